@@ -1,7 +1,7 @@
 #pragma once
 #include "types.h"
+#include "l0_sampling/hash_families.h"
 #include <vector>
-#include <xxhash.h>
 
 namespace Bucket_Boruvka {
 /**
@@ -34,6 +34,18 @@ inline static vec_hash_t index_hash(const vec_t &index, long seed);
 inline static bool contains(const col_hash_t &col_index_hash,
                             const vec_t &guess_nonzero);
 
+/**
+ * Computes the depth of an index within a column, i.e. the number of guesses
+ * of the column which contain the index. Guess j contains the index iff the
+ * column hash is 0 mod 2^(j+1), so the depth is the number of trailing zeros
+ * of the column hash.
+ * @param col_index_hash The return value to Bucket::col_index_hash
+ * @param max_depth      The number of guesses in the column.
+ * @return the number of guesses containing the index, at most max_depth.
+ */
+inline static unsigned get_index_depth(const col_hash_t &col_index_hash,
+                                       const unsigned max_depth);
+
 /**
  * Checks whether a Bucket is good, assuming the Bucket contains all elements.
  * @param a The bucket's a value.
@@ -49,17 +61,18 @@ inline static bool is_good(const vec_t &a, const vec_hash_t &c,
  * @param a The bucket's a value.
  * @param c The bucket's c value.
  * @param bucket_col This Bucket's column index.
- * @param guess_nonzero The guess of nonzero elements in the vector being
- * sketched.
+ * @param guess_idx This Bucket's guess index within its column. The guess of
+ * nonzero elements in the vector being sketched is 2^(guess_idx+1).
  * @param sketch_seed The seed of the Sketch this Bucket belongs to.
  * @return true if this Bucket is good, else false.
  */
 inline static bool is_good(const vec_t &a, const vec_hash_t &c,
                            const unsigned bucket_col,
-                           const vec_t &guess_nonzero, const long &sketch_seed);
+                           const unsigned guess_idx, const long &sketch_seed);
 
 /**
- * Updates a Bucket with the given update index
+ * Updates a Bucket with the given update index. Not thread-safe, so only for
+ * Buckets private to the calling thread, e.g. those of a delta being built.
  * @param a The bucket's a value. Modified by this function.
  * @param c The bucket's c value. Modified by this function.
  * @param update_idx The update index
@@ -68,21 +81,30 @@ inline static bool is_good(const vec_t &a, const vec_hash_t &c,
  */
 inline static void update(vec_t &a, vec_hash_t &c, const vec_t &update_idx,
                           const vec_hash_t &update_hash);
+
+/**
+ * Atomically updates a Bucket with the given update index. Used for Buckets
+ * of shared sketches which may be updated by several threads at once.
+ * @param a The bucket's a value. Modified by this function.
+ * @param c The bucket's c value. Modified by this function.
+ * @param update_idx The update index
+ * @param update_hash The hash of the update index, generated with
+ * Bucket::index_hash.
+ */
+inline static void atomic_update(vec_t &a, vec_hash_t &c,
+                                 const vec_t &update_idx,
+                                 const vec_hash_t &update_hash);
 } // namespace Bucket_Boruvka
 
 inline col_hash_t Bucket_Boruvka::col_index_hash(const unsigned bucket_col,
                                                  const vec_t &update_idx,
                                                  const long sketch_seed) {
-  struct {
-    unsigned bucket_col;
-    vec_t update_idx;
-  } __attribute__((packed)) buf = {bucket_col, update_idx};
-  return col_hash(&buf, sizeof(buf), sketch_seed);
+  return HashFamily::col_index_hash(bucket_col, update_idx, sketch_seed);
 }
 
 inline vec_hash_t Bucket_Boruvka::index_hash(const vec_t &index,
                                              long sketch_seed) {
-  return vec_hash(&index, sizeof(index), sketch_seed);
+  return HashFamily::index_hash(index, sketch_seed);
 }
 
 inline bool Bucket_Boruvka::contains(const col_hash_t &col_index_hash,
@@ -90,6 +112,13 @@ inline bool Bucket_Boruvka::contains(const col_hash_t &col_index_hash,
   return col_index_hash % guess_nonzero == 0;
 }
 
+inline unsigned Bucket_Boruvka::get_index_depth(const col_hash_t &col_index_hash,
+                                                const unsigned max_depth) {
+  if (col_index_hash == 0) return max_depth;
+  unsigned depth = __builtin_ctzll(col_index_hash);
+  return depth < max_depth ? depth : max_depth;
+}
+
 inline bool Bucket_Boruvka::is_good(const vec_t &a, const vec_hash_t &c,
                                     const long &sketch_seed) {
   return c == index_hash(a, sketch_seed);
@@ -97,17 +126,23 @@ inline bool Bucket_Boruvka::is_good(const vec_t &a, const vec_hash_t &c,
 
 inline bool Bucket_Boruvka::is_good(const vec_t &a, const vec_hash_t &c,
                                     const unsigned bucket_col,
-                                    const vec_t &guess_nonzero,
+                                    const unsigned guess_idx,
                                     const long &sketch_seed) {
   return c == index_hash(a, sketch_seed) &&
-         contains(col_index_hash(bucket_col, a, sketch_seed), guess_nonzero);
+         guess_idx < get_index_depth(col_index_hash(bucket_col, a, sketch_seed),
+                                     guess_idx + 1);
 }
 
 inline void Bucket_Boruvka::update(vec_t &a, vec_hash_t &c,
                                    const vec_t &update_idx,
                                    const vec_hash_t &update_hash) {
+  a ^= update_idx;
+  c ^= update_hash;
+}
+
+inline void Bucket_Boruvka::atomic_update(vec_t &a, vec_hash_t &c,
+                                          const vec_t &update_idx,
+                                          const vec_hash_t &update_hash) {
   __atomic_xor_fetch(&a, update_idx, __ATOMIC_RELAXED);
   __atomic_xor_fetch(&c, update_hash, __ATOMIC_RELAXED);
-  // a ^= update_idx;
-  // c ^= update_hash;
 }
@@ -1,43 +1,108 @@
 #pragma once
-#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <memory>
 
+/**
+ * A lock-free union-find over the elements 0 to n-1, so that finds and
+ * unions may be run from many threads at once. It links by rank, breaking
+ * ties by index, and compresses paths by path splitting, both without
+ * recursion.
+ *
+ * The rank of an element is kept in the same word as its parent, so that
+ * linking a root checks in one compare-and-swap that it is still a root of
+ * the rank it was ordered by. Ranks only grow while an element is a root, so
+ * every parent is greater than its child in (rank, index) order and two
+ * concurrent links can never form a cycle.
+ */
 template <class T>
 class DisjointSetUnion {
-  std::vector<T> parent;
-  std::vector<T> size;
+  static constexpr int rank_shift = 56;
+  static constexpr uint64_t parent_mask = (uint64_t(1) << rank_shift) - 1;
+
+  std::unique_ptr<std::atomic<uint64_t>[]> words;
+  T num_elems = 0;
+
+  static inline uint64_t word(T parent, uint64_t rank) {
+    return rank << rank_shift | (uint64_t) parent;
+  }
+  static inline T parent_of(uint64_t w) { return (T) (w & parent_mask); }
+  static inline uint64_t rank_of(uint64_t w) { return w >> rank_shift; }
+
 public:
-  DisjointSetUnion();
+  DisjointSetUnion() = default;
   DisjointSetUnion(T n);
 
-  void link(T i, T j);
+  /**
+   * Link two roots, placing the one lower in (rank, index) order under the
+   * other. Fails if either stopped being a root in the meantime.
+   * @return true if i and j were linked.
+   */
+  bool link(T i, T j);
+
+  // return the root of the set of i
   T find_set(T i);
-  void union_set(T i, T j);
-};
 
-template <class T>
-DisjointSetUnion<T>::DisjointSetUnion() {}
+  /**
+   * Merge the sets of i and j.
+   * @return true if they were different sets, false if they already were one.
+   */
+  bool union_set(T i, T j);
+
+  // make i a set of its own again. Not safe to call concurrently with the set of i
+  inline void reset(T i) { words[i].store(word(i, 0), std::memory_order_relaxed); }
+
+  inline T size() const { return num_elems; }
+};
 
 template <class T>
-DisjointSetUnion<T>::DisjointSetUnion(T n) : parent(n), size(n, 1) {
+DisjointSetUnion<T>::DisjointSetUnion(T n) : words(new std::atomic<uint64_t>[n]), num_elems(n) {
   for (T i = 0; i < n; i++) {
-    parent[i] = i;
+    reset(i);
   }
 }
 
 template <class T>
-void DisjointSetUnion<T>::link(T i, T j) {
-  if (size[i] < size[j]) std::swap(i,j);
-  parent[j] = i;
-  size[i] += size[j];
+bool DisjointSetUnion<T>::link(T i, T j) {
+  uint64_t wi = words[i].load(std::memory_order_acquire);
+  uint64_t wj = words[j].load(std::memory_order_acquire);
+  if (i == j || parent_of(wi) != i || parent_of(wj) != j) return false;
+  uint64_t ri = rank_of(wi), rj = rank_of(wj);
+  if (ri > rj || (ri == rj && i > j)) {
+    std::swap(i, j);
+    std::swap(wi, wj);
+    std::swap(ri, rj);
+  }
+  // i is now below j
+  if (!words[i].compare_exchange_strong(wi, word(j, ri), std::memory_order_acq_rel))
+    return false;
+  // a failure means j was linked or ranked up itself, which keeps j above i
+  if (ri == rj)
+    words[j].compare_exchange_strong(wj, word(j, rj + 1), std::memory_order_acq_rel);
+  return true;
 }
 
 template <class T>
 T DisjointSetUnion<T>::find_set(T i) {
-  if (parent[i] == i) return i;
-  return parent[i] = find_set(parent[i]);
+  while (true) {
+    uint64_t wi = words[i].load(std::memory_order_acquire);
+    T p = parent_of(wi);
+    if (p == i) return i;
+    uint64_t wp = words[p].load(std::memory_order_acquire);
+    T grand = parent_of(wp);
+    // path splitting: point i at its grandparent and continue from its parent
+    if (grand != p)
+      words[i].compare_exchange_weak(wi, word(grand, rank_of(wi)), std::memory_order_acq_rel);
+    i = p;
+  }
 }
 
 template <class T>
-void DisjointSetUnion<T>::union_set(T i, T j) {
-  link(find_set(i), find_set(j));
+bool DisjointSetUnion<T>::union_set(T i, T j) {
+  while (true) {
+    i = find_set(i);
+    j = find_set(j);
+    if (i == j) return false;
+    if (link(i, j)) return true;
+  }
 }
@@ -4,9 +4,18 @@
 #include <set>
 #include <fstream>
 #include <atomic>  // REMOVE LATER
+#include <condition_variable>
+#include <future>
+#include <mutex>
 
 #include <buffering_system.h>
+#include "dsu.h"
+#include "graph_dump.h"
+#include "node_bitmap.h"
 #include "supernode.h"
+#include "supernode_arena.h"
+#include "supernode_snapshot.h"
+#include "graph_worker.h"
 
 #ifdef VERIFY_SAMPLES_F
 #include "test/graph_verifier.h"
@@ -19,6 +28,24 @@ class GraphWorker;
 
 typedef pair<Edge, UpdateType> GraphUpdate;
 
+/**
+ * The connected components of a graph as one label per node, which is far
+ * cheaper to build and hold for large graphs than a set per component.
+ */
+struct ComponentLabels {
+  // labels[i] is the component of node i, from 0 to num_components - 1
+  vector<node_id_t> labels;
+  node_id_t num_components = 0;
+  // sizes[c] is the number of nodes in component c
+  vector<node_id_t> sizes;
+
+  // return the nodes of each component, indexed by label
+  vector<set<node_id_t>> to_sets() const;
+
+  // return (size, number of components of that size) for each size, in order
+  vector<std::pair<node_id_t, node_id_t>> size_histogram() const;
+};
+
 /**
  * Undirected graph object with n nodes labelled 0 to n-1, no self-edges,
  * multiple edges, or weights.
@@ -27,23 +54,137 @@ class Graph {
   node_id_t num_nodes;
   long seed;
   bool update_locked = false;
-  // a set containing one "representative" from each supernode
-  set<node_id_t>* representatives;
-  Supernode** supernodes;
+  // numbers the graphs made in this process, from 0
+  static std::atomic<int> num_graphs;
+  int id;
+  // the sizes of the supernodes and the geometry of their sketches
+  SupernodeGeometry* geometry;
+  // the supernodes, addressed by node id
+  SupernodeArena* supernodes;
   // DSU representation of supernode relationship
-  node_id_t * parent;
-  node_id_t get_parent(node_id_t node);
+  DisjointSetUnion<node_id_t> dsu;
+  // the edges Boruvka joined the components of the dsu with
+  vector<Edge> forest;
+
+  // The ranges of nodes, each with a buffering system for batching updates
+  std::vector<NodePartition> partitions;
+  // the GraphWorkers which apply the buffered updates
+  GraphWorkers *workers = nullptr;
+  // the number of workers, their threads and the NUMA partitions of the nodes
+  WorkerConfig worker_config;
+
+  // return the partition which holds node
+  inline NodePartition &partition_of(node_id_t node) {
+    for (auto &partition : partitions)
+      if (node < partition.end) return partition;
+    return partitions.back();
+  }
+
+  // split the nodes into partitions, placing their supernodes
+  void partition_nodes();
+  // create the buffering system of each partition and start the GraphWorkers
+  void start_buffering(bool use_guttertree, const std::string &prefix);
+
+  // the snapshot which an asynchronous query reads, if one is running
+  std::atomic<SupernodeSnapshot*> snapshot{nullptr};
+  // the number of workers saving supernodes to the snapshot
+  std::atomic<int> snapshot_users{0};
+  // queries share the dsu, so they run one at a time
+  std::mutex query_mt;
+  std::condition_variable query_done;
+  bool query_running = false;
+  // the number of supernodes the workers saved to the last query's snapshot
+  std::atomic<node_id_t> last_query_saved{0};
+
+  // wait for the running query to finish and start another
+  void begin_query();
+  void end_query();
+
+  // flush the buffering systems and wait for the workers to apply every update
+  void flush_and_pause();
+  // a bit per node, set when the node is updated after a query started
+  NodeBitmap dirty;
+  // a bit per node, set when the node is updated after a checkpoint started
+  NodeBitmap changed;
+
+  // the checkpoint log which the next checkpoint appends to, and the end of
+  // its last complete segment
+  string checkpoint_file;
+  uint64_t checkpoint_end = 0;
+
+  /**
+   * Split the components with a dirty node back into single nodes in the
+   * dsu and drop their forest edges, keeping the other components of the
+   * last query, and clear the dirty bits. The workers must be paused.
+   * @return the nodes of the components which were split.
+   */
+  vector<node_id_t> take_dirty_components();
 
-  // Buffering system for batching updates
-  BufferingSystem *bf;
+  // call f with the ith supernode, as of the snapshot if a query is taking one
+  template <class F>
+  void read_supernode(node_id_t i, F f);
 
-  Supernode** backup_supernodes();
-  void restore_supernodes(Supernode** supernodes);
+  // stop saving supernodes to the snapshot and delete it
+  void release_snapshot();
+
+  /**
+   * Write the supernodes, as of the snapshot, to a checkpoint log.
+   * @param filename  the checkpoint log.
+   * @param base      true to start the log over with every supernode,
+   *                  otherwise a segment of the given nodes is appended.
+   * @param nodes     the nodes of the segment.
+   */
+  void write_checkpoint(const string &filename, bool base, const vector<node_id_t> &nodes);
+
+  /**
+   * Run Boruvka rounds until the dsu holds the connected components, adding
+   * the edges which join them to the forest.
+   * @param in_place  true to merge into and use up the supernodes, otherwise
+   *                  they are left intact and only supernodes which absorb
+   *                  others are copied, so that the graph can be updated and
+   *                  queried again.
+   * @param reps      the nodes to find the components of, each a set of its
+   *                  own in the dsu.
+   */
+  void boruvka_emulation(bool in_place, vector<node_id_t> reps);
+  // label the nodes by the root of their set in the dsu
+  ComponentLabels label_components();
+
+  /**
+   * Find the connected components, as connected_component_labels(cont).
+   * @param forest_out  (Optional) where to copy the spanning forest.
+   */
+  ComponentLabels run_query(bool cont, vector<Edge> *forest_out);
+
+  /**
+   * Merge every tree of a Boruvka round into its root, in parallel. The
+   * supernodes of a tree are merged pairwise in log(size) levels, so that a
+   * root which absorbs many supernodes does not merge them all on one thread.
+   * @param absorbed  (root, supernode) for every supernode which is absorbed,
+   *                  sorted by root.
+   * @param scratch   nullptr to merge in place, otherwise the scratch copies of
+   *                  the supernodes of a non-destructive query, by node id.
+   * @param round     the Boruvka round, whose sketches are no longer merged
+   *                  into scratch copies.
+   */
+  void merge_trees(const vector<std::pair<node_id_t, node_id_t>> &absorbed,
+                   Supernode **scratch, int round);
 
   FRIEND_TEST(GraphTestSuite, TestCorrectnessOfReheating);
-  static bool open_graph;
+  FRIEND_TEST(GraphTest, TestDumpFormat);
+  FRIEND_TEST(GraphTest, TestWorkerConfigPerGraph);
+  FRIEND_TEST(GraphTest, TestOutOfCoreSupernodes);
 public:
   explicit Graph(node_id_t num_nodes);
+
+  /**
+   * Reheat a graph from a file written by write_binary or a checkpoint log
+   * written by checkpoint_async, replaying every complete segment of the log.
+   * @param input_file  the file to read.
+   * @throws CorruptDumpException if the file fails its checksums.
+   * @throws DumpVersionException if the file is of an unknown version.
+   * @throws HashFamilyException if it was written with another sketch hash family.
+   */
   explicit Graph(const string &input_file);
 
   ~Graph();
@@ -53,10 +194,29 @@ public:
    * Update all the sketches in supernode, given a batch of updates.
    * @param src        The supernode where the edges originate.
    * @param edges      A vector of <destination, delta> pairs.
-   * @param delta_loc  Memory location where we should initialize the delta
-   *                   supernode.
+   * @param delta_loc  A delta supernode made by make_delta_node. It is rebuilt
+   *                   from the batch and left empty afterwards.
+   * @param pool       (Optional) thread pool used to build the delta.
+   */
+  void batch_update(node_id_t src, const vector<node_id_t> &edges, Supernode *delta_loc,
+                    ThreadPool *pool = nullptr);
+
+  /**
+   * Main parallel algorithm utilizing Boruvka and L_0 sampling.
+   * @return the component label of every node in the graph.
    */
-  void batch_update(node_id_t src, const vector<node_id_t> &edges, Supernode *delta_loc);
+  ComponentLabels connected_component_labels();
+
+  /**
+   * Main parallel algorithm utilizing Boruvka and L_0 sampling.
+   * If cont is true, allow for additional updates when done. The supernodes
+   * are then only read, and only those which absorb others are copied, so
+   * the query needs memory in proportion to its merges rather than a copy of
+   * every supernode.
+   * @param cont
+   * @return the component label of every node in the graph.
+   */
+  ComponentLabels connected_component_labels(bool cont);
 
   /**
    * Main parallel algorithm utilizing Boruvka and L_0 sampling.
@@ -64,6 +224,19 @@ public:
    */
   vector<set<node_id_t>> connected_components();
 
+  /**
+   * Run the connected components algorithm on a snapshot of the graph while
+   * it keeps taking updates. The updates made before the call are flushed and
+   * applied, then the GraphWorkers resume at once, saving each supernode they
+   * change to the snapshot first. Queries run one at a time.
+   * @return a future of the component label of every node in the graph, as
+   *         of the call.
+   */
+  std::future<ComponentLabels> connected_component_labels_async();
+
+  // the number of supernodes saved to the snapshot of the last asynchronous query
+  inline node_id_t get_last_query_saved() const { return last_query_saved; }
+
   /**
    * Main parallel algorithm utilizing Boruvka and L_0 sampling.
    * If cont is true, allow for additional updates when done.
@@ -72,6 +245,25 @@ public:
    */
   vector<set<node_id_t>> connected_components(bool cont);
 
+  /**
+   * Find a spanning forest of the graph from the edges Boruvka merges the
+   * supernodes along, which has the same connected components as the graph
+   * and at most n-1 edges.
+   * If cont is true, allow for additional updates when done.
+   * @param cont
+   * @return the edges of the forest.
+   */
+  vector<Edge> spanning_forest(bool cont = false);
+
+  /**
+   * Write a spanning forest of the graph to a binary graph stream of its
+   * edge insertions, which BinaryGraphStream can read.
+   * @param filename  the name of the file to (over)write the forest to.
+   * @param cont      if true, allow for additional updates when done.
+   * @throws GraphFileException if the file could not be written.
+   */
+  void write_spanning_forest(const string &filename, bool cont = false);
+
 #ifdef VERIFY_SAMPLES_F
   std::unique_ptr<GraphVerifier> verifier;
   void set_verifier(std::unique_ptr<GraphVerifier> verifier) {
@@ -82,6 +274,18 @@ public:
   // temp to verify number of updates -- REMOVE later
   std::atomic<uint64_t> num_updates;
 
+  /**
+   * Make an empty delta supernode for batch_update, which can be reused for
+   * every batch of the calling thread.
+   * @param loc  the memory location to put the delta, of
+   *             get_delta_size() bytes.
+   * @return     a pointer to loc, the location of the delta.
+   */
+  Supernode *make_delta_node(void *loc);
+
+  // return the size of a delta supernode of this graph
+  inline uint32_t get_delta_size() const { return geometry->delta_bytes_size; }
+
   /**
    * Generate a delta node for the purposes of updating a node sketch
    * (supernode).
@@ -90,22 +294,44 @@ public:
    * @param src        the src id.
    * @param edges      a list of node ids to which src is connected.
    * @param delta_loc  the preallocated memory where the delta_node should be
-   *                   placed. this allows memory to be reused by the same
-   *                   calling thread.
+   *                   placed, of Supernode::get_delta_size() bytes.
+   * @param pool       (Optional) thread pool used to build the delta.
    * @returns nothing (supernode delta is in delta_loc).
    */
   static void generate_delta_node(node_id_t node_n, long node_seed, node_id_t src,
-                                  const vector<node_id_t> &edges, Supernode *delta_loc);
+                                  const vector<node_id_t> &edges, Supernode *delta_loc,
+                                  ThreadPool *pool = nullptr);
 
   /**
-   * Serialize the graph data to a binary file.
+   * Serialize the graph data to a binary file, in the format of GraphDump.
+   * Waits for any asynchronous query or checkpoint, and the graph takes
+   * updates again once the file is written.
    * @param filename the name of the file to (over)write data to.
    */
   void write_binary(const string &filename);
 
+  /**
+   * Write a checkpoint of the graph while it keeps taking updates. The first
+   * checkpoint to a file writes every supernode, as write_binary does, and
+   * each later one appends a segment of only the supernodes updated since the
+   * checkpoint before it. Graph(filename) replays the whole log. As for an
+   * asynchronous query, the updates made before the call are flushed and the
+   * supernodes are written from a snapshot, and checkpoints and queries run
+   * one at a time.
+   * @param filename  the checkpoint log to start or append to.
+   * @return a future which is ready once the checkpoint is written.
+   */
+  std::future<void> checkpoint_async(const string &filename);
+
   std::chrono::steady_clock::time_point end_time;
 };
 
+class CheckpointException : public exception {
+  virtual const char* what() const throw() {
+    return "Could not write the checkpoint log";
+  }
+};
+
 class UpdateLockedException : public exception {
   virtual const char* what() const throw() {
     return "The graph cannot be updated: Connected components algorithm has "
@@ -113,9 +339,4 @@ class UpdateLockedException : public exception {
   }
 };
 
-class MultipleGraphsException : public exception {
-  virtual const char * what() const throw() {
-    return "Only one Graph may be open at one time. The other Graph must be deleted.";
-  }
-};
 
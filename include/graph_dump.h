@@ -0,0 +1,197 @@
+#pragma once
+#include <exception>
+#include <functional>
+#include <string>
+#include <vector>
+#include <graph_zeppelin_common.h>
+
+#include "supernode.h"
+
+/**
+ * The file format of the dumps written by Graph::write_binary and of
+ * checkpoint logs.
+ *
+ * A dump starts with a DumpHeader and then holds a block for each supernode,
+ * in no particular order, followed by an index with the DumpEntry of each
+ * supernode and the checksum of the index. The header is written last and
+ * holds its own checksum, so a dump cut short fails to open.
+ *
+ * A block is the sketches of its supernode, each encoded as a bitmap of its
+ * nonzero buckets followed by the a and then the c of every nonzero bucket.
+ * Few buckets below the first levels of a column are ever nonzero, so this is
+ * several times smaller than the buckets themselves.
+ *
+ * A checkpoint log is a dump followed by segments, each a uint64 count of
+ * its records and then the records, each a DumpRecord followed by a block.
+ * The count is written last, so a segment cut short reads as the end of the
+ * log.
+ *
+ * The dumps of version 1, a seed, number of nodes and failure factor
+ * followed by the raw buckets of every supernode, are still read. They were
+ * all hashed with xxh32.
+ */
+class GraphDump {
+public:
+  static constexpr uint64_t magic = 0x504d55444b535a47; // "GZSKDUMP"
+  static constexpr uint32_t version = 2;
+
+  struct DumpHeader {
+    uint64_t magic;
+    uint32_t version;
+    int32_t fail_factor;
+    int64_t seed;
+    uint64_t num_nodes;
+    uint64_t index_offset; // where the index starts
+    char hash_family[16];  // the name of the sketch hash family, padded with NULs
+    uint64_t checksum;     // of the fields above
+  };
+
+  struct DumpEntry {
+    uint64_t offset;   // where the block of the supernode starts
+    uint32_t bytes;    // the size of the block
+    uint32_t checksum; // of the block
+  };
+
+  struct DumpRecord {
+    node_id_t node;
+    uint32_t bytes;
+    uint32_t checksum;
+  };
+
+  // writes the ith supernode, as Supernode::write_binary does, to its second argument
+  typedef std::function<void(node_id_t, char *)> SupernodeWriter;
+
+private:
+  int fd;
+  uint32_t file_version;
+  long seed;
+  SupernodeGeometry geometry;
+  std::vector<DumpEntry> index;
+  uint64_t end; // the end of the last complete segment
+
+  // read the header and index of a dump of version 1
+  void open_version_1(uint64_t file_size);
+
+  // read the header and index of a dump
+  void open_dump(uint64_t file_size);
+
+  // point the index at the records of the segments which follow the dump
+  void scan_segments(uint64_t file_size);
+
+  // read the block of entry into buf, which has room for entry.bytes
+  void read_block(const DumpEntry &entry, char *buf) const;
+
+public:
+  /**
+   * Open a dump or checkpoint log, and read its header and index.
+   * @param filename  the file to read.
+   * @throws GraphFileException if the file could not be read.
+   * @throws DumpVersionException if the dump is of an unknown version.
+   * @throws HashFamilyException if the dump was hashed with another hash family.
+   * @throws CorruptDumpException if the header or index does not match its checksum.
+   */
+  explicit GraphDump(const std::string &filename);
+  ~GraphDump();
+
+  GraphDump(const GraphDump &) = delete;
+  GraphDump &operator=(const GraphDump &) = delete;
+
+  inline uint32_t get_version() const { return file_version; }
+  inline long get_seed() const { return seed; }
+  inline node_id_t get_num_nodes() const { return geometry.n; }
+  inline int get_fail_factor() const { return geometry.sketch.failure_factor; }
+
+  // the geometry of the supernodes of the dump
+  inline const SupernodeGeometry &get_geometry() const { return geometry; }
+
+  // the end of the dump, or of the last complete segment of a checkpoint log
+  inline uint64_t get_end() const { return end; }
+
+  /**
+   * Read a single supernode, as of the last segment which holds it, without
+   * reading the rest of the file.
+   * @param i         the supernode to read.
+   * @param loc       the memory to put it in, of geometry.bytes_size bytes.
+   * @param geometry  (Optional) the geometry to make it with, which must have
+   *                  the sizes of the dump's, by default the dump's own.
+   * @throws CorruptDumpException if its block does not match its checksum.
+   */
+  Supernode *read_supernode(node_id_t i, void *loc);
+  Supernode *read_supernode(node_id_t i, void *loc, const SupernodeGeometry &geometry);
+
+  /**
+   * Read every supernode, in large chunks by many threads at once.
+   * @param geometry  the geometry to make them with, as for read_supernode.
+   * @param slot      the memory to put the ith supernode in.
+   * @throws CorruptDumpException if a block does not match its checksum.
+   */
+  void read_supernodes(const SupernodeGeometry &geometry,
+                       const std::function<void *(node_id_t)> &slot);
+
+  /**
+   * Write a dump of the supernodes of a graph, in large chunks by many
+   * threads at once.
+   * @param filename  the file to (over)write, replaced only once the dump is synced.
+   * @param seed      the seed of the graph.
+   * @param geometry  the geometry of its supernodes.
+   * @param serialize writes the ith supernode.
+   * @return the size of the dump.
+   * @throws GraphFileException if the file could not be written.
+   */
+  static uint64_t write(const std::string &filename, long seed, const SupernodeGeometry &geometry,
+                        const SupernodeWriter &serialize);
+
+  /**
+   * Append a segment to a checkpoint log, first dropping anything after the
+   * last complete segment.
+   * @param filename  the checkpoint log.
+   * @param end       the end of its last complete segment.
+   * @param geometry  the geometry of its supernodes.
+   * @param nodes     the supernodes of the segment.
+   * @param serialize writes the ith supernode.
+   * @return the end of the new segment.
+   * @throws GraphFileException if the file could not be written.
+   */
+  static uint64_t append_segment(const std::string &filename, uint64_t end,
+                                 const SupernodeGeometry &geometry,
+                                 const std::vector<node_id_t> &nodes, const SupernodeWriter &serialize);
+
+  // the most bytes the block of a supernode of geometry can take
+  static size_t max_block_bytes(const SupernodeGeometry &geometry);
+
+  /**
+   * Encode a supernode as a block.
+   * @param raw  the supernode as written by Supernode::write_binary.
+   * @param out  the block, with room for max_block_bytes.
+   * @return the size of the block.
+   */
+  static size_t encode(const SupernodeGeometry &geometry, const char *raw, char *out);
+
+  // decode a block of bytes bytes into the supernode as written by write_binary
+  static bool decode(const SupernodeGeometry &geometry, const char *block, size_t bytes,
+                     char *raw);
+};
+
+class GraphFileException : public std::exception {
+  virtual const char* what() const throw() {
+    return "Could not read or write the graph file";
+  }
+};
+
+class DumpVersionException : public std::exception {
+  virtual const char* what() const throw() {
+    return "The graph dump is of an unknown version";
+  }
+};
+
+class HashFamilyException : public std::exception {
+  virtual const char* what() const throw() {
+    return "The graph dump was written with another sketch hash family";
+  }
+};
+
+class CorruptDumpException : public std::exception {
+  virtual const char* what() const throw() {
+    return "The graph dump is corrupt";
+  }
+};
@@ -1,47 +1,140 @@
 #pragma once
+#include <map>
+#include <memory>
 #include <mutex>
 #include <condition_variable>
 #include <thread>
+#include <vector>
 #include <buffering_system.h>
+#include "thread_pool.h"
 
 // forward declarations
 class Graph;
 class Supernode;
 
-class GraphWorker {
+/**
+ * A range of node ids whose updates are buffered by their own buffering
+ * system and applied by their own GraphWorkers, so that with NUMA placement
+ * the supernodes of the range and the workers updating them share a NUMA
+ * node. The buffering system is indexed by node id - begin.
+ */
+struct NodePartition {
+  node_id_t begin;
+  node_id_t end;
+  BufferingSystem *bf;
+  int numa_node; // the NUMA node the range is placed on, or -1 if unplaced
+};
+
+class GraphWorker;
+
+/**
+ * The number of GraphWorkers of one graph, the threads of each and the NUMA
+ * partitions of its nodes. A graph takes them from the configuration of
+ * GraphWorker when it is made, so configuring a later graph leaves it alone.
+ */
+struct WorkerConfig {
+  int num_groups;
+  int group_size;
+  int num_partitions;
+};
+
+/**
+ * The GraphWorkers of one graph and the state they share, so that each graph
+ * in a process starts, pauses and stops its own workers.
+ *
+ * The helper threads which build deltas alongside the workers are not the
+ * graph's own: every graph alive in the process borrows the same pool of
+ * helpers for each NUMA node, so another graph adds workers but no helpers.
+ */
+class GraphWorkers {
 public:
   /**
-   * start_workers creates the graph workers and sets them to query the
-   * given buffering system.
+   * Create the graph workers and set them to query the buffering systems of
+   * the given partitions. GraphWorker i serves partition i % partitions.size().
    * @param _graph           the graph to update.
-   * @param _bf              the buffering system to query.
-   * @param _supernode_size  the size of a supernode so that we can allocate
-   *                         space for a delta_node.
+   * @param _partitions      the partitions of the nodes of the graph.
+   * @param _supernode_size  the size of a delta supernode so that we can
+   *                         allocate space for a delta_node.
+   * @param config           the number of workers and their threads.
+   */
+  GraphWorkers(Graph *_graph, const std::vector<NodePartition> &_partitions,
+               long _supernode_size, const WorkerConfig &config);
+  ~GraphWorkers(); // shutdown and delete the GraphWorkers
+
+  GraphWorkers(const GraphWorkers &) = delete;
+  GraphWorkers &operator=(const GraphWorkers &) = delete;
+
+  void pause_workers();   // pause the GraphWorkers before CC
+  void unpause_workers(); // unpause the GraphWorkers to resume updates
+
+  // return the number of GraphWorkers
+  int get_num_workers() const { return (int) workers.size(); }
+
+  // return the number of helper threads, shared with other graphs, on a NUMA node or -1
+  int get_num_helpers(int numa_node) const { return pools.at(numa_node)->get_num_threads(); }
+
+private:
+  friend class GraphWorker;
+
+  // thread status and status management
+  bool shutdown = false;
+  bool paused = false;
+  uint64_t unpause_epoch = 0; // counts the calls to unpause_workers()
+  std::condition_variable pause_condition;
+  std::mutex pause_lock;
+
+  int group_size;
+  long supernode_size;
+
+  // the helper pool of each NUMA node the workers are placed on, or -1
+  std::map<int, std::shared_ptr<ThreadPool>> pools;
+
+  /**
+   * Borrow the helper pool of a NUMA node, creating it if no graph holds it
+   * and growing it if it has fewer helpers than asked for, so that it has as
+   * many as the largest graph borrowing it wants. The pool lives until the
+   * last graph borrowing it is destroyed.
+   * @param numa_node    the NUMA node to pin the helpers to, or -1.
+   * @param num_threads  the number of helpers the pool should have.
    */
-  static void start_workers(Graph *_graph, BufferingSystem *_bf, long _supernode_size);
-  static void stop_workers();    // shutdown and delete GraphWorkers
-  static void pause_workers();   // pause the GraphWorkers before CC
-  static void unpause_workers(); // unpause the GraphWorkers to resume updates
+  static std::shared_ptr<ThreadPool> borrow_pool(int numa_node, int num_threads);
+  static std::mutex shared_pools_lock;
+  static std::map<int, std::weak_ptr<ThreadPool>> shared_pools;
 
+  // list of all GraphWorkers
+  std::vector<GraphWorker *> workers;
+  // the partitions they serve
+  std::vector<NodePartition> partitions;
+};
 
+class GraphWorker {
+public:
   /**
    * Returns whether the current thread is paused.
    */
   bool get_thr_paused() {return thr_paused;}
 
   // manage configuration
-  // configuration should be set before calling start_workers
+  // configuration should be set before creating a graph, which keeps a copy
+  static WorkerConfig get_config() { return {num_groups, group_size, num_partitions}; }
   static int get_num_groups() {return num_groups;} // return the number of GraphWorkers
   static int get_group_size() {return group_size;} // return the number of threads in each worker
   static void set_config(int g, int s) { num_groups = g; group_size = s; }
+  // the number of NUMA partitions of the nodes, or 0 to place nothing
+  static int get_num_partitions() {return num_partitions;}
+  static void set_num_partitions(int p) { num_partitions = p; }
 private:
+  friend class GraphWorkers;
+
   /**
    * Create a GraphWorker object by setting metadata and spinning up a thread.
-   * @param _id     the id of the new GraphWorker.
-   * @param _graph  the graph which this GraphWorker will be updating.
-   * @param _bf     the database data will be extracted from.
+   * @param _id         the id of the new GraphWorker.
+   * @param _owner      the GraphWorkers this GraphWorker belongs to.
+   * @param _graph      the graph which this GraphWorker will be updating.
+   * @param _partition  the nodes this GraphWorker updates and the database
+   *                    their data will be extracted from.
    */
-  GraphWorker(int _id, Graph *_graph, BufferingSystem *_bf);
+  GraphWorker(int _id, GraphWorkers *_owner, Graph *_graph, const NodePartition &_partition);
   ~GraphWorker();
 
   /**
@@ -56,25 +149,24 @@ private:
 
   void do_work(); // function which runs the GraphWorker process
   int id;
+  GraphWorkers *owner;
   Graph *graph;
   BufferingSystem *bf;
+  node_id_t node_offset; // the id of the first node of this worker's partition
+  int numa_node;         // the NUMA node to pin this worker to, or -1
   std::thread thr;
   bool thr_paused; // indicates if this individual thread is paused
 
-  // thread status and status management
-  static bool shutdown;
-  static bool paused;
-  static std::condition_variable pause_condition;
-  static std::mutex pause_lock;
+  // helper threads which, together with thr and the workers of every graph
+  // on the same NUMA node, build the deltas of this worker
+  ThreadPool *pool;
 
   // configuration
   static int num_groups;
   static int group_size;
-  static long supernode_size;
-
-  // list of all GraphWorkers
-  static GraphWorker **workers;
+  static int num_partitions;
 
-  // the supernode object this GraphWorker will use for generating deltas
-  Supernode *delta_node;
+  // the supernode object this GraphWorker will use for generating deltas,
+  // made by its thread so that it is placed on its NUMA node
+  Supernode *delta_node = nullptr;
 };
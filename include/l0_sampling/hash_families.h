@@ -0,0 +1,171 @@
+#pragma once
+#include <cstdint>
+#include <xxhash.h>
+#include "../types.h"
+
+/*
+ * The hash families the buckets of a sketch can be built with. Each provides
+ * the two 32 bit hashes behind Bucket_Boruvka: index_hash, the checksum of an
+ * update index, and col_index_hash, whose trailing zeros give the depth of an
+ * index within a column. The family is chosen at compile time by defining one
+ * of SKETCH_HASH_XXH3, SKETCH_HASH_MULTIPLY_SHIFT, SKETCH_HASH_TABULATION or
+ * SKETCH_HASH_FUSED (see CMakeLists.txt); XXH32 is used otherwise.
+ */
+namespace Bucket_Boruvka {
+
+// A 64 bit finalizer (splitmix64) used to expand seeds into hash keys.
+inline static constexpr uint64_t mix_seed(uint64_t x) {
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+// The key of a column hash. Distinct for every (seed, column) pair of the
+// sketches of a supernode, whose seeds are consecutive.
+inline static constexpr uint64_t col_seed(unsigned bucket_col, long sketch_seed) {
+  return (uint64_t) sketch_seed + (bucket_col + 1ULL) * 0x9E3779B97F4A7C15ULL;
+}
+
+struct XXH32Hash {
+  static const char *name() { return "xxh32"; }
+
+  inline static vec_hash_t index_hash(const vec_t &index, long sketch_seed) {
+    return XXH32(&index, sizeof(index), sketch_seed);
+  }
+
+  inline static col_hash_t col_index_hash(const unsigned bucket_col,
+                                          const vec_t &update_idx,
+                                          const long sketch_seed) {
+    struct {
+      unsigned bucket_col;
+      vec_t update_idx;
+    } __attribute__((packed)) buf = {bucket_col, update_idx};
+    return XXH32(&buf, sizeof(buf), sketch_seed);
+  }
+};
+
+// XXH3 produces 64 bits, the index hash takes the low half of the hash of the
+// index and the column hash the high half of the hash of {column, index}.
+struct XXH3Hash {
+  static const char *name() { return "xxh3"; }
+
+  inline static vec_hash_t index_hash(const vec_t &index, long sketch_seed) {
+    return (vec_hash_t) XXH3_64bits_withSeed(&index, sizeof(index), sketch_seed);
+  }
+
+  inline static col_hash_t col_index_hash(const unsigned bucket_col,
+                                          const vec_t &update_idx,
+                                          const long sketch_seed) {
+    struct {
+      unsigned bucket_col;
+      vec_t update_idx;
+    } __attribute__((packed)) buf = {bucket_col, update_idx};
+    return (col_hash_t) (XXH3_64bits_withSeed(&buf, sizeof(buf), sketch_seed) >> 32);
+  }
+};
+
+// Dietzfelbinger's multiply-add-shift: h(x) = ((a x + b) mod 2^96) >> 64 for
+// 96 bit a and b, which are expanded from the key with mix_seed. The keys of
+// the sketches of a graph are fixed, so the expansion is hoisted out of loops.
+struct MultiplyShiftHash {
+  static const char *name() { return "multiply_shift"; }
+
+  inline static uint32_t hash(uint64_t x, uint64_t key) {
+    uint64_t a_lo = mix_seed(key);
+    uint64_t a_hi = mix_seed(a_lo);
+    uint64_t b = mix_seed(a_hi);
+    unsigned __int128 h = (unsigned __int128) a_lo * x
+                          + ((unsigned __int128) (a_hi * x) << 64)
+                          + ((unsigned __int128) b << 32);
+    return (uint32_t) (h >> 64);
+  }
+
+  inline static vec_hash_t index_hash(const vec_t &index, long sketch_seed) {
+    return hash(index, sketch_seed);
+  }
+
+  inline static col_hash_t col_index_hash(const unsigned bucket_col,
+                                          const vec_t &update_idx,
+                                          const long sketch_seed) {
+    return hash(update_idx, col_seed(bucket_col, sketch_seed));
+  }
+};
+
+// Simple tabulation over the 8 bytes of the index. The tables are fixed (see
+// hash_families.cpp) so the seed is mixed into the index before the lookups,
+// which leaves the hashes of different seeds related: h_s(x) = h_t(y) whenever
+// x ^ y == mix_seed(s) ^ mix_seed(t).
+struct TabulationHash {
+  struct Tables {
+    uint32_t index[8][256];
+    uint32_t col[8][256];
+  };
+  static const Tables tables;
+
+  static const char *name() { return "tabulation"; }
+
+  inline static uint32_t hash(const uint32_t (&table)[8][256], uint64_t x) {
+    uint32_t h = 0;
+    for (int i = 0; i < 8; ++i)
+      h ^= table[i][(x >> (8 * i)) & 0xFF];
+    return h;
+  }
+
+  inline static vec_hash_t index_hash(const vec_t &index, long sketch_seed) {
+    return hash(tables.index, index ^ mix_seed(sketch_seed));
+  }
+
+  inline static col_hash_t col_index_hash(const unsigned bucket_col,
+                                          const vec_t &update_idx,
+                                          const long sketch_seed) {
+    return hash(tables.col, update_idx ^ mix_seed(col_seed(bucket_col, sketch_seed)));
+  }
+};
+
+// The hashes of every sketch are derived from one wide hash of the index:
+// h_k(x) = (wide(x) * k mod 2^64) >> 32, multiply-shift over the wide hash
+// with a random odd key k per seed and column. A run of sketches can then hash
+// an update once and pay one multiply per column of each sketch, see
+// Sketch::batch_update_run.
+struct FusedHash {
+  static const char *name() { return "fused"; }
+
+  // a bijection, so distinct indices never share a wide hash
+  inline static uint64_t wide(const vec_t &index) { return mix_seed(index); }
+
+  inline static uint64_t index_key(long sketch_seed) {
+    return mix_seed(sketch_seed) | 1;
+  }
+
+  inline static uint64_t col_key(unsigned bucket_col, long sketch_seed) {
+    return mix_seed(col_seed(bucket_col, sketch_seed)) | 1;
+  }
+
+  inline static uint32_t derive(uint64_t wide_hash, uint64_t key) {
+    return (uint32_t) ((wide_hash * key) >> 32);
+  }
+
+  inline static vec_hash_t index_hash(const vec_t &index, long sketch_seed) {
+    return derive(wide(index), index_key(sketch_seed));
+  }
+
+  inline static col_hash_t col_index_hash(const unsigned bucket_col,
+                                          const vec_t &update_idx,
+                                          const long sketch_seed) {
+    return derive(wide(update_idx), col_key(bucket_col, sketch_seed));
+  }
+};
+
+#if defined(SKETCH_HASH_XXH3)
+typedef XXH3Hash HashFamily;
+#elif defined(SKETCH_HASH_MULTIPLY_SHIFT)
+typedef MultiplyShiftHash HashFamily;
+#elif defined(SKETCH_HASH_TABULATION)
+typedef TabulationHash HashFamily;
+#elif defined(SKETCH_HASH_FUSED)
+typedef FusedHash HashFamily;
+#else
+typedef XXH32Hash HashFamily;
+#endif
+} // namespace Bucket_Boruvka
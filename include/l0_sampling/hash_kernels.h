@@ -0,0 +1,41 @@
+#pragma once
+#include <cstddef>
+#include "../types.h"
+
+/*
+ * Batched versions of Bucket_Boruvka::index_hash and
+ * Bucket_Boruvka::col_index_hash. These hash many update indices at once in
+ * the lanes of the widest vector unit the CPU supports (AVX-512, AVX2 or
+ * scalar, chosen at runtime) and produce exactly the same values as the
+ * scalar functions, so sketches built with either are identical. The vector
+ * kernels implement XXH32, other hash families are hashed one index at a time.
+ */
+namespace Bucket_Boruvka {
+/**
+ * Hashes a batch of update indices. Equivalent to calling index_hash on each.
+ * @param update_idx   The update indices to hash.
+ * @param num_updates  The number of update indices.
+ * @param sketch_seed  The seed of the Sketch the Buckets belong to.
+ * @param hashes       Output array of num_updates hashes.
+ */
+void index_hash_batch(const vec_t *update_idx, size_t num_updates,
+                      long sketch_seed, vec_hash_t *hashes);
+
+/**
+ * Hashes a batch of update indices together with a column index.
+ * Equivalent to calling col_index_hash on each.
+ * @param bucket_col   Column index of the buckets.
+ * @param update_idx   The update indices to hash.
+ * @param num_updates  The number of update indices.
+ * @param sketch_seed  The seed of the Sketch the Buckets belong to.
+ * @param hashes       Output array of num_updates hashes.
+ */
+void col_index_hash_batch(unsigned bucket_col, const vec_t *update_idx,
+                          size_t num_updates, long sketch_seed,
+                          col_hash_t *hashes);
+
+/**
+ * @return the name of the hashing kernel selected for this CPU.
+ */
+const char *hash_kernel_name();
+} // namespace Bucket_Boruvka
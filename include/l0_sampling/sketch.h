@@ -21,6 +21,57 @@ enum SampleSketchRet {
   FAIL   // querying this sketch failed to produce a single non-zero value
 };
 
+/**
+ * A single bucket update recorded by a sparse delta instead of being applied.
+ * Every bucket an update lands in is XORed with the same (a, c) pair.
+ */
+struct BucketTouch {
+  uint16_t sketch;  // index of the sketch within its supernode
+  uint16_t bucket;  // index of the bucket within the sketch
+  vec_hash_t c;     // value to XOR into bucket_c
+  vec_t a;          // value to XOR into bucket_a
+};
+
+struct SketchKernels; // see sketch.cpp
+
+/**
+ * The shape of the sketches of a vector of length n. Every sketch points to
+ * the geometry it was made with, so sketches of different vector lengths,
+ * such as those of two graphs of different sizes, can be used side by side.
+ * A geometry must outlive its sketches.
+ */
+struct SketchGeometry {
+  vec_t n;             // Length of the vector this is sketching.
+  int failure_factor;  // Failure factor determines number of columns in sketch. Pr(failure) = 1 / factor
+  size_t num_buckets;  // Portion of array length, number of buckets
+  size_t num_guesses;  // Portion of array length, number of guesses
+  size_t num_elems;    // length of our actual arrays in number of elements
+
+  // The operations which loop over the buckets, instantiated for this
+  // geometry when there is a compile time one that matches it.
+  const SketchKernels *kernels;
+
+  /**
+   * @param n               Length of the vector to sketch.
+   * @param failure_factor  The rate at which an individual sketch is allowed to fail (determines column width)
+   */
+  SketchGeometry(vec_t n, int failure_factor);
+
+  /**
+   * Select the kernels for this geometry.
+   * @param allow_fixed  if false always select the generic kernels.
+   */
+  void select_kernels(bool allow_fixed = true);
+
+  // rounded up so that the sketches packed in a supernode stay aligned
+  size_t sketch_sizeof() const;
+
+  // the bucket_a and bucket_c arrays are laid out back to back in this many bytes
+  inline size_t bucket_bytes() const {
+    return num_elems * (sizeof(vec_t) + sizeof(vec_hash_t));
+  }
+};
+
 /**
  * An implementation of a "sketch" as defined in the L0 algorithm.
  * Note a sketch may only be queried once. Attempting to query multiple times will
@@ -28,14 +79,12 @@ enum SampleSketchRet {
  */
 class Sketch {
 private:
-  static int failure_factor;       // Failure factor determines number of columns in sketch. Pr(failure) = 1 / factor
-  static vec_t n;                  // Length of the vector this is sketching.
-  static size_t num_elems;         // length of our actual arrays in number of elements
-  static size_t num_buckets;       // Portion of array length, number of buckets
-  static size_t num_guesses;       // Portion of array length, number of guesses
+  // the geometry of the sketches made without one, set by configure()
+  static SketchGeometry default_geometry;
 
   // Seed used for hashing operations in this sketch.
   const long seed;
+  const SketchGeometry *geometry;
   // pointers to buckets
   vec_t*      bucket_a;
   vec_hash_t* bucket_c;
@@ -44,18 +93,32 @@ private:
   bool already_quered = false;
 
   FRIEND_TEST(SketchTestSuite, TestExceptions);
+  FRIEND_TEST(SketchTestSuite, TestFixedGeometry);
+  FRIEND_TEST(EXPR_Sketch, FixedGeometry);
   FRIEND_TEST(EXPR_Parallelism, N10kU100k);
 
+  template <class Geometry> friend struct SketchKernel;
+
+  /**
+   * Select the kernels for the default geometry.
+   * @param allow_fixed  if false always select the generic kernels.
+   */
+  static void select_kernels(bool allow_fixed = true) {
+    default_geometry.select_kernels(allow_fixed);
+  }
+
   
   // Buckets of this sketch.
   // Length is bucket_gen(failure_factor) * guess_gen(n).
   // For buckets[i * guess_gen(n) + j], the bucket has a 1/2^j probability
   // of containing an index. The first two are pointers into the buckets array.
-  char buckets[1];
+  // Aligned so that atomic updates to bucket_a never straddle a cache line.
+  alignas(vec_t) char buckets[1];
 
   // private constructors -- use makeSketch
-  Sketch(long seed);
-  Sketch(long seed, std::fstream &binary_in);
+  Sketch(const SketchGeometry &geometry, long seed);
+  Sketch(const SketchGeometry &geometry, long seed, std::fstream &binary_in);
+  Sketch(const SketchGeometry &geometry, long seed, const char *binary_in);
   Sketch(const Sketch& s);
 
 public:
@@ -69,6 +132,18 @@ public:
    */
   static Sketch* makeSketch(void* loc, long seed);
   static Sketch* makeSketch(void* loc, long seed, std::fstream &binary_in);
+
+  /**
+   * Construct a sketch of the given geometry rather than the default one.
+   * @param loc       A pointer to sketch_sizeof() bytes of the geometry.
+   * @param geometry  The geometry of the sketch, which must outlive it.
+   */
+  static Sketch* makeSketch(void* loc, const SketchGeometry &geometry, long seed);
+  static Sketch* makeSketch(void* loc, const SketchGeometry &geometry, long seed,
+                            std::fstream &binary_in);
+  // read the sketch from geometry.bucket_bytes() bytes written by write_binary
+  static Sketch* makeSketch(void* loc, const SketchGeometry &geometry, long seed,
+                            const char *binary_in);
   
   /**
    * Copy constructor to create a sketch from another
@@ -78,42 +153,133 @@ public:
    */
   static Sketch* makeSketch(void* loc, const Sketch& s);
   
-  /* configure the static variables of sketches
-   * @param n               Length of the vector to sketch. (static variable)
+  /* configure the default geometry of sketches
+   * @param n               Length of the vector to sketch.
    * @param failure_factor  The rate at which an individual sketch is allowed to fail (determines column width)
    * @return nothing
    */
   inline static void configure(size_t _n, int _factor) {
-    n = _n;
-    failure_factor = _factor;
-    num_buckets = bucket_gen(failure_factor);
-    num_guesses = guess_gen(n);
-    num_elems = num_buckets * num_guesses + 1;
+    default_geometry = SketchGeometry(_n, _factor);
   }
 
-  inline static size_t sketchSizeof()
-  { return sizeof(Sketch) + num_elems * (sizeof(vec_t) + sizeof(vec_hash_t)) - sizeof(char); }
+  inline static const SketchGeometry &get_default_geometry() { return default_geometry; }
+
+  // rounded up so that the sketches packed in a supernode stay aligned
+  inline static size_t sketchSizeof() { return default_geometry.sketch_sizeof(); }
   
+  // the bucket_a and bucket_c arrays are laid out back to back in this many bytes
+  inline static size_t bucket_bytes() { return default_geometry.bucket_bytes(); }
+
+  inline static size_t get_num_elems() { return default_geometry.num_elems; }
+  inline static size_t get_num_buckets() { return default_geometry.num_buckets; }
+  inline static size_t get_num_guesses() { return default_geometry.num_guesses; }
+
+  // return the name of the kernels selected for the default geometry
+  static const char *get_kernel_name();
+
   inline static int get_failure_factor() 
-  { return failure_factor; }
+  { return default_geometry.failure_factor; }
+
+  // return the geometry of this sketch
+  inline const SketchGeometry &get_geometry() const { return *geometry; }
   /**
    * Update a sketch based on information about one of its indices.
+   * Thread-safe: buckets are updated atomically so several threads may update
+   * the same sketch at once.
    * @param update the point update.
    */
   void update(const vec_t& update_idx);
 
   /**
    * Update a sketch given a batch of updates.
+   * Not thread-safe: the sketch must only be visible to the calling thread,
+   * as is the case for a delta sketch under construction.
    * @param updates A vector of updates
    */
   void batch_update(const std::vector<vec_t>& updates);
 
+  /**
+   * Update a sketch given a contiguous range of updates. See batch_update.
+   * @param updates      A pointer to the first update
+   * @param num_updates  The number of updates in the range
+   */
+  void batch_update(const vec_t* updates, size_t num_updates);
+
+  /**
+   * Record the bucket updates a range of updates would make to a sketch with
+   * the given seed, without applying them.
+   * @param seed         the seed of the sketch.
+   * @param sketch_idx   the sketch index stored in each touch.
+   * @param updates      a pointer to the first update.
+   * @param num_updates  the number of updates in the range.
+   * @param touches      output array of at most max_touches touches.
+   * @param max_touches  the capacity of touches.
+   * @param geometry     (Optional) the geometry of the sketch.
+   * @return the number of touches written, or max_touches + 1 if they did not
+   *         all fit.
+   */
+  static size_t collect_touches(long seed, uint16_t sketch_idx, const vec_t *updates,
+                                size_t num_updates, BucketTouch *touches,
+                                size_t max_touches,
+                                const SketchGeometry &geometry = default_geometry);
+
+  /**
+   * Update a run of sketches given a contiguous range of updates, as if by
+   * calling batch_update on each. Not thread-safe. With the fused hash family
+   * each update is hashed once for the whole run.
+   * @param first         the first sketch of the run.
+   * @param num_sketches  the number of sketches in the run.
+   * @param stride        the distance in bytes between consecutive sketches.
+   * @param updates       a pointer to the first update.
+   * @param num_updates   the number of updates in the range.
+   * @param heights       (Optional) the column heights of the run, see below,
+   *                      raised to cover every bucket the updates land in.
+   */
+  static void batch_update_run(Sketch *first, size_t num_sketches, size_t stride,
+                               const vec_t *updates, size_t num_updates,
+                               uint8_t *heights = nullptr);
+
+  /**
+   * Record the bucket updates a range of updates would make to a run of
+   * sketches with seeds seed, seed + 1, ..., as if by calling collect_touches
+   * for each with its index in the run.
+   * @param seed          the seed of the first sketch of the run.
+   * @param num_sketches  the number of sketches in the run.
+   * @param updates       a pointer to the first update.
+   * @param num_updates   the number of updates in the range.
+   * @param touches       output array of at most max_touches touches.
+   * @param max_touches   the capacity of touches.
+   * @param geometry      (Optional) the geometry of the sketches.
+   * @return the number of touches written, or max_touches + 1 if they did not
+   *         all fit.
+   */
+  static size_t collect_run_touches(long seed, size_t num_sketches,
+                                    const vec_t *updates, size_t num_updates,
+                                    BucketTouch *touches, size_t max_touches,
+                                    const SketchGeometry &geometry = default_geometry);
+
+  /**
+   * Apply a touch collected by collect_touches. Not thread-safe.
+   * @param touch  the bucket update to apply.
+   */
+  inline void apply_touch(const BucketTouch &touch) {
+    Bucket_Boruvka::update(bucket_a[touch.bucket], bucket_c[touch.bucket],
+                           touch.a, touch.c);
+  }
+
   /**
    * Function to query a sketch.
    * @return   A pair with the result index and a code indicating if the type of result.
    */
   std::pair<vec_t, SampleSketchRet> query();
 
+  /**
+   * Query a sketch without marking it as queried, for queries which leave
+   * the sketch to be updated and queried again.
+   * @return   A pair with the result index and a code indicating if the type of result.
+   */
+  std::pair<vec_t, SampleSketchRet> peek_query() const;
+
   /**
    * Operator to add a sketch to another one in-place. Guaranteed to be
    * thread-safe for the sketch being added to. It is up to the user to
@@ -126,11 +292,53 @@ public:
   friend bool operator== (const Sketch &sketch1, const Sketch &sketch2);
   friend std::ostream& operator<< (std::ostream &os, const Sketch &sketch);
 
+  /**
+   * Add a run of sketches to another run in-place, as if by dst[i] += src[i]
+   * for each i, in a single vectorized pass over all of their buckets.
+   * @param dst           the first sketch being added to.
+   * @param src           the first sketch being added.
+   * @param num_sketches  the number of sketches in each run.
+   * @param stride        the distance in bytes between consecutive sketches
+   *                      of a run, e.g. sketchSizeof() when they are packed.
+   */
+  static void add_sketches(Sketch *dst, const Sketch *src, size_t num_sketches,
+                           size_t stride);
+
+  /*
+   * An index lands in a prefix of the guesses of every column, so the buckets
+   * a run of sketches built from empty by batch_update_run can have dirtied
+   * are the deterministic bucket of each sketch and the first heights[s *
+   * num_buckets + i] guesses of column i of sketch s. The functions below only
+   * visit those buckets, which lets a delta be applied and reset for the next
+   * batch without a pass over all of its buckets.
+   */
+
+  /**
+   * Add a run of sketches to another run in-place as add_sketches does, when
+   * only the buckets within the column heights of src may be non-zero, and
+   * zero those buckets of src and its heights in the same pass so that src is
+   * left empty.
+   * @param heights  the column heights of src.
+   */
+  static void add_and_clear_sketches(Sketch *dst, Sketch *src,
+                                     size_t num_sketches, size_t stride,
+                                     uint8_t *heights);
+
+  /**
+   * Zero the buckets within the column heights of a run of sketches and the
+   * heights themselves, leaving the run empty.
+   */
+  static void clear_sketches(Sketch *run, size_t num_sketches, size_t stride,
+                             uint8_t *heights);
+
   /**
    * Serialize the sketch to a binary output stream.
    * @param out the stream to write to.
    */
-  void write_binary(std::fstream& binary_out);
+  void write_binary(std::fstream& binary_out) const;
+
+  // serialize the sketch to the geometry's bucket_bytes() bytes at binary_out
+  void write_binary(char *binary_out) const;
 };
 
 class MultipleQueryException : public std::exception {
@@ -0,0 +1,40 @@
+#pragma once
+#include <cstddef>
+
+/*
+ * XOR kernels used to add sketches together. Adding sketches is an XOR of
+ * their buckets, and the buckets of the sketches in a supernode are packed a
+ * fixed stride apart, so a whole supernode is added in one call that walks
+ * every sketch's buckets with the widest vector unit the CPU supports
+ * (AVX-512, AVX2 or scalar, chosen at runtime).
+ */
+namespace Bucket_Boruvka {
+/**
+ * XORs num_rows rows of src into the matching rows of dst. Row i of each
+ * starts i * stride bytes after the given pointer.
+ * @param dst        The first row to XOR into.
+ * @param src        The first row to XOR from. May not overlap dst.
+ * @param num_rows   The number of rows.
+ * @param row_bytes  The length of each row in bytes.
+ * @param stride     The distance in bytes between consecutive rows.
+ */
+void xor_rows(char *dst, const char *src, size_t num_rows, size_t row_bytes,
+              size_t stride);
+
+/**
+ * XORs num_rows rows of src into the matching rows of dst as xor_rows does,
+ * and zeroes those rows of src in the same pass.
+ * @param dst        The first row to XOR into.
+ * @param src        The first row to XOR from and clear. May not overlap dst.
+ * @param num_rows   The number of rows.
+ * @param row_bytes  The length of each row in bytes.
+ * @param stride     The distance in bytes between consecutive rows.
+ */
+void xor_and_clear_rows(char *dst, char *src, size_t num_rows, size_t row_bytes,
+                        size_t stride);
+
+/**
+ * @return the name of the XOR kernel selected for this CPU.
+ */
+const char *xor_kernel_name();
+} // namespace Bucket_Boruvka
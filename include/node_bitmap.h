@@ -0,0 +1,44 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+/**
+ * A bit per node which many threads may set at once, to track the nodes
+ * which were updated since some point.
+ */
+class NodeBitmap {
+  std::unique_ptr<std::atomic<uint64_t>[]> words;
+  uint64_t num_words = 0;
+
+public:
+  NodeBitmap() = default;
+
+  /**
+   * @param n    the number of nodes.
+   * @param set  the value of every bit.
+   */
+  explicit NodeBitmap(uint64_t n, bool set = false) :
+      words(new std::atomic<uint64_t>[(n + 63) / 64]), num_words((n + 63) / 64) {
+    for (uint64_t w = 0; w < num_words; ++w)
+      words[w].store(set ? ~uint64_t(0) : 0, std::memory_order_relaxed);
+  }
+
+  inline bool test(uint64_t i) const {
+    return words[i / 64].load(std::memory_order_relaxed) >> (i % 64) & 1;
+  }
+
+  // set the bit of i. Thread-safe
+  inline void set(uint64_t i) {
+    uint64_t bit = uint64_t(1) << (i % 64);
+    // most batches land on nodes which are set already, so skip their write
+    if (!(words[i / 64].load(std::memory_order_relaxed) & bit))
+      words[i / 64].fetch_or(bit, std::memory_order_relaxed);
+  }
+
+  // clear every bit. Not safe to call concurrently with set
+  inline void clear() {
+    for (uint64_t w = 0; w < num_words; ++w)
+      words[w].store(0, std::memory_order_relaxed);
+  }
+};
@@ -0,0 +1,44 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+
+/**
+ * The NUMA nodes of the machine and the CPUs local to each, as listed under
+ * /sys/devices/system/node. On machines without NUMA (or without that
+ * directory) every CPU is reported as local to a single node 0.
+ * Placement uses the raw mbind and sched_setaffinity system calls so that
+ * libnuma is not required.
+ */
+class NumaTopology {
+  std::vector<std::vector<int>> node_cpus; // node_cpus[i] lists the CPUs of node i
+  std::vector<int> node_ids;               // the kernel's id of node i
+
+  NumaTopology();
+  static const NumaTopology &get();
+
+public:
+  // return the number of NUMA nodes which have CPUs, numbered from 0 here
+  static int num_nodes();
+
+  // return the CPUs local to the given node
+  static const std::vector<int> &cpus(int node);
+
+  /**
+   * Restrict the calling thread to the CPUs of a NUMA node.
+   * @return true if the affinity could be set.
+   */
+  static bool pin_thread(int node);
+
+  /**
+   * Ask that the pages of a region are placed on a NUMA node when they are
+   * first touched. The node is preferred, not required, so that placement
+   * falls back to other nodes rather than failing when it is full. Only the
+   * pages wholly inside the region are bound, so that a page shared with a
+   * neighbouring region is left to first touch.
+   * @param addr  the start of the region.
+   * @param len   the length of the region in bytes.
+   * @param node  the NUMA node to place the region on.
+   * @return true if the policy could be set.
+   */
+  static bool bind_memory(void *addr, size_t len, int node);
+};
@@ -5,27 +5,57 @@
 #include <graph_zeppelin_common.h>
 
 #include "l0_sampling/sketch.h"
+#include "thread_pool.h"
 
 using namespace std;
 
 typedef std::pair<node_id_t, node_id_t> Edge;
 
+/**
+ * The sizes of the supernodes of a graph of n nodes and of their deltas, and
+ * the geometry of their sketches. Every supernode points to the geometry it
+ * was made with, so graphs of different sizes can be kept in one process. A
+ * geometry must outlive its supernodes.
+ */
+struct SupernodeGeometry {
+  uint64_t n;             // the total number of nodes in the graph
+  SketchGeometry sketch;  // the geometry of the sketches, of vectors of length n*n
+  // the size of a super-node in bytes including the all sketches off the end
+  uint32_t bytes_size;
+  // the size of a delta super-node, which also holds column heights and touches
+  uint32_t delta_bytes_size;
+  // the size of a super-node in a dump, its sketches' buckets back to back
+  uint64_t binary_size;
+
+  SupernodeGeometry(uint64_t n, int sketch_fail_factor = 100);
+};
+
 /**
  * This interface implements the "supernode" so Boruvka can use it as a black
  * box without needing to worry about implementing l_0.
  */
 class Supernode {
-  // the size of a super-node in bytes including the all sketches off the end
-  static uint32_t bytes_size; 
+  // the geometry of the supernodes made without one, set by configure()
+  static SupernodeGeometry default_geometry;
   int idx;
   int num_sketches;
-  std::mutex node_mt;
+  const SupernodeGeometry *geometry;
 
   FRIEND_TEST(SupernodeTestSuite, TestBatchUpdate);
   FRIEND_TEST(SupernodeTestSuite, TestConcurrency);
+  FRIEND_TEST(SupernodeTestSuite, TestPooledBatchUpdate);
+  FRIEND_TEST(EXPR_Supernode, DeltaOverhead);
+  FRIEND_TEST(SupernodeTestSuite, TestSparseDelta);
+  FRIEND_TEST(EXPR_Supernode, SparseDelta);
+  FRIEND_TEST(SupernodeTestSuite, TestReusableDelta);
+  FRIEND_TEST(SupernodeTestSuite, TestHubContention);
+  FRIEND_TEST(SupernodeTestSuite, TestArena);
+  FRIEND_TEST(SupernodeTestSuite, TestMergeBandwidth);
   FRIEND_TEST(SupernodeTestSuite, TestSerialization);
+  FRIEND_TEST(SupernodeTestSuite, TestSnapshot);
   FRIEND_TEST(GraphTestSuite, TestCorrectnessOfReheating);
   FRIEND_TEST(EXPR_Parallelism, N10kU100k);
+  friend struct SupernodeGeometry;
 
 public:
   const uint64_t n; // for creating a copy
@@ -34,23 +64,33 @@ public:
 private:
   size_t sketch_size;
 
+  // Deltas of small batches are sparse: they hold num_touches BucketTouches
+  // after the sketches instead of updating them. See delta_supernode.
+  bool sparse = false;
+  size_t num_touches = 0;
+
   /* collection of logn sketches to query from, since we can't query from one
      sketch more than once */
   // The sketches, off the end.
   alignas(Sketch) char sketch_buffer[1];
   
   /**
-   * @param n     the total number of nodes in the graph.
-   * @param seed  the (fixed) seed value passed to each supernode.
+   * @param geometry  the geometry of the supernode.
+   * @param n         the total number of nodes in the graph.
+   * @param seed      the (fixed) seed value passed to each supernode.
    */
-  Supernode(uint64_t n, long seed);
+  Supernode(const SupernodeGeometry &geometry, uint64_t n, long seed);
 
   /**
+   * @param geometry  the geometry of the supernode.
    * @param n         the total number of nodes in the graph.
    * @param seed      the (fixed) seed value passed to each supernode.
    * @param binary_in A stream to read the file from.
    */
-  Supernode(uint64_t n, long seed, std::fstream &binary_in);
+  Supernode(const SupernodeGeometry &geometry, uint64_t n, long seed,
+            std::fstream &binary_in);
+  Supernode(const SupernodeGeometry &geometry, uint64_t n, long seed,
+            const char *binary_in);
 
   // get the ith sketch in the sketch array
   inline Sketch* get_sketch(size_t i) {
@@ -62,6 +102,64 @@ private:
     return reinterpret_cast<const Sketch*>(sketch_buffer + i * sketch_size);
   }
 
+  /**
+   * Construct an empty sparse delta. Its sketches are never built.
+   * @param geometry  the geometry of the delta.
+   * @param n         the total number of nodes in the graph.
+   * @param seed      the (fixed) seed value passed to each supernode.
+   * @param sparse    must be true.
+   */
+  Supernode(const SupernodeGeometry &geometry, uint64_t n, long seed, bool sparse);
+
+  /*
+   * A delta is laid out as a supernode followed by the column heights of its
+   * sketches (see Sketch::add_and_clear_sketches) and then the touches of a
+   * sparse delta, of which there is room for max_touches.
+   */
+  inline static size_t heights_bytes(const SketchGeometry &sketch, size_t num_sketches) {
+    size_t size = num_sketches * sketch.num_buckets;
+    return (size + alignof(BucketTouch) - 1) / alignof(BucketTouch) * alignof(BucketTouch);
+  }
+
+  inline static size_t max_touches(const SketchGeometry &sketch, size_t num_sketches) {
+    return num_sketches * sketch.num_elems / 4;
+  }
+
+  // get the column heights of a delta
+  inline uint8_t* get_heights() {
+    return reinterpret_cast<uint8_t*>(this) + geometry->bytes_size;
+  }
+
+  inline const uint8_t* get_heights() const {
+    return reinterpret_cast<const uint8_t*>(this) + geometry->bytes_size;
+  }
+
+  // get the touches of a sparse delta
+  inline BucketTouch* get_touches() {
+    return reinterpret_cast<BucketTouch*>(get_heights() +
+                                          heights_bytes(geometry->sketch, num_sketches));
+  }
+
+  inline const BucketTouch* get_touches() const {
+    return reinterpret_cast<const BucketTouch*>(get_heights() +
+                                                heights_bytes(geometry->sketch, num_sketches));
+  }
+
+  // apply the touches of a sparse delta, see apply_delta_update
+  void apply_touches(const BucketTouch *touches, size_t num_touches);
+
+  /**
+   * Record a batch sparsely if it fits in the touches of this delta.
+   * @return true if it did, otherwise the delta is left unchanged.
+   */
+  bool build_sparse_delta(const std::vector<vec_t>& updates);
+
+  /**
+   * Update the sketches of this delta, which must be empty outside of its
+   * column heights, with a batch.
+   */
+  void build_dense_delta(const std::vector<vec_t>& updates, ThreadPool *pool);
+
   Supernode(const Supernode& s);
 public:
   static Supernode* makeSupernode(uint64_t n, long seed);
@@ -75,19 +173,60 @@ public:
    * @return        a pointer to loc, the location of the supernode.
    */
   static Supernode* makeSupernode(void* loc, uint64_t n, long seed);
+  static Supernode* makeSupernode(void* loc, uint64_t n, long seed, std::fstream &binary_in);
   static Supernode* makeSupernode(const Supernode& s);
+  static Supernode* makeSupernode(void* loc, const Supernode& s);
+
+  /**
+   * Makes a supernode of the given geometry rather than the default one.
+   * @param loc       the memory location to put the supernode, of
+   *                  geometry.bytes_size bytes.
+   * @param geometry  the geometry of the supernode, which must outlive it.
+   * @param seed      the (fixed) seed value passed to each supernode.
+   * @return          a pointer to loc, the location of the supernode.
+   */
+  static Supernode* makeSupernode(void* loc, const SupernodeGeometry &geometry, long seed);
+  static Supernode* makeSupernode(void* loc, const SupernodeGeometry &geometry, long seed,
+                                  std::fstream &binary_in);
+  // read the supernode from geometry.binary_size bytes written by write_binary
+  static Supernode* makeSupernode(void* loc, const SupernodeGeometry &geometry, long seed,
+                                  const char *binary_in);
+
+  /**
+   * Makes an empty delta supernode at the provided location, which can be
+   * rebuilt with build_delta for each batch.
+   * @param loc     the memory location to put the delta, of get_delta_size()
+   *                bytes.
+   * @param n       the total number of nodes in the graph.
+   * @param seed    the (fixed) seed value passed to each supernode.
+   * @return        a pointer to loc, the location of the delta.
+   */
+  static Supernode* makeDeltaSupernode(void* loc, uint64_t n, long seed);
+  static Supernode* makeDeltaSupernode(void* loc, const SupernodeGeometry &geometry, long seed);
 
   ~Supernode();
 
+  // configure the default geometry of supernodes and their sketches
   static inline void configure(uint64_t n, int sketch_fail_factor=100) {
     Sketch::configure(n*n, sketch_fail_factor);
-    bytes_size = sizeof(Supernode) + log2(n)/(log2(3)-1) * Sketch::sketchSizeof() - sizeof(char);
+    default_geometry = SupernodeGeometry(n, sketch_fail_factor);
+  }
+
+  static inline const SupernodeGeometry &get_default_geometry() {
+    return default_geometry;
   }
 
   static inline uint32_t get_size() {
-    return bytes_size;
+    return default_geometry.bytes_size;
+  }
+
+  static inline uint32_t get_delta_size() {
+    return default_geometry.delta_bytes_size;
   }
 
+  // return the geometry of this supernode
+  inline const SupernodeGeometry &get_geometry() const { return *geometry; }
+
   /**
    * Function to sample an edge from the cut of a supernode.
    * @return   an edge in the cut, represented as an Edge with LHS <= RHS, 
@@ -96,11 +235,25 @@ public:
    */
   std::pair<Edge, SampleSketchRet> sample();
 
+  /**
+   * Sample an edge from the ith sketch without using the sketch up, so that
+   * the supernode is left as it was.
+   * @param i  the sketch to sample, which is i for the ith Boruvka round.
+   * @return   the sample, as for sample().
+   */
+  std::pair<Edge, SampleSketchRet> peek_sample(int i) const;
+
   /**
    * In-place merge function. Guaranteed to update the caller Supernode.
    */
   void merge(Supernode& other);
 
+  /**
+   * Merge only the sketches from the first on, the ones which rounds after a
+   * non-destructive sample of sketch first - 1 read.
+   */
+  void merge(const Supernode& other, int first);
+
   /**
    * Insert or delete an (encoded) edge into the supernode. Guaranteed to be
    * processed BEFORE Boruvka starts.
@@ -109,30 +262,57 @@ public:
 
   /**
    * Update all the sketches in a supernode, given a batch of updates.
+   * Thread-safe: deltas may be applied to the same supernode concurrently.
    * @param delta_node  a delta supernode created through calling
    *                    Supernode::delta_supernode.
    */
   void apply_delta_update(const Supernode* delta_node);
 
+  /**
+   * Update all the sketches in a supernode given a delta built with
+   * build_delta, and leave the delta empty for the next batch. Only the
+   * buckets the batch dirtied are visited.
+   * @param delta_node  a delta supernode created through calling
+   *                    Supernode::makeDeltaSupernode.
+   */
+  void apply_and_clear_delta(Supernode* delta_node);
+
+  /**
+   * Rebuild a delta supernode from a batch of updates, in place of the batch
+   * it held before. Resets only the buckets that batch dirtied, which
+   * apply_and_clear_delta has already done.
+   * @param updates the batch of updates to apply.
+   * @param pool    (Optional) the thread pool to split the work across.
+   */
+  void build_delta(const std::vector<vec_t>& updates, ThreadPool *pool = nullptr);
+
   /**
    * Create new delta supernode with given initial parmameters and batch of
-   * updates to apply.
+   * updates to apply. Small batches produce a sparse delta which lists the
+   * buckets the batch touches, so that building and applying it costs time
+   * proportional to the batch rather than to the size of a supernode.
    * @param n       see declared constructor.
    * @param seed    see declared constructor.
    * @param updates the batch of updates to apply.
-   * @param loc     the location to place the delta in
+   * @param loc     the location to place the delta in, of get_delta_size()
+   *                bytes.
+   * @param pool    (Optional) the thread pool to split the work across. If
+   *                null the delta is built on the calling thread.
    */
   static void delta_supernode(uint64_t n, long seed, const
-  std::vector<vec_t>& updates, void *loc);
+  std::vector<vec_t>& updates, void *loc, ThreadPool *pool = nullptr);
 
   /**
    * Serialize the supernode to a binary output stream.
    * @param out the stream to write to.
    */
-  void write_binary(fstream &binary_out);
+  void write_binary(fstream &binary_out) const;
+
+  // serialize the supernode to the geometry's binary_size bytes at binary_out
+  void write_binary(char *binary_out) const;
 
   // return the number of sketches held in this supernode
-  int get_num_sktch() { return num_sketches; };
+  int get_num_sktch() const { return num_sketches; };
 };
 
 
@@ -0,0 +1,159 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <string>
+#include <graph_zeppelin_common.h>
+
+#include "supernode.h"
+
+// The pages which back a SupernodeArena
+enum HugePages {
+  NO_HUGEPAGES,  // regular pages
+  TRANSPARENT,   // regular pages the kernel may promote to 2MB (madvise)
+  HUGEPAGES_2MB, // reserved 2MB hugepages (MAP_HUGETLB)
+  HUGEPAGES_1GB  // reserved 1GB hugepages (MAP_HUGETLB)
+};
+
+/**
+ * A single region of memory which holds every supernode of a graph, so that
+ * supernodes are addressed by index rather than allocated one by one. Each
+ * supernode gets a slot of its size in bytes rounded up to a cache line, so no
+ * two supernodes share a line. The region is mapped with mmap,
+ * optionally backed by hugepages to cut the TLB misses of scattered updates.
+ *
+ * Out of core, the region is instead a shared mapping of a file under the
+ * configured directory, so the supernodes may outgrow memory and the kernel
+ * pages them in and out as they are used.
+ */
+class SupernodeArena {
+  static HugePages huge_pages;
+  // whether arenas are kept out of core, in files starting with disk_prefix
+  static bool on_disk;
+  static std::string disk_prefix;
+  // start writing back dirty pages every this many batches (0 leaves it to the kernel)
+  static uint64_t writeback_interval;
+
+  char *base;
+  node_id_t num_slots;
+  size_t slot_size;
+  size_t map_bytes;
+  HugePages backing;
+  int fd = -1; // the file of an out of core arena
+  std::atomic<uint64_t> num_batches;
+
+  /**
+   * Map a region of at least bytes bytes with the given pages.
+   * @return true if it could be mapped, otherwise the arena is unchanged.
+   */
+  bool map(size_t bytes, HugePages pages);
+
+  // map a region of bytes bytes of a new file starting with disk_prefix
+  void map_file(size_t bytes);
+
+public:
+  /**
+   * Map an arena with room for num_slots supernodes of the given size. The
+   * supernodes must then be constructed in their slots, e.g. with
+   * Supernode::makeSupernode(arena->slot(i), n, seed).
+   * If the configured hugepages cannot be mapped (none are reserved) this
+   * and later arenas fall back to transparent hugepages.
+   * @param num_slots       the number of supernodes the arena holds.
+   * @param supernode_size  (Optional) the size of a supernode, by default
+   *                        that of the default geometry.
+   */
+  explicit SupernodeArena(node_id_t num_slots, uint32_t supernode_size = Supernode::get_size());
+  ~SupernodeArena();
+
+  SupernodeArena(const SupernodeArena &) = delete;
+  SupernodeArena &operator=(const SupernodeArena &) = delete;
+
+  // the memory in which the ith supernode is placed
+  inline void *slot(node_id_t i) { return base + i * slot_size; }
+
+  // get the ith supernode
+  inline Supernode *get(node_id_t i) {
+    return reinterpret_cast<Supernode *>(base + i * slot_size);
+  }
+
+  inline const Supernode *get(node_id_t i) const {
+    return reinterpret_cast<const Supernode *>(base + i * slot_size);
+  }
+
+  inline node_id_t get_num_slots() const { return num_slots; }
+  inline size_t get_slot_size() const { return slot_size; }
+
+  // return the pages this arena was actually mapped with
+  inline HugePages get_backing() const { return backing; }
+
+  // return the size of the pages this arena was mapped with
+  size_t get_page_size() const;
+
+  /**
+   * Return the first slot at or after slot i which starts a new page, or the
+   * number of slots if there is none. Ranges of slots split there share at
+   * most the page of the one slot which straddles it.
+   */
+  node_id_t page_boundary(node_id_t i) const;
+
+  /**
+   * Place the supernodes [begin, end) on a NUMA node when they are first
+   * touched. Only the pages wholly inside the range are placed, a page shared
+   * with the neighbouring ranges is left to whichever touches it first. Must
+   * be called before they are constructed.
+   */
+  void bind(node_id_t begin, node_id_t end, int numa_node);
+
+  // return true if this arena is backed by a file
+  inline bool is_on_disk() const { return fd != -1; }
+
+  /**
+   * Record that a batch was applied to the supernodes. Every
+   * writeback_interval batches an out of core arena starts writing back its
+   * dirty pages, so that they never pile up into a long stall when the
+   * kernel runs short of memory. Thread-safe.
+   */
+  inline void batch_done() {
+    if (fd != -1 && writeback_interval != 0 &&
+        ++num_batches % writeback_interval == 0)
+      write_back();
+  }
+
+  // start writing back the dirty pages of an out of core arena without waiting
+  void write_back();
+
+  /*
+   * Hint how the supernodes of an out of core arena are about to be read.
+   * Updates land on supernodes at random, so reading ahead of them wastes
+   * I/O, while a Boruvka round samples the supernodes in order.
+   */
+  void advise_random();
+  void advise_sequential();
+
+  // set the pages which back arenas made from now on
+  static void set_huge_pages(HugePages pages) { huge_pages = pages; }
+  static HugePages get_huge_pages() { return huge_pages; }
+
+  /**
+   * Keep the arenas made from now on in memory or out of core. The files are
+   * unlinked as soon as they are made, so they never outlive their arena.
+   * @param disk    true to keep arenas out of core.
+   * @param prefix  the prefix of their files (a directory must end with '/').
+   */
+  static void set_storage(bool disk, const std::string &prefix = "") {
+    on_disk = disk;
+    disk_prefix = prefix;
+  }
+  static bool get_on_disk() { return on_disk; }
+
+  static void set_writeback_interval(uint64_t batches) { writeback_interval = batches; }
+
+  // return a printable name for the given pages
+  static const char *huge_pages_name(HugePages pages);
+};
+
+class ArenaFileException : public std::exception {
+  virtual const char* what() const throw() {
+    return "Could not create the file of an out of core supernode arena";
+  }
+};
@@ -0,0 +1,71 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <graph_zeppelin_common.h>
+
+#include "supernode_arena.h"
+
+/**
+ * A copy-on-write snapshot of the supernodes of an arena, so that a query can
+ * read them as they were when the snapshot was taken while the GraphWorkers
+ * keep applying deltas to them. A supernode is copied only when it is first
+ * written after the snapshot, so the snapshot costs memory in proportion to
+ * the supernodes dirtied during the query.
+ *
+ * Each supernode has one atomic word holding the number of readers of its
+ * live copy and whether it has been saved. A reader counts itself in and
+ * reads the saved copy if there is one, otherwise the live supernode. A
+ * writer saves the supernode and then waits for the readers of the live
+ * supernode to leave before it changes it.
+ */
+class SupernodeSnapshot {
+  static constexpr uint32_t saving = 1u << 31; // a writer is copying the supernode
+  static constexpr uint32_t saved  = 1u << 30; // the copy is complete
+  static constexpr uint32_t ready  = 1u << 29; // the live supernode may be written
+  static constexpr uint32_t readers_mask = ready - 1;
+
+  SupernodeArena *live;
+  std::unique_ptr<std::atomic<uint32_t>[]> state;
+  std::unique_ptr<Supernode*[]> copies;
+  std::atomic<node_id_t> num_saved;
+
+public:
+  /**
+   * Take a snapshot of the supernodes of live. No supernode may be written
+   * while the snapshot is taken.
+   */
+  explicit SupernodeSnapshot(SupernodeArena *live);
+  ~SupernodeSnapshot();
+
+  SupernodeSnapshot(const SupernodeSnapshot &) = delete;
+  SupernodeSnapshot &operator=(const SupernodeSnapshot &) = delete;
+
+  /**
+   * Save the ith supernode before it is written. Must be called before every
+   * write to a supernode until the snapshot is deleted. Thread-safe.
+   */
+  inline void save(node_id_t i) {
+    if (state[i].load(std::memory_order_acquire) & ready) return;
+    save_slow(i);
+  }
+  void save_slow(node_id_t i);
+
+  /**
+   * Call f with the ith supernode as of the snapshot. Thread-safe.
+   * @param f  a function taking a const Supernode&, which must not keep it.
+   */
+  template <class F>
+  inline void read(node_id_t i, F f) {
+    uint32_t s = state[i].fetch_add(1, std::memory_order_acq_rel);
+    if (s & saved) {
+      state[i].fetch_sub(1, std::memory_order_release);
+      f(static_cast<const Supernode&>(*copies[i]));
+      return;
+    }
+    f(static_cast<const Supernode&>(*live->get(i)));
+    state[i].fetch_sub(1, std::memory_order_release);
+  }
+
+  // return the number of supernodes which were copied
+  inline node_id_t get_num_saved() const { return num_saved; }
+};
@@ -6,7 +6,7 @@
  * used in unit testing.
  */
 using SketchUniquePtr = std::unique_ptr<Sketch,std::function<void(Sketch*)>>;
-SketchUniquePtr makeSketch(long seed) {
+inline SketchUniquePtr makeSketch(long seed) {
   void* loc = malloc(Sketch::sketchSizeof());
   return {
     Sketch::makeSketch(loc, seed),
@@ -14,7 +14,7 @@ SketchUniquePtr makeSketch(long seed) {
   };
 }
 
-SketchUniquePtr makeSketch(long seed, std::fstream &binary_in) {
+inline SketchUniquePtr makeSketch(long seed, std::fstream &binary_in) {
   void* loc = malloc(Sketch::sketchSizeof());
   return {
     Sketch::makeSketch(loc, seed, binary_in),
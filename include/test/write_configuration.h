@@ -1,6 +1,7 @@
 #include <fstream>
 
-static void write_configuration(bool use_tree, int groups=1, int g_size=1) {
+static void write_configuration(bool use_tree, int groups=1, int g_size=1, bool on_disk=false,
+                                int numa_partitions=0) {
 	// read previous configuration to get GutterTree prefix
 	// as this is system dependent and shouldn't be set by our code
 	std::ifstream in("streaming.conf");
@@ -22,5 +23,7 @@ static void write_configuration(bool use_tree, int groups=1, int g_size=1) {
 	out << "path_prefix=" << path_prefix << std::endl;
 	out << "num_groups=" << groups << std::endl;
 	out << "group_size=" << g_size << std::endl;
+	out << "supernode_storage=" << (on_disk? "disk" : "memory") << std::endl;
+	out << "numa=" << numa_partitions << std::endl;
 	out.close();
 }
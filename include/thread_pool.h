@@ -0,0 +1,75 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A persistent pool of threads used to split a batch of work into tasks
+ * without creating and joining threads for every batch.
+ * The thread that calls parallel_for works on its own tasks alongside the
+ * pool, so a pool of size 0 simply runs every task on the caller.
+ */
+class ThreadPool {
+public:
+  /**
+   * Spin up the threads of the pool. They sleep until work is submitted.
+   * @param num_threads  the number of helper threads (may be 0).
+   * @param init         (Optional) run by each helper thread as it starts,
+   *                     e.g. to set its affinity.
+   */
+  explicit ThreadPool(int num_threads, const std::function<void()> &init = nullptr);
+  ~ThreadPool();
+
+  /**
+   * Run task(i) for every i in [0, num_tasks) and return once all of them
+   * have completed. Multiple threads may call parallel_for concurrently.
+   * Tasks must not throw.
+   * @param num_tasks  the number of tasks to run.
+   * @param task       the function to call with each task index.
+   */
+  void parallel_for(size_t num_tasks, const std::function<void(size_t)> &task);
+
+  /**
+   * Spin up more helper threads, running init as the first ones did, until
+   * the pool has at least num_threads of them. May be called while other
+   * threads call parallel_for.
+   * @param num_threads  the number of helper threads the pool should have.
+   */
+  void grow(int num_threads);
+
+  // return the number of helper threads in the pool
+  int get_num_threads() const { return num_helpers; }
+
+private:
+  // A batch of tasks submitted by a single call to parallel_for
+  struct Job {
+    const std::function<void(size_t)> *task;
+    size_t num_tasks;
+    size_t next_task = 0; // index of the next unclaimed task
+    int active = 0;       // number of pool threads working on this job
+  };
+
+  /**
+   * Claim and run tasks of the job until none are left.
+   * @param job  the job to work on.
+   */
+  void run_tasks(Job *job);
+
+  void do_work(std::function<void()> init); // function which runs on each pool thread
+
+  std::function<void()> init;     // run by each helper thread as it starts
+  std::vector<std::thread> threads;
+  std::atomic<int> num_helpers{0}; // the size of threads, read without the lock
+  std::deque<Job *> jobs; // jobs which may still have unclaimed tasks
+  bool shutdown = false;
+
+  // protects threads, jobs, shutdown and the fields of every Job
+  std::mutex queue_lock;
+  std::condition_variable queue_condition; // signals new jobs or shutdown
+  std::condition_variable done_condition;  // signals a job has no active threads
+};
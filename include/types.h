@@ -1,10 +1,8 @@
 #pragma once
-#include <xxhash.h>
 #include <graph_zeppelin_common.h>
 
+// The hash functions are selected in l0_sampling/hash_families.h
 typedef vec_hash_t col_hash_t;
-static const auto& vec_hash = XXH32;
-static const auto& col_hash = XXH32;
 
 enum UpdateType {
   INSERT = 0,
@@ -23,8 +23,10 @@ std::pair<uint32_t , uint32_t> inv_nondir_non_self_edge_pairing_fn(uint64_t idx)
 /**
  * Configures the system using the configuration file streaming.conf
  * Gets the path prefix where the buffer tree data will be stored and sets
- * with the number of threads used for a variety of tasks.
- * Should be called before creating the buffer tree or starting graph workers.
+ * with the number of threads used for a variety of tasks and the pages which
+ * back the supernodes.
+ * Should be called before allocating the supernodes, creating the buffer tree
+ * or starting graph workers.
  * @return the prefix of the path in which the buffer tree should be stored.
  */
 std::pair<bool, std::string> configure_system();
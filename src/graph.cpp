@@ -1,106 +1,172 @@
 #include <map>
 #include <iostream>
 #include <chrono>
+#include <cstring>
+#include <memory>
+#include <numeric>
 #include <random>
+#include <thread>
 
 #include <gutter_tree.h>
 #include <standalone_gutters.h>
 #include "../include/graph.h"
 #include "../include/graph_worker.h"
+#include "../include/numa_topology.h"
+
+/*
+ * Return out(i), in order, for every i in [0, n) for which keep(i) is true.
+ * Each chunk of indices is counted and then written in parallel at the
+ * offset of the kept indices of the chunks before it.
+ */
+template <class Keep, class Out>
+static auto parallel_filter(size_t n, Keep keep, Out out)
+    -> vector<decltype(out(size_t()))> {
+  constexpr size_t chunk_size = 4096;
+  size_t num_chunks = (n + chunk_size - 1) / chunk_size;
+  vector<size_t> offsets(num_chunks + 1, 0);
+  #pragma omp parallel for default(none) shared(n, keep, offsets, num_chunks)
+  for (size_t c = 0; c < num_chunks; ++c) {
+    size_t end = std::min(n, (c + 1) * chunk_size);
+    for (size_t i = c * chunk_size; i < end; ++i)
+      offsets[c + 1] += keep(i);
+  }
+  std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+  vector<decltype(out(size_t()))> kept(offsets[num_chunks]);
+  #pragma omp parallel for default(none) shared(n, keep, out, offsets, kept, num_chunks)
+  for (size_t c = 0; c < num_chunks; ++c) {
+    size_t pos = offsets[c];
+    size_t end = std::min(n, (c + 1) * chunk_size);
+    for (size_t i = c * chunk_size; i < end; ++i)
+      if (keep(i)) kept[pos++] = out(i);
+  }
+  return kept;
+}
 
-// static variable for enforcing that only one graph is open at a time
-bool Graph::open_graph = false;
-
-Graph::Graph(node_id_t num_nodes): num_nodes(num_nodes) {
-  if (open_graph) throw MultipleGraphsException();
+std::atomic<int> Graph::num_graphs{0};
 
+Graph::Graph(node_id_t num_nodes): num_nodes(num_nodes), id(num_graphs++) {
 #ifdef VERIFY_SAMPLES_F
   cout << "Verifying samples..." << endl;
 #endif
-  Supernode::configure(num_nodes);
-  representatives = new set<node_id_t>();
-  supernodes = new Supernode*[num_nodes];
-  parent = new node_id_t[num_nodes];
+  geometry = new SupernodeGeometry(num_nodes);
+  std::pair<bool, std::string> conf = configure_system(); // read the configuration file to configure the system
+  worker_config = GraphWorker::get_config();
+  supernodes = new SupernodeArena(num_nodes, geometry->bytes_size);
+  partition_nodes();
+  dsu = DisjointSetUnion<node_id_t>(num_nodes);
+  dirty = NodeBitmap(num_nodes);
+  changed = NodeBitmap(num_nodes);
   seed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
   std::mt19937_64 r(seed);
   seed = r();
 
   for (node_id_t i = 0; i < num_nodes; ++i) {
-    representatives->insert(i);
-    supernodes[i] = Supernode::makeSupernode(num_nodes,seed);
-    parent[i] = i;
+    Supernode::makeSupernode(supernodes->slot(i), *geometry, seed);
   }
   num_updates = 0; // REMOVE this later
   
-  std::pair<bool, std::string> conf = configure_system(); // read the configuration file to configure the system
-  std::string buffer_loc_prefix = conf.second;
-  // Create the buffering system and start the graphWorkers
-  if (conf.first)
-    bf = new GutterTree(buffer_loc_prefix, num_nodes, GraphWorker::get_num_groups(), true);
-  else
-    bf = new StandAloneGutters(num_nodes, GraphWorker::get_num_groups());
-
-  GraphWorker::start_workers(this, bf, Supernode::get_size());
-  open_graph = true;
+  // Create the buffering systems and start the graphWorkers
+  start_buffering(conf.first, conf.second);
 }
 
-Graph::Graph(const std::string& input_file) : num_updates(0) {
-  if (open_graph) throw MultipleGraphsException();
-  
-  int sketch_fail_factor;
-  auto binary_in = std::fstream(input_file, std::ios::in | std::ios::binary);
-  binary_in.read((char*)&seed, sizeof(long));
-  binary_in.read((char*)&num_nodes, sizeof(uint64_t));
-  binary_in.read((char*)&sketch_fail_factor, sizeof(int));
-  Supernode::configure(num_nodes, sketch_fail_factor);
+Graph::Graph(const std::string& input_file) : id(num_graphs++), num_updates(0) {
+  GraphDump dump(input_file);
+  seed = dump.get_seed();
+  num_nodes = dump.get_num_nodes();
+  geometry = new SupernodeGeometry(num_nodes, dump.get_fail_factor());
+  std::pair<bool, std::string> conf = configure_system(); // read the configuration file to configure the system
+  worker_config = GraphWorker::get_config();
 
 #ifdef VERIFY_SAMPLES_F
   cout << "Verifying samples..." << endl;
 #endif
-  representatives = new set<node_id_t>();
-  supernodes = new Supernode*[num_nodes];
-  parent = new node_id_t[num_nodes];
-  for (node_id_t i = 0; i < num_nodes; ++i) {
-    representatives->insert(i);
-    supernodes[i] = Supernode::makeSupernode(num_nodes, seed, binary_in);
-    parent[i] = i;
+  supernodes = new SupernodeArena(num_nodes, geometry->bytes_size);
+  partition_nodes();
+  dsu = DisjointSetUnion<node_id_t>(num_nodes);
+  // the supernodes read from the file are not yet in any component
+  dirty = NodeBitmap(num_nodes, true);
+  changed = NodeBitmap(num_nodes);
+  dump.read_supernodes(*geometry, [this](node_id_t i) { return supernodes->slot(i); });
+  // later checkpoints to the file append to it, unless it is of an older version
+  if (dump.get_version() == GraphDump::version) {
+    checkpoint_file = input_file;
+    checkpoint_end = dump.get_end();
   }
-  binary_in.close();
-
-  std::pair<bool, std::string> conf = configure_system(); // read the configuration file to configure the system
-  std::string buffer_loc_prefix = conf.second;
-  // Create the buffering system and start the graphWorkers
-  if (conf.first)
-    bf = new GutterTree(buffer_loc_prefix, num_nodes, GraphWorker::get_num_groups(), true);
-  else
-    bf = new StandAloneGutters(num_nodes, GraphWorker::get_num_groups());
 
-  GraphWorker::start_workers(this, bf, Supernode::get_size());
-  open_graph = true;
+  // Create the buffering systems and start the graphWorkers
+  start_buffering(conf.first, conf.second);
 }
 
 Graph::~Graph() {
-  for (unsigned i=0;i<num_nodes;++i)
-    free(supernodes[i]); // free because memory is malloc'd in make_supernode
-  delete[] supernodes;
-  delete[] parent;
-  delete representatives;
-  GraphWorker::stop_workers(); // join the worker threads
-  delete bf;
-  open_graph = false;
+  begin_query(); // wait for an asynchronous query
+  delete workers; // join the worker threads
+  delete supernodes;
+  delete geometry;
+  for (auto &partition : partitions)
+    delete partition.bf;
 }
 
 void Graph::update(GraphUpdate upd) {
   if (update_locked) throw UpdateLockedException();
   Edge &edge = upd.first;
 
-  bf->insert(edge);
-  std::swap(edge.first, edge.second);
-  bf->insert(edge);
+  NodePartition &src = partition_of(edge.first);
+  src.bf->insert({edge.first - src.begin, edge.second});
+  NodePartition &dst = partition_of(edge.second);
+  dst.bf->insert({edge.second - dst.begin, edge.first});
 }
 
-void Graph::generate_delta_node(node_id_t node_n, long node_seed, node_id_t
-               src, const vector<node_id_t> &edges, Supernode *delta_loc) {
+/*
+ * Without NUMA placement all nodes form one partition. With it the nodes are
+ * split into contiguous ranges spread over the NUMA nodes. The pages of each
+ * range are bound to its NUMA node before the supernodes are constructed, so
+ * that they are placed there when first touched, and the workers of the
+ * range run on the same NUMA node. Every partition needs a worker, so there
+ * are never more partitions than workers.
+ */
+void Graph::partition_nodes() {
+  node_id_t num_parts = worker_config.num_partitions;
+  num_parts = std::min(num_parts, (node_id_t) worker_config.num_groups);
+  num_parts = std::min(num_parts, num_nodes);
+  if (num_parts == 0) {
+    partitions = {{0, num_nodes, nullptr, -1}};
+    return;
+  }
+
+  // split on page boundaries of the arena, so that with hugepages each range
+  // is backed by whole pages of its own. Ranges left empty are dropped.
+  partitions.clear();
+  for (node_id_t p = 0; p < num_parts; ++p) {
+    node_id_t begin = supernodes->page_boundary((uint64_t) p * num_nodes / num_parts);
+    node_id_t end = supernodes->page_boundary((uint64_t) (p + 1) * num_nodes / num_parts);
+    if (begin == end) continue;
+    int numa_node = partitions.size() % NumaTopology::num_nodes();
+    partitions.push_back({begin, end, nullptr, numa_node});
+    supernodes->bind(begin, end, numa_node);
+  }
+}
+
+void Graph::start_buffering(bool use_guttertree, const std::string &prefix) {
+  int num_parts = partitions.size();
+  for (int p = 0; p < num_parts; ++p) {
+    NodePartition &partition = partitions[p];
+    node_id_t size = partition.end - partition.begin;
+    // GraphWorker i serves partition i % num_parts
+    int num_workers = (worker_config.num_groups - p + num_parts - 1) / num_parts;
+    if (use_guttertree) {
+      // graphs after the first in a process keep their trees in files of their own
+      std::string part_prefix = id == 0 ? prefix : prefix + "graph" + std::to_string(id) + "_";
+      if (num_parts > 1) part_prefix += "numa" + std::to_string(p) + "_";
+      partition.bf = new GutterTree(part_prefix, size, num_workers, true);
+    } else
+      partition.bf = new StandAloneGutters(size, num_workers);
+  }
+  workers = new GraphWorkers(this, partitions, geometry->delta_bytes_size, worker_config);
+}
+
+// encode the edges from src as updates to its sketches
+static std::vector<vec_t> edge_updates(node_id_t src, const vector<node_id_t> &edges) {
   std::vector<vec_t> updates;
   updates.reserve(edges.size());
   for (const auto& edge : edges) {
@@ -112,42 +178,143 @@ void Graph::generate_delta_node(node_id_t node_n, long node_seed, node_id_t
                             nondirectional_non_self_edge_pairing_fn(edge, src)));
     }
   }
-  Supernode::delta_supernode(node_n, node_seed, updates, delta_loc);
+  return updates;
 }
-void Graph::batch_update(node_id_t src, const vector<node_id_t> &edges, Supernode *delta_loc) {
+
+void Graph::generate_delta_node(node_id_t node_n, long node_seed, node_id_t
+               src, const vector<node_id_t> &edges, Supernode *delta_loc, ThreadPool *pool) {
+  Supernode::delta_supernode(node_n, node_seed, edge_updates(src, edges), delta_loc, pool);
+}
+
+Supernode *Graph::make_delta_node(void *loc) {
+  return Supernode::makeDeltaSupernode(loc, *geometry, seed);
+}
+
+void Graph::batch_update(node_id_t src, const vector<node_id_t> &edges, Supernode *delta_loc,
+                         ThreadPool *pool) {
   if (update_locked) throw UpdateLockedException();
 
   num_updates += edges.size();
-  generate_delta_node(supernodes[src]->n, supernodes[src]->seed, src, edges, delta_loc);
-  supernodes[src]->apply_delta_update(delta_loc);
+  delta_loc->build_delta(edge_updates(src, edges), pool);
+  dirty.set(src);
+  changed.set(src);
+  if (snapshot.load(std::memory_order_acquire) != nullptr) {
+    // a query is reading a snapshot, save the supernode before changing it
+    ++snapshot_users;
+    SupernodeSnapshot *snap = snapshot.load();
+    if (snap != nullptr) snap->save(src);
+    --snapshot_users;
+  }
+  supernodes->get(src)->apply_and_clear_delta(delta_loc);
+  supernodes->batch_done();
 }
 
-vector<set<node_id_t>> Graph::connected_components() {
-  bf->force_flush(); // flush everything in buffering system to make final updates
-  GraphWorker::pause_workers(); // wait for the workers to finish applying the updates
+void Graph::flush_and_pause() {
+  for (auto &partition : partitions)
+    partition.bf->force_flush(); // flush everything in buffering system to make final updates
+  workers->pause_workers(); // wait for the workers to finish applying the updates
   // after this point all updates have been processed from the buffer tree
   end_time = std::chrono::steady_clock::now();
   printf("Total number of updates to sketches before CC %lu\n", num_updates.load()); // REMOVE this later
-  update_locked = true; // disallow updating the graph after we run the alg
-  bool modified;
-  std::pair<Edge, SampleSketchRet> query[num_nodes];
-  node_id_t size[num_nodes];
-  vector<node_id_t> reps(num_nodes);
-  fill(size, size + num_nodes, 1);
+}
+
+void Graph::begin_query() {
+  std::unique_lock<std::mutex> lk(query_mt);
+  query_done.wait(lk, [this]{ return !query_running; });
+  query_running = true;
+}
+
+void Graph::end_query() {
+  std::unique_lock<std::mutex> lk(query_mt);
+  query_running = false;
+  lk.unlock();
+  query_done.notify_all();
+}
+
+/*
+ * An update to an edge dirties both of its endpoints, so a component none of
+ * whose nodes are dirty still has an empty cut and is still a component. It
+ * is kept as it is in the dsu, and only the components with a dirty node are
+ * split back into single nodes to be found again.
+ */
+vector<node_id_t> Graph::take_dirty_components() {
+  std::unique_ptr<std::atomic<bool>[]> dirty_root(new std::atomic<bool>[num_nodes]);
+  #pragma omp parallel for default(none) shared(dirty_root)
+  for (node_id_t i = 0; i < num_nodes; ++i) {
+    dirty_root[i].store(false, std::memory_order_relaxed);
+  }
+  #pragma omp parallel for default(none) shared(dirty_root)
   for (node_id_t i = 0; i < num_nodes; ++i) {
-    reps[i] = i;
+    if (dirty.test(i)) dirty_root[dsu.find_set(i)].store(true, std::memory_order_relaxed);
+  }
+  vector<node_id_t> reps = parallel_filter(num_nodes,
+      [&](size_t i) { return dirty_root[dsu.find_set(i)].load(std::memory_order_relaxed); },
+      [](size_t i) { return (node_id_t) i; });
+  forest = parallel_filter(forest.size(),
+      [&](size_t i) { return !dirty_root[dsu.find_set(forest[i].first)].load(std::memory_order_relaxed); },
+      [&](size_t i) { return forest[i]; });
+
+  #pragma omp parallel for default(none) shared(reps)
+  for (node_id_t i = 0; i < reps.size(); ++i) { // NOLINT(modernize-loop-convert)
+    dsu.reset(reps[i]);
   }
+  dirty.clear();
+  return reps;
+}
+
+template <class F>
+void Graph::read_supernode(node_id_t i, F f) {
+  SupernodeSnapshot *snap = snapshot.load(std::memory_order_acquire);
+  if (snap != nullptr)
+    snap->read(i, f);
+  else
+    f(static_cast<const Supernode&>(*supernodes->get(i)));
+}
+
+void Graph::release_snapshot() {
+  SupernodeSnapshot *snap = snapshot.exchange(nullptr);
+  // wait for the workers which are saving supernodes to the snapshot
+  while (snapshot_users.load() != 0) std::this_thread::yield();
+  delete snap;
+}
+
+void Graph::boruvka_emulation(bool in_place, vector<node_id_t> reps) {
+  bool modified;
+  std::unique_ptr<std::pair<Edge, SampleSketchRet>[]> query(
+      new std::pair<Edge, SampleSketchRet>[num_nodes]);
+
+  /*
+   * Each round the sampled edges are unioned into the dsu from many threads.
+   * The representatives at the start of a round are the roots, so the round
+   * links them into trees, and every tree is then merged into its new root.
+   */
+  std::unique_ptr<bool[]> linked(new bool[num_nodes]);
+
+  /*
+   * Unless in place, the supernodes are only read: round r samples sketch r
+   * without using it up, and a supernode which absorbs others is first copied
+   * to scratch. A supernode is read from its scratch copy once it has one.
+   */
+  vector<Supernode*> scratch(in_place ? 0 : num_nodes, nullptr);
+  int round = 0;
 
   do {
     modified = false;
     bool except = false;
     std::exception_ptr err;
 
-    #pragma omp parallel for default(none) shared(query, reps, except, err, modified)
+    #pragma omp parallel for default(none) shared(query, reps, except, err, modified, scratch, \
+                                                  in_place, round)
     for (node_id_t i = 0; i < reps.size(); ++i) { // NOLINT(modernize-loop-convert)
       // wrap in a try/catch because exiting through exception is undefined behavior in OMP
       try {
-        query[reps[i]] = supernodes[reps[i]]->sample();
+        node_id_t rep = reps[i];
+        if (in_place)
+          query[rep] = supernodes->get(rep)->sample();
+        else if (scratch[rep] != nullptr)
+          query[rep] = scratch[rep]->peek_sample(round);
+        else
+          read_supernode(rep, [&](const Supernode &node) { query[rep] = node.peek_sample(round); });
 
       } catch (...) {
         except = true;
@@ -155,130 +322,359 @@ vector<set<node_id_t>> Graph::connected_components() {
       }
     }
     // Did one of our threads produce an exception?
-    if (except) std::rethrow_exception(err);
-
-    vector<node_id_t> to_remove;
-    for (auto i : reps) {
-      // unpack query result
-      Edge edge = query[i].first;
-      SampleSketchRet ret_code = query[i].second;
+    if (except) {
+      for (Supernode *copy : scratch) free(copy);
+      std::rethrow_exception(err);
+    }
 
-      // try this query again next round as it failed this round
-      if (ret_code == FAIL) {modified = true; continue;} 
-      if (ret_code == ZERO) {
 #ifdef VERIFY_SAMPLES_F
-        verifier->verify_cc(i);
+    for (auto i : reps) {
+      if (query[i].second == ZERO) verifier->verify_cc(i);
+    }
 #endif
-        continue;
-      }
 
-      // query dsu
-      node_id_t a = get_parent(edge.first);
-      node_id_t b = get_parent(edge.second);
-      if (a == b) continue;
+    // resolve the sampled edges into a forest of the supernodes to merge
+    #pragma omp parallel for default(none) shared(query, reps, linked) reduction(||:modified)
+    for (node_id_t i = 0; i < reps.size(); ++i) { // NOLINT(modernize-loop-convert)
+      node_id_t rep = reps[i];
+      linked[rep] = false;
+      // try this query again next round as it failed this round
+      if (query[rep].second == FAIL) {modified = true; continue;}
+      if (query[rep].second == ZERO) continue;
+      Edge edge = query[rep].first;
+      linked[rep] = dsu.union_set(edge.first, edge.second);
+    }
 
 #ifdef VERIFY_SAMPLES_F
-      verifier->verify_edge(edge);
+    // the edges which linked two trees are exactly the edges Boruvka uses
+    for (auto i : reps) {
+      if (linked[i]) verifier->verify_edge(query[i].first);
+    }
 #endif
 
-      // make sure a is the one to be merged into and merge
-      if (size[a] < size[b]) std::swap(a,b);
-      to_remove.push_back(b);
-      parent[b] = a;
-      size[a] += size[b];
-      supernodes[a]->merge(*supernodes[b]);
-    }
-    if (!to_remove.empty()) modified = true;
-    sort(to_remove.begin(), to_remove.end());
-
-    // 2-pointer to find set difference
-    vector<node_id_t> temp_diff;
-    unsigned long ptr1 = 0;
-    unsigned long ptr2 = 0;
-    while (ptr1 < reps.size() && ptr2 < to_remove.size()) {
-      if (reps[ptr1] == to_remove[ptr2]) {
-        ++ ptr1; ++ptr2;
-      } else {
-        temp_diff.push_back(reps[ptr1]);
-        ++ptr1;
+    // every union joined two components, so its edge is in the spanning forest
+    vector<Edge> round_forest = parallel_filter(reps.size(),
+        [&](size_t i) { return linked[reps[i]]; }, [&](size_t i) { return query[reps[i]].first; });
+    forest.insert(forest.end(), round_forest.begin(), round_forest.end());
+
+    // the supernodes which are absorbed, grouped by the root they merge into
+    vector<std::pair<node_id_t, node_id_t>> absorbed = parallel_filter(reps.size(),
+        [&](size_t i) { return dsu.find_set(reps[i]) != reps[i]; },
+        [&](size_t i) { return std::make_pair(dsu.find_set(reps[i]), reps[i]); });
+    if (!absorbed.empty()) modified = true;
+    sort(absorbed.begin(), absorbed.end());
+    merge_trees(absorbed, in_place ? nullptr : scratch.data(), round);
+    reps = parallel_filter(reps.size(), [&](size_t i) { return dsu.find_set(reps[i]) == reps[i]; },
+                           [&](size_t i) { return reps[i]; });
+    ++round;
+  } while (modified);
+  for (Supernode *copy : scratch) free(copy);
+  printf("CC done\n");
+}
+
+/*
+ * The components are numbered in the order of their roots: the roots are
+ * found with a parallel filter over the dsu, then every node is labelled by
+ * the index of its root. Sizes are counted per run of equal labels, so that
+ * one giant component does not serialize every thread on its counter.
+ */
+ComponentLabels Graph::label_components() {
+  ComponentLabels ret;
+  ret.labels.resize(num_nodes);
+  vector<node_id_t> &labels = ret.labels;
+  #pragma omp parallel for default(none) shared(labels)
+  for (node_id_t i = 0; i < num_nodes; ++i) {
+    labels[i] = dsu.find_set(i);
+  }
+  vector<node_id_t> roots = parallel_filter(num_nodes,
+      [&](size_t i) { return labels[i] == i; }, [](size_t i) { return (node_id_t) i; });
+  ret.num_components = roots.size();
+
+  vector<node_id_t> root_label(num_nodes);
+  #pragma omp parallel for default(none) shared(roots, root_label)
+  for (node_id_t c = 0; c < roots.size(); ++c) {
+    root_label[roots[c]] = c;
+  }
+  ret.sizes.assign(ret.num_components, 0);
+  vector<node_id_t> &sizes = ret.sizes;
+  constexpr node_id_t chunk_size = 4096;
+  #pragma omp parallel for default(none) shared(labels, root_label, sizes)
+  for (node_id_t begin = 0; begin < num_nodes; begin += chunk_size) {
+    node_id_t end = std::min(num_nodes, begin + chunk_size);
+    node_id_t run_label = 0, run_size = 0;
+    for (node_id_t i = begin; i < end; ++i) {
+      labels[i] = root_label[labels[i]];
+      if (labels[i] != run_label && run_size > 0) {
+        __atomic_fetch_add(&sizes[run_label], run_size, __ATOMIC_RELAXED);
+        run_size = 0;
       }
+      run_label = labels[i];
+      ++run_size;
     }
-    while (ptr1 < reps.size()) {
-      temp_diff.push_back(reps[ptr1]);
-      ++ptr1;
-    }
-
-    swap(reps, temp_diff);
-  } while (modified);
+    if (run_size > 0) __atomic_fetch_add(&sizes[run_label], run_size, __ATOMIC_RELAXED);
+  }
+  return ret;
+}
 
-  map<node_id_t, set<node_id_t>> temp;
-  for (node_id_t i = 0; i < num_nodes; ++i)
-    temp[get_parent(i)].insert(i);
-  vector<set<node_id_t>> retval;
-  retval.reserve(temp.size());
-  for (const auto& it : temp) retval.push_back(it.second);
+ComponentLabels Graph::connected_component_labels() {
+  return run_query(false, nullptr);
+}
 
-  printf("CC done\n");
-  return retval;
+ComponentLabels Graph::connected_component_labels(bool cont) {
+  return run_query(cont, nullptr);
 }
 
-Supernode** Graph::backup_supernodes() {
-  bf->force_flush(); // flush everything in buffering system to make final updates
-  GraphWorker::pause_workers(); // wait for the workers to finish applying the updates
+ComponentLabels Graph::run_query(bool cont, vector<Edge> *forest_out) {
+  begin_query();
+  flush_and_pause();
+  update_locked = true; // disallow updating the graph until the query is done
+  supernodes->advise_sequential();
+  vector<node_id_t> reps = take_dirty_components();
+  ComponentLabels ret;
+  std::exception_ptr err;
+  try {
+    boruvka_emulation(!cont, reps);
+    ret = label_components();
+    if (forest_out != nullptr) *forest_out = forest;
+  } catch (...) {
+    err = std::current_exception();
+    for (node_id_t rep : reps) dirty.set(rep); // find these components again next time
+  }
 
-  // Copy supernodes
-  Supernode** supernodes = new Supernode*[num_nodes];
-  for (node_id_t i = 0; i < num_nodes; ++i) {
-    supernodes[i] = Supernode::makeSupernode(*this->supernodes[i]);
+  if (cont) {
+    // the supernodes are as they were, and the dsu is kept for the next query
+    supernodes->advise_random();
+    workers->unpause_workers();
+    update_locked = false;
   }
+  end_query();
+  if (err) std::rethrow_exception(err);
+  return ret;
+}
 
-  return supernodes;
+vector<Edge> Graph::spanning_forest(bool cont) {
+  vector<Edge> ret;
+  run_query(cont, &ret);
+  return ret;
 }
 
-void Graph::restore_supernodes(Supernode** supernodes) {
-  // Restore supernodes
-  for (node_id_t i=0;i<num_nodes;++i) {
-    free(this->supernodes[i]);
-    this->supernodes[i] = supernodes[i];
-    representatives->insert(i);
-    parent[i] = i;
+/*
+ * The forest is written as a binary graph stream of insertions, so that it
+ * can be read back with BinaryGraphStream like any other stream.
+ */
+void Graph::write_spanning_forest(const string &filename, bool cont) {
+  vector<Edge> edges = spanning_forest(cont);
+  auto binary_out = std::fstream(filename, std::ios::out | std::ios::binary);
+  if (!binary_out.is_open()) throw GraphFileException();
+  uint32_t n = num_nodes;
+  uint64_t m = edges.size();
+  binary_out.write((char*)&n, sizeof(uint32_t));
+  binary_out.write((char*)&m, sizeof(uint64_t));
+
+  constexpr size_t edge_size = sizeof(uint8_t) + 2 * sizeof(uint32_t);
+  constexpr size_t buf_edges = 1 << 16;
+  vector<char> buf(buf_edges * edge_size);
+  for (size_t begin = 0; begin < edges.size(); begin += buf_edges) {
+    size_t end = std::min(edges.size(), begin + buf_edges);
+    char *pos = buf.data();
+    for (size_t i = begin; i < end; ++i) {
+      uint32_t a = edges[i].first;
+      uint32_t b = edges[i].second;
+      *pos = INSERT;
+      std::memcpy(pos + 1, &a, sizeof(uint32_t));
+      std::memcpy(pos + 5, &b, sizeof(uint32_t));
+      pos += edge_size;
+    }
+    binary_out.write(buf.data(), pos - buf.data());
   }
-  delete[] supernodes;
+  // a failed write, or the flush on close, leaves the stream failed
+  binary_out.close();
+  if (binary_out.fail()) throw GraphFileException();
+}
 
-  GraphWorker::unpause_workers();
-  update_locked = false;
+/*
+ * The workers are only paused to flush the updates made before the query and
+ * to take the snapshot. From then on every supernode a worker updates is
+ * saved to the snapshot first, and Boruvka reads the snapshot.
+ */
+std::future<ComponentLabels> Graph::connected_component_labels_async() {
+  // only once the running query is done is it known whether it merged the
+  // supernodes in place
+  begin_query();
+  if (update_locked) {
+    end_query();
+    throw UpdateLockedException();
+  }
+  flush_and_pause();
+  snapshot = new SupernodeSnapshot(supernodes);
+  vector<node_id_t> reps = take_dirty_components();
+  workers->unpause_workers();
+
+  return std::async(std::launch::async, [this, reps]() {
+    ComponentLabels ret;
+    std::exception_ptr err;
+    try {
+      boruvka_emulation(false, reps);
+      ret = label_components();
+    } catch (...) {
+      err = std::current_exception();
+      for (node_id_t rep : reps) dirty.set(rep); // find these components again next time
+    }
+    last_query_saved = snapshot.load()->get_num_saved();
+    release_snapshot();
+    end_query();
+    if (err) std::rethrow_exception(err);
+    return ret;
+  });
 }
 
-vector<set<node_id_t>> Graph::connected_components(bool cont) {
-  if (!cont)
-    return connected_components();
+vector<set<node_id_t>> ComponentLabels::to_sets() const {
+  vector<set<node_id_t>> retval(num_components);
+  for (node_id_t i = 0; i < labels.size(); ++i)
+    retval[labels[i]].insert(retval[labels[i]].end(), i);
+  return retval;
+}
 
-  Supernode** supernodes = backup_supernodes();
+vector<std::pair<node_id_t, node_id_t>> ComponentLabels::size_histogram() const {
+  map<node_id_t, node_id_t> counts;
+  for (node_id_t size : sizes) ++counts[size];
+  return {counts.begin(), counts.end()};
+}
 
-  vector<set<node_id_t>> ret = connected_components();
+vector<set<node_id_t>> Graph::connected_components() {
+  return connected_component_labels().to_sets();
+}
 
-  restore_supernodes(supernodes);
+void Graph::merge_trees(const vector<std::pair<node_id_t, node_id_t>> &absorbed,
+                        Supernode **scratch, int round) {
+  // lay out each tree as its root followed by the supernodes it absorbs
+  vector<node_id_t> order;
+  vector<size_t> tree_start;
+  order.reserve(2 * absorbed.size());
+  for (size_t i = 0; i < absorbed.size(); ++i) {
+    if (i == 0 || absorbed[i].first != absorbed[i - 1].first) {
+      tree_start.push_back(order.size());
+      order.push_back(absorbed[i].first);
+    }
+    order.push_back(absorbed[i].second);
+  }
+  tree_start.push_back(order.size());
+
+  // at each level the jth supernode of a tree absorbs the (j + stride)th,
+  // for every j which is a multiple of 2 * stride
+  vector<std::pair<node_id_t, node_id_t>> level;
+  for (size_t stride = 1; ; stride *= 2) {
+    level.clear();
+    for (size_t t = 0; t + 1 < tree_start.size(); ++t) {
+      for (size_t j = tree_start[t]; j + stride < tree_start[t + 1]; j += 2 * stride)
+        level.emplace_back(order[j], order[j + stride]);
+    }
+    if (level.empty()) break;
+    #pragma omp parallel for default(none) shared(level, scratch, round)
+    for (size_t i = 0; i < level.size(); ++i) { // NOLINT(modernize-loop-convert)
+      node_id_t dst = level[i].first, src = level[i].second;
+      if (scratch == nullptr) {
+        supernodes->get(dst)->merge(*supernodes->get(src));
+        continue;
+      }
+      // the sketches up to round's are never read again, so they are not merged
+      if (scratch[dst] == nullptr) {
+        read_supernode(dst, [&](const Supernode &node) {
+          scratch[dst] = Supernode::makeSupernode(node);
+        });
+      }
+      if (scratch[src] != nullptr) {
+        scratch[dst]->merge(*scratch[src], round + 1);
+      } else {
+        read_supernode(src, [&](const Supernode &node) { scratch[dst]->merge(node, round + 1); });
+      }
+    }
+  }
 
-  return ret;
+  // the copies of the absorbed supernodes are not read again
+  if (scratch == nullptr) return;
+  #pragma omp parallel for default(none) shared(absorbed, scratch)
+  for (size_t i = 0; i < absorbed.size(); ++i) { // NOLINT(modernize-loop-convert)
+    free(scratch[absorbed[i].second]);
+    scratch[absorbed[i].second] = nullptr;
+  }
 }
 
-node_id_t Graph::get_parent(node_id_t node) {
-  if (parent[node] == node) return node;
-  return parent[node] = get_parent(parent[node]);
+vector<set<node_id_t>> Graph::connected_components(bool cont) {
+  return connected_component_labels(cont).to_sets();
 }
 
+/*
+ * The dump waits for any asynchronous query or checkpoint, which read the
+ * snapshot, and the workers resume once it is written.
+ */
 void Graph::write_binary(const std::string& filename) {
-  bf->force_flush(); // flush everything in buffering system to make final updates
-  GraphWorker::pause_workers(); // wait for the workers to finish applying the updates
+  begin_query();
+  for (auto &partition : partitions)
+    partition.bf->force_flush(); // flush everything in buffering system to make final updates
+  workers->pause_workers(); // wait for the workers to finish applying the updates
   // after this point all updates have been processed from the buffering system
 
-  auto binary_out = std::fstream(filename, std::ios::out | std::ios::binary);
-  int fail_factor = Sketch::get_failure_factor();
-  binary_out.write((char*)&seed, sizeof(long));
-  binary_out.write((char*)&num_nodes, sizeof(uint64_t));
-  binary_out.write((char*)&fail_factor, sizeof(int));
-  for (node_id_t i = 0; i < num_nodes; ++i) {
-    supernodes[i]->write_binary(binary_out);
+  std::exception_ptr err;
+  try {
+    GraphDump::write(filename, seed, *geometry, [this](node_id_t i, char *out) {
+      supernodes->get(i)->write_binary(out);
+    });
+  } catch (...) {
+    err = std::current_exception();
   }
-  binary_out.close();
+  workers->unpause_workers();
+  end_query();
+  if (err) std::rethrow_exception(err);
+}
+
+void Graph::write_checkpoint(const string &filename, bool base, const vector<node_id_t> &nodes) {
+  auto serialize = [this](node_id_t i, char *out) {
+    read_supernode(i, [&](const Supernode &node) { node.write_binary(out); });
+  };
+  try {
+    if (base)
+      checkpoint_end = GraphDump::write(filename, seed, *geometry, serialize);
+    else
+      checkpoint_end = GraphDump::append_segment(filename, checkpoint_end, *geometry, nodes,
+                                                 serialize);
+  } catch (GraphFileException &) {
+    throw CheckpointException();
+  }
+  checkpoint_file = filename;
+}
+/*
+ * The supernodes updated since the last checkpoint are taken while the
+ * workers are paused, so every update is either in this checkpoint's
+ * snapshot or marks its supernode for the next one.
+ */
+std::future<void> Graph::checkpoint_async(const string &filename) {
+  begin_query();
+  if (update_locked) {
+    end_query();
+    throw UpdateLockedException();
+  }
+  flush_and_pause();
+  snapshot = new SupernodeSnapshot(supernodes);
+  bool base = filename != checkpoint_file;
+  vector<node_id_t> nodes;
+  if (!base) {
+    nodes = parallel_filter(num_nodes, [&](size_t i) { return changed.test(i); },
+                            [](size_t i) { return (node_id_t) i; });
+  }
+  changed.clear();
+  workers->unpause_workers();
+
+  return std::async(std::launch::async, [this, filename, base, nodes]() {
+    std::exception_ptr err;
+    try {
+      write_checkpoint(filename, base, nodes);
+    } catch (...) {
+      err = std::current_exception();
+      checkpoint_file.clear(); // start the next checkpoint over
+    }
+    release_snapshot();
+    end_query();
+    if (err) std::rethrow_exception(err);
+  });
 }
@@ -0,0 +1,472 @@
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <xxhash.h>
+#include "../include/graph_dump.h"
+
+constexpr uint64_t GraphDump::magic;
+constexpr uint32_t GraphDump::version;
+
+static_assert(sizeof(GraphDump::DumpHeader) == 64, "the dump header must not be padded");
+static_assert(sizeof(GraphDump::DumpEntry) == 16, "the dump index must not be padded");
+static_assert(sizeof(GraphDump::DumpRecord) == 12, "the segment records must not be padded");
+
+// the hash family every dump of version 1 was written with
+static constexpr const char *version_1_hash_family = "xxh32";
+
+// the size of the header of a dump of version 1: seed, number of nodes and failure factor
+static constexpr size_t version_1_header_bytes = sizeof(long) + sizeof(uint64_t) + sizeof(int);
+
+// the supernodes of a dump are read and written in chunks of about this many bytes
+static constexpr size_t io_chunk_bytes = size_t(8) << 20;
+
+// blocks this close together are read with one pread, along with the gap between them
+static constexpr uint64_t max_gap = 64 * 1024;
+
+static bool pwrite_all(int fd, const char *buf, size_t bytes, uint64_t offset) {
+  while (bytes > 0) {
+    ssize_t written = pwrite(fd, buf, bytes, offset);
+    if (written <= 0) return false;
+    buf += written;
+    bytes -= written;
+    offset += written;
+  }
+  return true;
+}
+
+static bool pread_all(int fd, char *buf, size_t bytes, uint64_t offset) {
+  while (bytes > 0) {
+    ssize_t num_read = pread(fd, buf, bytes, offset);
+    if (num_read <= 0) return false;
+    buf += num_read;
+    bytes -= num_read;
+    offset += num_read;
+  }
+  return true;
+}
+
+static inline uint32_t block_checksum(const char *block, size_t bytes) {
+  return (uint32_t) XXH64(block, bytes, 0);
+}
+
+static inline size_t num_sketches_of(const SupernodeGeometry &geometry) {
+  return geometry.binary_size / geometry.sketch.bucket_bytes();
+}
+
+static inline size_t bitmap_bytes(const SketchGeometry &sketch) {
+  return (sketch.num_elems + 63) / 64 * sizeof(uint64_t);
+}
+
+// the number of supernodes to read or write at once
+static inline node_id_t chunk_nodes_of(const SupernodeGeometry &geometry) {
+  size_t node_bytes = std::max<size_t>(1, geometry.binary_size);
+  return std::min<uint64_t>(geometry.n, std::max<size_t>(1, io_chunk_bytes / node_bytes));
+}
+
+GraphDump::GraphDump(const std::string &filename) : geometry(2), end(0) {
+  fd = open(filename.c_str(), O_RDONLY);
+  if (fd == -1) throw GraphFileException();
+  try {
+    struct stat st;
+    if (fstat(fd, &st) != 0) throw GraphFileException();
+    uint64_t file_size = st.st_size;
+    uint64_t file_magic = 0;
+    if (file_size >= sizeof(DumpHeader))
+      pread_all(fd, (char *) &file_magic, sizeof(file_magic), 0);
+    if (file_magic == magic)
+      open_dump(file_size);
+    else
+      open_version_1(file_size);
+    scan_segments(file_size);
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+}
+
+GraphDump::~GraphDump() {
+  close(fd);
+}
+
+/*
+ * A dump of version 1 has no checksums, so only its size tells that it is
+ * not a dump. Its supernodes lie one after the other in order.
+ */
+void GraphDump::open_version_1(uint64_t file_size) {
+  char header[version_1_header_bytes];
+  if (file_size < version_1_header_bytes || !pread_all(fd, header, sizeof(header), 0))
+    throw CorruptDumpException();
+  // the number of nodes was written from a node_id_t into 8 bytes, so only the
+  // low 4 bytes of it were ever set
+  node_id_t n;
+  int fail_factor;
+  std::memcpy(&seed, header, sizeof(long));
+  std::memcpy(&n, header + sizeof(long), sizeof(node_id_t));
+  std::memcpy(&fail_factor, header + sizeof(long) + sizeof(uint64_t), sizeof(int));
+  if (n == 0 || n > file_size || fail_factor <= 0) throw CorruptDumpException();
+  if (std::strcmp(Bucket_Boruvka::HashFamily::name(), version_1_hash_family) != 0)
+    throw HashFamilyException();
+
+  file_version = 1;
+  geometry = SupernodeGeometry(n, fail_factor);
+  end = version_1_header_bytes + n * geometry.binary_size;
+  if (end > file_size) throw CorruptDumpException();
+  index.resize(n);
+  for (node_id_t i = 0; i < n; ++i)
+    index[i] = {version_1_header_bytes + i * geometry.binary_size,
+                (uint32_t) geometry.binary_size, 0};
+}
+
+void GraphDump::open_dump(uint64_t file_size) {
+  DumpHeader header;
+  if (!pread_all(fd, (char *) &header, sizeof(header), 0)) throw CorruptDumpException();
+  if (header.version != version) throw DumpVersionException();
+  if (XXH64(&header, offsetof(DumpHeader, checksum), 0) != header.checksum)
+    throw CorruptDumpException();
+  if (std::strncmp(header.hash_family, Bucket_Boruvka::HashFamily::name(),
+                   sizeof(header.hash_family)) != 0)
+    throw HashFamilyException();
+  uint64_t n = header.num_nodes;
+  if (n == 0 || n > file_size || header.index_offset > file_size) throw CorruptDumpException();
+
+  file_version = version;
+  seed = header.seed;
+  geometry = SupernodeGeometry(n, header.fail_factor);
+  end = header.index_offset + n * sizeof(DumpEntry) + sizeof(uint64_t);
+  if (end > file_size) throw CorruptDumpException();
+  index.resize(n);
+  uint64_t index_checksum;
+  if (!pread_all(fd, (char *) index.data(), n * sizeof(DumpEntry), header.index_offset) ||
+      !pread_all(fd, (char *) &index_checksum, sizeof(uint64_t), end - sizeof(uint64_t)))
+    throw CorruptDumpException();
+  if (XXH64(index.data(), n * sizeof(DumpEntry), 0) != index_checksum)
+    throw CorruptDumpException();
+
+  size_t max_bytes = max_block_bytes(geometry);
+  for (const DumpEntry &entry : index) {
+    if (entry.bytes > max_bytes || entry.offset < sizeof(DumpHeader) ||
+        entry.offset + entry.bytes > header.index_offset)
+      throw CorruptDumpException();
+  }
+}
+
+/*
+ * A segment whose count was written is complete, so one which runs past the
+ * end of the file or names a supernode the graph does not have is corrupt.
+ */
+void GraphDump::scan_segments(uint64_t file_size) {
+  size_t record_bytes = file_version == 1 ? sizeof(node_id_t) : sizeof(DumpRecord);
+  size_t max_bytes = file_version == 1 ? geometry.binary_size : max_block_bytes(geometry);
+  while (end + sizeof(uint64_t) <= file_size) {
+    uint64_t num_records = 0;
+    if (!pread_all(fd, (char *) &num_records, sizeof(uint64_t), end)) throw GraphFileException();
+    if (num_records == 0) return;
+    if (num_records > file_size / record_bytes) throw CorruptDumpException();
+
+    uint64_t pos = end + sizeof(uint64_t);
+    for (uint64_t k = 0; k < num_records; ++k) {
+      DumpRecord record = {0, (uint32_t) geometry.binary_size, 0};
+      if (pos + record_bytes > file_size ||
+          !pread_all(fd, (char *) &record, record_bytes, pos))
+        throw CorruptDumpException();
+      pos += record_bytes;
+      if (record.node >= index.size() || record.bytes > max_bytes ||
+          pos + record.bytes > file_size)
+        throw CorruptDumpException();
+      index[record.node] = {pos, record.bytes, record.checksum};
+      pos += record.bytes;
+    }
+    end = pos;
+  }
+}
+
+void GraphDump::read_block(const DumpEntry &entry, char *buf) const {
+  if (!pread_all(fd, buf, entry.bytes, entry.offset)) throw GraphFileException();
+  if (file_version != 1 && block_checksum(buf, entry.bytes) != entry.checksum)
+    throw CorruptDumpException();
+}
+
+Supernode *GraphDump::read_supernode(node_id_t i, void *loc) {
+  return read_supernode(i, loc, geometry);
+}
+
+Supernode *GraphDump::read_supernode(node_id_t i, void *loc, const SupernodeGeometry &geometry) {
+  const DumpEntry &entry = index[i];
+  std::unique_ptr<char[]> block(new char[entry.bytes]);
+  read_block(entry, block.get());
+  if (file_version == 1) return Supernode::makeSupernode(loc, geometry, seed, block.get());
+
+  std::unique_ptr<char[]> raw(new char[geometry.binary_size]);
+  if (!decode(geometry, block.get(), entry.bytes, raw.get())) throw CorruptDumpException();
+  return Supernode::makeSupernode(loc, geometry, seed, raw.get());
+}
+
+/*
+ * The blocks of each chunk of supernodes are read in order of their offsets,
+ * in runs of blocks which lie close together, so a chunk written at once is
+ * read with one pread and only the supernodes of later segments are read
+ * apart from it.
+ */
+void GraphDump::read_supernodes(const SupernodeGeometry &geometry,
+                                const std::function<void *(node_id_t)> &slot) {
+  node_id_t n = index.size();
+  node_id_t chunk_nodes = chunk_nodes_of(geometry);
+  node_id_t num_chunks = (n + chunk_nodes - 1) / chunk_nodes;
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  std::atomic<bool> io_failed{false};
+  std::atomic<bool> corrupt{false};
+  #pragma omp parallel default(none) shared(geometry, slot, n, chunk_nodes, num_chunks, io_failed, corrupt)
+  {
+    std::vector<node_id_t> order;
+    std::vector<char> buf;
+    std::unique_ptr<char[]> raw(new char[geometry.binary_size]);
+    #pragma omp for schedule(dynamic)
+    for (node_id_t c = 0; c < num_chunks; ++c) {
+      node_id_t begin = c * chunk_nodes;
+      node_id_t end = std::min(n, begin + chunk_nodes);
+      order.resize(end - begin);
+      for (node_id_t i = begin; i < end; ++i) order[i - begin] = i;
+      std::sort(order.begin(), order.end(), [&](node_id_t a, node_id_t b) {
+        return index[a].offset < index[b].offset;
+      });
+
+      for (size_t run = 0; run < order.size();) {
+        uint64_t run_start = index[order[run]].offset;
+        uint64_t run_end = run_start + index[order[run]].bytes;
+        size_t run_stop = run + 1;
+        while (run_stop < order.size()) {
+          const DumpEntry &next = index[order[run_stop]];
+          if (next.offset > run_end + max_gap || next.offset + next.bytes - run_start > 2 * io_chunk_bytes)
+            break;
+          run_end = std::max(run_end, next.offset + next.bytes);
+          ++run_stop;
+        }
+        buf.resize(run_end - run_start);
+        if (!pread_all(fd, buf.data(), buf.size(), run_start)) {
+          io_failed = true;
+          break;
+        }
+        for (; run < run_stop; ++run) {
+          node_id_t i = order[run];
+          const char *block = buf.data() + (index[i].offset - run_start);
+          if (file_version == 1) {
+            Supernode::makeSupernode(slot(i), geometry, seed, block);
+          } else if (block_checksum(block, index[i].bytes) == index[i].checksum &&
+                     decode(geometry, block, index[i].bytes, raw.get())) {
+            Supernode::makeSupernode(slot(i), geometry, seed, raw.get());
+          } else {
+            corrupt = true;
+          }
+        }
+      }
+    }
+  }
+  if (io_failed) throw GraphFileException();
+  if (corrupt) throw CorruptDumpException();
+}
+
+/*
+ * Each thread encodes a chunk of supernodes into its buffer and then takes
+ * the next free bytes of the file for the whole chunk, so the chunks are
+ * written with one pwrite each, in the order they finish. The index and then
+ * the header are written once every block is on disk. The dump is written
+ * beside the file and renamed over it once synced, so the last good dump
+ * survives a write that fails or is cut short.
+ */
+uint64_t GraphDump::write(const std::string &filename, long seed,
+                          const SupernodeGeometry &geometry, const SupernodeWriter &serialize) {
+  const std::string temp_filename = filename + ".tmp";
+  int fd = open(temp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) throw GraphFileException();
+  node_id_t n = geometry.n;
+  node_id_t chunk_nodes = chunk_nodes_of(geometry);
+  node_id_t num_chunks = (n + chunk_nodes - 1) / chunk_nodes;
+  size_t max_bytes = max_block_bytes(geometry);
+  std::vector<DumpEntry> index(n);
+  std::atomic<uint64_t> cursor{sizeof(DumpHeader)};
+  std::atomic<bool> failed{false};
+  #pragma omp parallel default(none) shared(geometry, serialize, fd, n, chunk_nodes, num_chunks, \
+                                            max_bytes, index, cursor, failed)
+  {
+    std::unique_ptr<char[]> raw(new char[geometry.binary_size]);
+    std::unique_ptr<char[]> buf(new char[chunk_nodes * max_bytes]);
+    #pragma omp for schedule(dynamic)
+    for (node_id_t c = 0; c < num_chunks; ++c) {
+      node_id_t begin = c * chunk_nodes;
+      node_id_t end = std::min(n, begin + chunk_nodes);
+      uint64_t pos = 0;
+      for (node_id_t i = begin; i < end; ++i) {
+        serialize(i, raw.get());
+        uint32_t bytes = encode(geometry, raw.get(), buf.get() + pos);
+        index[i] = {pos, bytes, block_checksum(buf.get() + pos, bytes)};
+        pos += bytes;
+      }
+      uint64_t start = cursor.fetch_add(pos);
+      for (node_id_t i = begin; i < end; ++i) index[i].offset += start;
+      if (!pwrite_all(fd, buf.get(), pos, start)) failed = true;
+    }
+  }
+
+  DumpHeader header = {};
+  header.magic = magic;
+  header.version = version;
+  header.fail_factor = geometry.sketch.failure_factor;
+  header.seed = seed;
+  header.num_nodes = n;
+  header.index_offset = cursor;
+  std::strncpy(header.hash_family, Bucket_Boruvka::HashFamily::name(), sizeof(header.hash_family));
+  header.checksum = XXH64(&header, offsetof(DumpHeader, checksum), 0);
+  uint64_t index_bytes = n * sizeof(DumpEntry);
+  uint64_t index_checksum = XXH64(index.data(), index_bytes, 0);
+  if (failed || !pwrite_all(fd, (char *) index.data(), index_bytes, header.index_offset) ||
+      !pwrite_all(fd, (char *) &index_checksum, sizeof(uint64_t), header.index_offset + index_bytes) ||
+      fdatasync(fd) != 0 || !pwrite_all(fd, (char *) &header, sizeof(header), 0) ||
+      fdatasync(fd) != 0) {
+    close(fd);
+    unlink(temp_filename.c_str());
+    throw GraphFileException();
+  }
+  if (close(fd) != 0 || rename(temp_filename.c_str(), filename.c_str()) != 0) {
+    unlink(temp_filename.c_str());
+    throw GraphFileException();
+  }
+  return header.index_offset + index_bytes + sizeof(uint64_t);
+}
+
+/*
+ * The records are synced before the count of the segment is written, so the
+ * count is never on disk without them.
+ */
+uint64_t GraphDump::append_segment(const std::string &filename, uint64_t end,
+                                   const SupernodeGeometry &geometry,
+                                   const std::vector<node_id_t> &nodes,
+                                   const SupernodeWriter &serialize) {
+  if (truncate(filename.c_str(), end) != 0) throw GraphFileException();
+  if (nodes.empty()) return end;
+  int fd = open(filename.c_str(), O_WRONLY);
+  if (fd == -1) throw GraphFileException();
+
+  std::unique_ptr<char[]> raw(new char[geometry.binary_size]);
+  std::vector<char> buf;
+  buf.reserve(io_chunk_bytes + sizeof(DumpRecord) + max_block_bytes(geometry));
+  uint64_t num_records = 0;
+  uint64_t pos = end + sizeof(uint64_t);
+  bool ok = pwrite_all(fd, (char *) &num_records, sizeof(uint64_t), end);
+  for (node_id_t i : nodes) {
+    serialize(i, raw.get());
+    size_t record_start = buf.size();
+    buf.resize(record_start + sizeof(DumpRecord) + max_block_bytes(geometry));
+    char *block = buf.data() + record_start + sizeof(DumpRecord);
+    DumpRecord record;
+    record.node = i;
+    record.bytes = encode(geometry, raw.get(), block);
+    record.checksum = block_checksum(block, record.bytes);
+    std::memcpy(buf.data() + record_start, &record, sizeof(DumpRecord));
+    buf.resize(record_start + sizeof(DumpRecord) + record.bytes);
+    if (buf.size() >= io_chunk_bytes) {
+      ok = ok && pwrite_all(fd, buf.data(), buf.size(), pos);
+      pos += buf.size();
+      buf.clear();
+    }
+  }
+  ok = ok && pwrite_all(fd, buf.data(), buf.size(), pos);
+  pos += buf.size();
+
+  num_records = nodes.size();
+  ok = ok && fdatasync(fd) == 0 && pwrite_all(fd, (char *) &num_records, sizeof(uint64_t), end);
+  if (close(fd) != 0 || !ok) throw GraphFileException();
+  return pos;
+}
+
+size_t GraphDump::max_block_bytes(const SupernodeGeometry &geometry) {
+  return num_sketches_of(geometry) * (bitmap_bytes(geometry.sketch) + geometry.sketch.bucket_bytes());
+}
+
+size_t GraphDump::encode(const SupernodeGeometry &geometry, const char *raw, char *out) {
+  const SketchGeometry &sketch = geometry.sketch;
+  size_t num_elems = sketch.num_elems;
+  size_t num_words = bitmap_bytes(sketch) / sizeof(uint64_t);
+  char *pos = out;
+  for (size_t s = 0; s < num_sketches_of(geometry); ++s) {
+    const char *a = raw + s * sketch.bucket_bytes();
+    const char *c = a + num_elems * sizeof(vec_t);
+    auto nonzero = [&](size_t i) {
+      vec_t a_i;
+      vec_hash_t c_i;
+      std::memcpy(&a_i, a + i * sizeof(vec_t), sizeof(vec_t));
+      std::memcpy(&c_i, c + i * sizeof(vec_hash_t), sizeof(vec_hash_t));
+      return a_i != 0 || c_i != 0;
+    };
+
+    size_t num_nonzero = 0;
+    for (size_t w = 0; w < num_words; ++w) {
+      uint64_t bits = 0;
+      for (size_t i = w * 64; i < std::min(num_elems, (w + 1) * 64); ++i) {
+        if (nonzero(i)) bits |= uint64_t(1) << (i % 64);
+      }
+      num_nonzero += __builtin_popcountll(bits);
+      std::memcpy(pos + w * sizeof(uint64_t), &bits, sizeof(uint64_t));
+    }
+    char *out_a = pos + num_words * sizeof(uint64_t);
+    char *out_c = out_a + num_nonzero * sizeof(vec_t);
+    for (size_t i = 0; i < num_elems; ++i) {
+      if (!nonzero(i)) continue;
+      std::memcpy(out_a, a + i * sizeof(vec_t), sizeof(vec_t));
+      std::memcpy(out_c, c + i * sizeof(vec_hash_t), sizeof(vec_hash_t));
+      out_a += sizeof(vec_t);
+      out_c += sizeof(vec_hash_t);
+    }
+    pos = out_c;
+  }
+  return pos - out;
+}
+
+bool GraphDump::decode(const SupernodeGeometry &geometry, const char *block, size_t bytes,
+                       char *raw) {
+  const SketchGeometry &sketch = geometry.sketch;
+  size_t num_elems = sketch.num_elems;
+  size_t num_words = bitmap_bytes(sketch) / sizeof(uint64_t);
+  const char *pos = block;
+  const char *block_end = block + bytes;
+  std::memset(raw, 0, geometry.binary_size);
+  for (size_t s = 0; s < num_sketches_of(geometry); ++s) {
+    if ((size_t) (block_end - pos) < num_words * sizeof(uint64_t)) return false;
+    const char *bitmap = pos;
+    size_t num_nonzero = 0;
+    for (size_t w = 0; w < num_words; ++w) {
+      uint64_t bits;
+      std::memcpy(&bits, bitmap + w * sizeof(uint64_t), sizeof(uint64_t));
+      // no bucket past the end of the sketch may be set
+      if (w == num_words - 1 && num_elems % 64 != 0 && bits >> (num_elems % 64) != 0)
+        return false;
+      num_nonzero += __builtin_popcountll(bits);
+    }
+    const char *in_a = pos + num_words * sizeof(uint64_t);
+    const char *in_c = in_a + num_nonzero * sizeof(vec_t);
+    if ((size_t) (block_end - in_a) < num_nonzero * (sizeof(vec_t) + sizeof(vec_hash_t)))
+      return false;
+
+    char *a = raw + s * sketch.bucket_bytes();
+    char *c = a + num_elems * sizeof(vec_t);
+    for (size_t w = 0; w < num_words; ++w) {
+      uint64_t bits;
+      std::memcpy(&bits, bitmap + w * sizeof(uint64_t), sizeof(uint64_t));
+      while (bits != 0) {
+        size_t i = w * 64 + __builtin_ctzll(bits);
+        bits &= bits - 1;
+        std::memcpy(a + i * sizeof(vec_t), in_a, sizeof(vec_t));
+        std::memcpy(c + i * sizeof(vec_hash_t), in_c, sizeof(vec_hash_t));
+        in_a += sizeof(vec_t);
+        in_c += sizeof(vec_hash_t);
+      }
+    }
+    pos = in_c;
+  }
+  return pos == block_end;
+}
@@ -6,65 +6,87 @@
 #endif
 
 #include <string>
+#include "../include/numa_topology.h"
 
-bool GraphWorker::shutdown = false;
-bool GraphWorker::paused   = false; // controls whether threads should pause or resume work
 int GraphWorker::num_groups = 1;
 int GraphWorker::group_size = 1;
-long GraphWorker::supernode_size;
-GraphWorker **GraphWorker::workers;
-std::condition_variable GraphWorker::pause_condition;
-std::mutex GraphWorker::pause_lock;
+int GraphWorker::num_partitions = 0;
+
+std::mutex GraphWorkers::shared_pools_lock;
+std::map<int, std::weak_ptr<ThreadPool>> GraphWorkers::shared_pools;
 
 /***********************************************
- ******** GraphWorker Static Functions *********
+ ************* GraphWorkers class **************
  ***********************************************/
 /* These functions are used by the rest of the
- * code to manipulate the GraphWorkers as a whole
+ * code to manipulate the GraphWorkers of a graph as a whole
  */
-void GraphWorker::start_workers(Graph *_graph, BufferingSystem *_bf, long _supernode_size) {
-  shutdown = false;
-  paused   = false;
-  supernode_size = _supernode_size;
-
-  workers = (GraphWorker **) calloc(num_groups, sizeof(GraphWorker *));
+GraphWorkers::GraphWorkers(Graph *_graph, const std::vector<NodePartition> &_partitions,
+                           long _supernode_size, const WorkerConfig &config) :
+ group_size(config.group_size), supernode_size(_supernode_size),
+ partitions(_partitions) {
+  int num_groups = config.num_groups;
+  // as many helpers on each NUMA node as the workers placed there had alone
+  std::map<int, int> node_workers;
+  for (int i = 0; i < num_groups; i++)
+    ++node_workers[partitions[i % partitions.size()].numa_node];
+  for (auto &node : node_workers)
+    pools[node.first] = borrow_pool(node.first, node.second * (group_size - 1));
+
+  workers.reserve(num_groups);
   for (int i = 0; i < num_groups; i++) {
-    workers[i] = new GraphWorker(i, _graph, _bf);
+    workers.push_back(new GraphWorker(i, this, _graph, partitions[i % partitions.size()]));
   }
 }
 
-void GraphWorker::stop_workers() {
-  if (shutdown)
-    return;
+GraphWorkers::~GraphWorkers() {
+  for (auto &partition : partitions)
+    partition.bf->set_non_block(true); // make the GraphWorkers bypass waiting in queue
 
+  std::unique_lock<std::mutex> lk(pause_lock);
   shutdown = true;
-  workers[0]->bf->set_non_block(true); // make the GraphWorkers bypass waiting in queue
-  
+  lk.unlock();
   pause_condition.notify_all();      // tell any paused threads to continue and exit
-  for (int i = 0; i < num_groups; i++) {
-    delete workers[i];
+  for (GraphWorker *worker : workers) {
+    delete worker;
+  }
+}
+
+std::shared_ptr<ThreadPool> GraphWorkers::borrow_pool(int numa_node, int num_threads) {
+  std::lock_guard<std::mutex> lk(shared_pools_lock);
+  std::shared_ptr<ThreadPool> pool = shared_pools[numa_node].lock();
+  if (pool == nullptr) {
+    pool = std::make_shared<ThreadPool>(num_threads, [numa_node]{
+      if (numa_node >= 0) NumaTopology::pin_thread(numa_node);
+    });
+    shared_pools[numa_node] = pool;
   }
-  free(workers);
+  pool->grow(num_threads);
+  return pool;
 }
 
-void GraphWorker::pause_workers() {
-  paused = true;
-  workers[0]->bf->set_non_block(true); // make the GraphWorkers bypass waiting in queue
+void GraphWorkers::pause_workers() {
+  {
+    std::lock_guard<std::mutex> lk(pause_lock);
+    paused = true;
+  }
+  for (auto &partition : partitions)
+    partition.bf->set_non_block(true); // make the GraphWorkers bypass waiting in queue
 
   // wait until all GraphWorkers are paused
   while (true) {
     std::unique_lock<std::mutex> lk(pause_lock);
-    pause_condition.wait_for(lk, std::chrono::milliseconds(500), []{
-      for (int i = 0; i < num_groups; i++)
-        if (!workers[i]->get_thr_paused()) return false;
+    pause_condition.wait_for(lk, std::chrono::milliseconds(500), [this]{
+      for (GraphWorker *worker : workers)
+        if (!worker->get_thr_paused()) return false;
       return true;
     });
     
 
     // double check that we didn't get a spurious wake-up
     bool all_paused = true;
-    for (int i = 0; i < num_groups; i++) {
-      if (!workers[i]->get_thr_paused()) {
+    for (GraphWorker *worker : workers) {
+      if (!worker->get_thr_paused()) {
         all_paused = false; // a worker still working so don't stop
         break;
       }
@@ -75,18 +97,29 @@ void GraphWorker::pause_workers() {
   }
 }
 
-void GraphWorker::unpause_workers() {
-  workers[0]->bf->set_non_block(false); // buffer-tree operations should block when necessary
+void GraphWorkers::unpause_workers() {
+  for (auto &partition : partitions)
+    partition.bf->set_non_block(false); // buffer-tree operations should block when necessary
+  std::unique_lock<std::mutex> lk(pause_lock);
   paused = false;
+  ++unpause_epoch;
+  // a worker counts as working until it pauses again, even if it has not woken
+  // up yet, so that the next pause_workers() waits for it to drain its queue
+  for (GraphWorker *worker : workers)
+    worker->thr_paused = false;
+  lk.unlock();
   pause_condition.notify_all();       // tell all paused workers to get back to work
 }
 
 /***********************************************
  ************** GraphWorker class **************
  ***********************************************/
-GraphWorker::GraphWorker(int _id, Graph *_graph, BufferingSystem *_bf) :
- id(_id), graph(_graph), bf(_bf), thr(start_worker, this), thr_paused(false) {
-  delta_node = (Supernode *) malloc(supernode_size);
+GraphWorker::GraphWorker(int _id, GraphWorkers *_owner, Graph *_graph,
+                         const NodePartition &_partition) :
+ id(_id), owner(_owner), graph(_graph), bf(_partition.bf), node_offset(_partition.begin),
+ numa_node(_partition.numa_node), thr_paused(false),
+ pool(_owner->pools.at(_partition.numa_node).get()) {
+  thr = std::thread(start_worker, this); // start once the worker is fully set up
 }
 
 GraphWorker::~GraphWorker() {
@@ -96,31 +129,41 @@ GraphWorker::~GraphWorker() {
 }
 
 void GraphWorker::do_work() {
+  if (numa_node >= 0) NumaTopology::pin_thread(numa_node);
+  delta_node = graph->make_delta_node(malloc(owner->supernode_size));
   data_ret_t data;
   while(true) {
-    if(shutdown)
-      return;
-    std::unique_lock<std::mutex> lk(pause_lock);
-    thr_paused = true; // this thread is currently paused
-    lk.unlock();
-    pause_condition.notify_all(); // notify pause_workers()
-
-    // wait until we are unpaused
-    lk.lock();
-    pause_condition.wait(lk, []{return !paused || shutdown;});
-    thr_paused = false; // no longer paused
-    lk.unlock();
+    // drain the queue before pausing, so that a worker which only starts once
+    // the workers are paused still applies the updates queued for it
     while(true) {
       // call get_data which will handle waiting on the queue
       // and will enforce locking.
       bool valid = bf->get_data(data);
 
       if (valid)
-        graph->batch_update(data.first, data.second, delta_node);
-      else if(shutdown)
+        graph->batch_update(node_offset + data.first, data.second, delta_node, pool);
+      else if(owner->shutdown)
         return;
-      else if(paused)
+      else if(owner->paused)
         break;
     }
+
+    std::unique_lock<std::mutex> lk(owner->pause_lock);
+    if (owner->shutdown) return;
+    if (!owner->paused) continue; // unpaused while draining
+    thr_paused = true; // this thread is currently paused
+    uint64_t epoch = owner->unpause_epoch;
+    lk.unlock();
+    owner->pause_condition.notify_all(); // notify pause_workers()
+
+    // wait until we are unpaused. unpause_workers() clears thr_paused
+    lk.lock();
+    owner->pause_condition.wait(lk, [this, epoch]{
+      return owner->unpause_epoch != epoch || owner->shutdown;
+    });
+    bool stop = owner->shutdown;
+    lk.unlock();
+    if(stop)
+      return;
   }
 }
@@ -0,0 +1,21 @@
+#include "../../include/l0_sampling/hash_families.h"
+
+namespace {
+// Fill the tabulation tables from a fixed seed. Evaluated at compile time so
+// the tables are ready before any static initializer hashes.
+constexpr Bucket_Boruvka::TabulationHash::Tables make_tables() {
+  Bucket_Boruvka::TabulationHash::Tables t{};
+  uint64_t state = 0x5DEECE66DULL;
+  for (int i = 0; i < 8; ++i) {
+    for (int j = 0; j < 256; ++j) {
+      uint64_t r = Bucket_Boruvka::mix_seed(state++);
+      t.index[i][j] = (uint32_t) r;
+      t.col[i][j] = (uint32_t) (r >> 32);
+    }
+  }
+  return t;
+}
+} // namespace
+
+const Bucket_Boruvka::TabulationHash::Tables Bucket_Boruvka::TabulationHash::tables
+    = make_tables();
@@ -0,0 +1,175 @@
+#include "../../include/l0_sampling/hash_kernels.h"
+#include "../../include/bucket.h"
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HASH_KERNELS_X86
+#endif
+
+static_assert(sizeof(vec_t) == 8, "hash kernels expect 64 bit update indices");
+static_assert(sizeof(vec_hash_t) == 4 && sizeof(col_hash_t) == 4,
+              "hash kernels expect 32 bit hashes");
+
+/*
+ * The hashes are XXH32 of an 8 byte index (index_hash) or of a packed 12 byte
+ * {column, index} struct (col_index_hash). For inputs shorter than 16 bytes
+ * XXH32 seeds an accumulator with seed + PRIME32_5 + length, mixes in each
+ * 4 byte word with a round, and finishes with an avalanche. The column word is
+ * the same for every index in a batch so it is mixed in once up front, and
+ * the lanes only need to mix the two words of their index.
+ */
+namespace {
+constexpr uint32_t prime32_2 = 0x85EBCA77U;
+constexpr uint32_t prime32_3 = 0xC2B2AE3DU;
+constexpr uint32_t prime32_4 = 0x27D4EB2FU;
+constexpr uint32_t prime32_5 = 0x165667B1U;
+
+inline uint32_t round32(uint32_t acc, uint32_t word) {
+  acc += word * prime32_3;
+  acc = (acc << 17) | (acc >> 15);
+  return acc * prime32_4;
+}
+
+inline uint32_t avalanche32(uint32_t h) {
+  h ^= h >> 15;
+  h *= prime32_2;
+  h ^= h >> 13;
+  h *= prime32_3;
+  h ^= h >> 16;
+  return h;
+}
+
+// Hashes each index starting from a prepared accumulator.
+typedef void (*lane_kernel_t)(const vec_t *, size_t, uint32_t, uint32_t *);
+
+#ifdef HASH_KERNELS_X86
+void hash_lanes_tail(const vec_t *idx, size_t n, uint32_t acc, uint32_t *out) {
+  for (size_t k = 0; k < n; ++k) {
+    uint32_t h = round32(acc, (uint32_t) idx[k]);
+    out[k] = avalanche32(round32(h, (uint32_t) (idx[k] >> 32)));
+  }
+}
+
+__attribute__((target("avx2")))
+inline __m256i round_avx2(__m256i acc, __m256i word) {
+  acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(word, _mm256_set1_epi32(prime32_3)));
+  acc = _mm256_or_si256(_mm256_slli_epi32(acc, 17), _mm256_srli_epi32(acc, 15));
+  return _mm256_mullo_epi32(acc, _mm256_set1_epi32(prime32_4));
+}
+
+__attribute__((target("avx2")))
+void hash_lanes_avx2(const vec_t *idx, size_t n, uint32_t acc, uint32_t *out) {
+  const __m256i acc_v = _mm256_set1_epi32(acc);
+  const __m256i deinterleave = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+  size_t k = 0;
+  for (; k + 8 <= n; k += 8) {
+    // split 8 indices into a register of low words and one of high words
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(idx + k));
+    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(idx + k + 4));
+    a = _mm256_permutevar8x32_epi32(a, deinterleave);
+    b = _mm256_permutevar8x32_epi32(b, deinterleave);
+    __m256i lo = _mm256_permute2x128_si256(a, b, 0x20);
+    __m256i hi = _mm256_permute2x128_si256(a, b, 0x31);
+
+    __m256i h = round_avx2(round_avx2(acc_v, lo), hi);
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 15));
+    h = _mm256_mullo_epi32(h, _mm256_set1_epi32(prime32_2));
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+    h = _mm256_mullo_epi32(h, _mm256_set1_epi32(prime32_3));
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + k), h);
+  }
+  hash_lanes_tail(idx + k, n - k, acc, out + k);
+}
+
+// GCC 12's AVX-512 headers trigger spurious uninitialized warnings
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f")))
+inline __m512i round_avx512(__m512i acc, __m512i word) {
+  acc = _mm512_add_epi32(acc, _mm512_mullo_epi32(word, _mm512_set1_epi32(prime32_3)));
+  return _mm512_mullo_epi32(_mm512_rol_epi32(acc, 17), _mm512_set1_epi32(prime32_4));
+}
+
+__attribute__((target("avx512f")))
+void hash_lanes_avx512(const vec_t *idx, size_t n, uint32_t acc, uint32_t *out) {
+  const __m512i acc_v = _mm512_set1_epi32(acc);
+  size_t k = 0;
+  for (; k + 16 <= n; k += 16) {
+    // split 16 indices into a register of low words and one of high words
+    __m512i a = _mm512_loadu_si512(idx + k);
+    __m512i b = _mm512_loadu_si512(idx + k + 8);
+    __m512i lo = _mm512_inserti64x4(_mm512_castsi256_si512(_mm512_cvtepi64_epi32(a)),
+                                    _mm512_cvtepi64_epi32(b), 1);
+    __m512i hi = _mm512_inserti64x4(
+        _mm512_castsi256_si512(_mm512_cvtepi64_epi32(_mm512_srli_epi64(a, 32))),
+        _mm512_cvtepi64_epi32(_mm512_srli_epi64(b, 32)), 1);
+
+    __m512i h = round_avx512(round_avx512(acc_v, lo), hi);
+    h = _mm512_xor_si512(h, _mm512_srli_epi32(h, 15));
+    h = _mm512_mullo_epi32(h, _mm512_set1_epi32(prime32_2));
+    h = _mm512_xor_si512(h, _mm512_srli_epi32(h, 13));
+    h = _mm512_mullo_epi32(h, _mm512_set1_epi32(prime32_3));
+    h = _mm512_xor_si512(h, _mm512_srli_epi32(h, 16));
+    _mm512_storeu_si512(out + k, h);
+  }
+  hash_lanes_tail(idx + k, n - k, acc, out + k);
+}
+#pragma GCC diagnostic pop
+#endif // HASH_KERNELS_X86
+
+lane_kernel_t select_kernel(const char **name) {
+#ifdef HASH_KERNELS_X86
+  if (!std::is_same<Bucket_Boruvka::HashFamily, Bucket_Boruvka::XXH32Hash>::value) {
+    // the lanes only implement XXH32
+    *name = "scalar";
+    return nullptr;
+  }
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    *name = "avx512";
+    return hash_lanes_avx512;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    *name = "avx2";
+    return hash_lanes_avx2;
+  }
+#endif
+  // fall back to calling the hash family directly for each index
+  *name = "scalar";
+  return nullptr;
+}
+
+const char *kernel_name;
+const lane_kernel_t lane_kernel = select_kernel(&kernel_name);
+} // namespace
+
+void Bucket_Boruvka::index_hash_batch(const vec_t *update_idx,
+                                      size_t num_updates, long sketch_seed,
+                                      vec_hash_t *hashes) {
+  if (lane_kernel == nullptr) {
+    for (size_t k = 0; k < num_updates; ++k)
+      hashes[k] = index_hash(update_idx[k], sketch_seed);
+    return;
+  }
+  uint32_t acc = (uint32_t) sketch_seed + prime32_5 + sizeof(vec_t);
+  lane_kernel(update_idx, num_updates, acc, hashes);
+}
+
+void Bucket_Boruvka::col_index_hash_batch(unsigned bucket_col,
+                                          const vec_t *update_idx,
+                                          size_t num_updates, long sketch_seed,
+                                          col_hash_t *hashes) {
+  if (lane_kernel == nullptr) {
+    for (size_t k = 0; k < num_updates; ++k)
+      hashes[k] = col_index_hash(bucket_col, update_idx[k], sketch_seed);
+    return;
+  }
+  uint32_t acc = (uint32_t) sketch_seed + prime32_5 + sizeof(unsigned) + sizeof(vec_t);
+  lane_kernel(update_idx, num_updates, round32(acc, bucket_col), hashes);
+}
+
+const char *Bucket_Boruvka::hash_kernel_name() {
+  return kernel_name;
+}
@@ -1,14 +1,12 @@
 #include "../../include/l0_sampling/sketch.h"
+#include "../../include/l0_sampling/hash_kernels.h"
+#include "../../include/l0_sampling/xor_kernels.h"
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <iostream>
-#include <thread>
-
-int Sketch::failure_factor = 100;
-vec_t Sketch::n;
-size_t Sketch::num_elems;
-size_t Sketch::num_buckets;
-size_t Sketch::num_guesses;
+#include <type_traits>
+#include <utility>
 
 /*
  * Static functions for creating sketches with a provided memory location.
@@ -16,18 +14,33 @@ size_t Sketch::num_guesses;
  * contiguous.
  */
 Sketch *Sketch::makeSketch(void *loc, long seed) {
-  return new (loc) Sketch(seed);
+  return new (loc) Sketch(default_geometry, seed);
 }
 
 Sketch *Sketch::makeSketch(void *loc, long seed, std::fstream &binary_in) {
-  return new (loc) Sketch(seed, binary_in);
+  return new (loc) Sketch(default_geometry, seed, binary_in);
+}
+
+Sketch *Sketch::makeSketch(void *loc, const SketchGeometry &geometry, long seed) {
+  return new (loc) Sketch(geometry, seed);
+}
+
+Sketch *Sketch::makeSketch(void *loc, const SketchGeometry &geometry, long seed,
+                           std::fstream &binary_in) {
+  return new (loc) Sketch(geometry, seed, binary_in);
+}
+
+Sketch *Sketch::makeSketch(void *loc, const SketchGeometry &geometry, long seed,
+                           const char *binary_in) {
+  return new (loc) Sketch(geometry, seed, binary_in);
 }
 
 Sketch *Sketch::makeSketch(void *loc, const Sketch &s) {
   return new (loc) Sketch(s);
 }
 
-Sketch::Sketch(long seed) : seed(seed) {
+Sketch::Sketch(const SketchGeometry &geometry, long seed) : seed(seed), geometry(&geometry) {
+  size_t num_elems = geometry.num_elems;
   // establish the bucket_a and bucket_c locations
   bucket_a = reinterpret_cast<vec_t *>(buckets);
   bucket_c =
@@ -40,7 +53,9 @@ Sketch::Sketch(long seed) : seed(seed) {
   }
 }
 
-Sketch::Sketch(long seed, std::fstream &binary_in) : seed(seed) {
+Sketch::Sketch(const SketchGeometry &geometry, long seed, std::fstream &binary_in) :
+    seed(seed), geometry(&geometry) {
+  size_t num_elems = geometry.num_elems;
   // establish the bucket_a and bucket_c locations
   bucket_a = reinterpret_cast<vec_t *>(buckets);
   bucket_c =
@@ -50,7 +65,17 @@ Sketch::Sketch(long seed, std::fstream &binary_in) : seed(seed) {
   binary_in.read((char *)bucket_c, num_elems * sizeof(vec_hash_t));
 }
 
-Sketch::Sketch(const Sketch &s) : seed(s.seed) {
+// bucket_a and bucket_c lie back to back, as they are written
+Sketch::Sketch(const SketchGeometry &geometry, long seed, const char *binary_in) :
+    seed(seed), geometry(&geometry) {
+  bucket_a = reinterpret_cast<vec_t *>(buckets);
+  bucket_c =
+      reinterpret_cast<vec_hash_t *>(buckets + geometry.num_elems * sizeof(vec_t));
+  std::memcpy(buckets, binary_in, geometry.bucket_bytes());
+}
+
+Sketch::Sketch(const Sketch &s) : seed(s.seed), geometry(s.geometry) {
+  size_t num_elems = geometry->num_elems;
   bucket_a = reinterpret_cast<vec_t *>(buckets);
   bucket_c =
       reinterpret_cast<vec_hash_t *>(buckets + num_elems * sizeof(vec_t));
@@ -59,101 +84,604 @@ Sketch::Sketch(const Sketch &s) : seed(s.seed) {
   std::memcpy(bucket_c, s.bucket_c, num_elems * sizeof(vec_hash_t));
 }
 
-void Sketch::update(const vec_t &update_idx) {
-  XXH64_hash_t update_hash = Bucket_Boruvka::index_hash(update_idx, seed);
-  Bucket_Boruvka::update(bucket_a[num_elems - 1], bucket_c[num_elems - 1],
-                         update_idx, update_hash);
-  for (unsigned i = 0; i < num_buckets; ++i) {
-    col_hash_t col_index_hash =
-        Bucket_Boruvka::col_index_hash(i, update_idx, seed);
-    for (unsigned j = 0; j < num_guesses; ++j) {
-      unsigned bucket_id = i * num_guesses + j;
-      if (Bucket_Boruvka::contains(col_index_hash, 1 << (j + 1))) {
-        // std::cout << " [i,j]: " << i << ", " << j << ' ';
-        // std::cout << ", update_idx = " << update_idx << ' ';
-        // std::cout << ", Bucket Id = " << bucket_id << '\n';
-        Bucket_Boruvka::update(bucket_a[bucket_id], bucket_c[bucket_id],
-                               update_idx, update_hash);
-      } else
-        break;
-    }
+/*
+ * The operations which loop over the buckets of a sketch are written once
+ * against a Geometry giving the number of columns (buckets), guesses per
+ * column and bucket elements, and a way to loop over the columns. Every
+ * kernel takes the SketchGeometry of the operation and makes its Geometry from
+ * it. RuntimeGeometry reads the SketchGeometry. FixedGeometry ignores it and
+ * makes them compile time constants, so the column loop is fully unrolled and
+ * every bucket offset and loop bound is folded into the code.
+ */
+struct RuntimeGeometry {
+  const SketchGeometry &geometry;
+
+  explicit RuntimeGeometry(const SketchGeometry &geometry) : geometry(geometry) {}
+
+  size_t buckets() const { return geometry.num_buckets; }
+  size_t guesses() const { return geometry.num_guesses; }
+  size_t elems() const { return geometry.num_elems; }
+
+  // call f(i) for every column i
+  template <class F>
+  void for_each_column(F f) const {
+    for (unsigned i = 0; i < buckets(); ++i) f(i);
   }
-}
+};
 
-void Sketch::batch_update(const std::vector<vec_t> &updates) {
+template <size_t B, size_t G>
+struct FixedGeometry {
+  explicit FixedGeometry(const SketchGeometry &) {}
+
+  static constexpr size_t buckets() { return B; }
+  static constexpr size_t guesses() { return G; }
+  static constexpr size_t elems() { return B * G + 1; }
+
+  template <class F>
+  static void for_each_column(F f) {
+    for_each_column(f, std::make_index_sequence<B>());
+  }
+
+  template <class F, size_t... I>
+  static void for_each_column(F f, std::index_sequence<I...>) {
+    int unrolled[] = {(f((unsigned) I), 0)...};
+    (void) unrolled;
+  }
+};
+
+/*
+ * Updates are hashed in blocks so that the hashes of a whole block can be
+ * computed at once by the vectorized kernels in hash_kernels.h, then the
+ * block is applied column by column exactly as Sketch::update would.
+ */
+static constexpr size_t hash_block_size = 64;
 
-  const bool use_threads = true;
-  if (use_threads) {
-    const std::size_t subpatch_size{512};
-    const std::size_t num_subpatches{(updates.size() + subpatch_size - 1) /
-                                     subpatch_size};
-    std::thread update_threads[num_subpatches];
-    for (std::size_t i = 0; i < num_subpatches; i++) {
-      auto start = i * subpatch_size;
-      auto end = std::min(start + subpatch_size, updates.size());
-      update_threads[i] = std::thread([&] {
-        for (std::size_t j = start; j < end; j++) {
-          update(updates[j]);
+/*
+ * A supernode has fewer than 64 sketches, log2(n)/(log2(3)-1) for n < 2^32,
+ * and a sketch at most 32 columns, as its failure factor is an int, so the
+ * per-sketch state of a run fits on the stack.
+ */
+static constexpr size_t max_run_sketches = 64;
+static constexpr size_t max_columns = 32;
+
+template <class Geometry>
+struct SketchKernel {
+  /*
+   * An index is placed in the first d guesses of a column, where d is the
+   * depth given by the trailing zeros of its column hash. Computing d up front
+   * makes the bucket loop a simple count instead of a test per guess.
+   */
+  static void update(const SketchGeometry &geometry, Sketch &sketch,
+                     const vec_t &update_idx) {
+    const Geometry geo(geometry);
+    const size_t last = geo.elems() - 1;
+    vec_hash_t update_hash = Bucket_Boruvka::index_hash(update_idx, sketch.seed);
+    Bucket_Boruvka::atomic_update(sketch.bucket_a[last], sketch.bucket_c[last],
+                                  update_idx, update_hash);
+    geo.for_each_column([&](unsigned i) {
+      col_hash_t col_index_hash =
+          Bucket_Boruvka::col_index_hash(i, update_idx, sketch.seed);
+      unsigned depth =
+          Bucket_Boruvka::get_index_depth(col_index_hash, geo.guesses());
+      unsigned col_start = i * geo.guesses();
+      for (unsigned j = 0; j < depth; ++j) {
+        Bucket_Boruvka::atomic_update(sketch.bucket_a[col_start + j],
+                                      sketch.bucket_c[col_start + j],
+                                      update_idx, update_hash);
+      }
+    });
+  }
+
+  /**
+   * Hash a block of at most hash_block_size updates with hasher and call
+   * touch(bucket, update_idx, update_hash) for every bucket they land in.
+   * If heights is not null the column heights are raised to cover them.
+   * @return false if touch returned false, which stops the loop early.
+   */
+  template <class Hasher, class Touch>
+  static bool for_each_block_touch(const SketchGeometry &geometry,
+                                   const Hasher &hasher, const vec_t *block,
+                                   size_t block_size, Touch touch,
+                                   uint8_t *heights) {
+    const Geometry geo(geometry);
+    vec_hash_t update_hashes[hash_block_size];
+    col_hash_t col_hashes[hash_block_size];
+    hasher.index_hashes(block, block_size, update_hashes);
+    for (size_t k = 0; k < block_size; ++k) {
+      if (!touch(geo.elems() - 1, block[k], update_hashes[k])) return false;
+    }
+    bool stopped = false;
+    geo.for_each_column([&](unsigned i) {
+      if (stopped) return;
+      hasher.col_hashes(i, block, block_size, col_hashes);
+      unsigned col_start = i * geo.guesses();
+      unsigned height = 0;
+      for (size_t k = 0; k < block_size; ++k) {
+        unsigned depth =
+            Bucket_Boruvka::get_index_depth(col_hashes[k], geo.guesses());
+        height = std::max(height, depth);
+        for (unsigned j = 0; j < depth; ++j) {
+          if (!touch(col_start + j, block[k], update_hashes[k])) {
+            stopped = true;
+            return;
+          }
         }
-      });
+      }
+      if (heights != nullptr && height > heights[i]) heights[i] = height;
+    });
+    return !stopped;
+  }
+
+  // hashes blocks with the vectorized kernels in hash_kernels.h
+  struct SeededHasher {
+    long seed;
+    void index_hashes(const vec_t *block, size_t block_size, vec_hash_t *out) const {
+      Bucket_Boruvka::index_hash_batch(block, block_size, seed, out);
     }
-    for (std::size_t i = 0; i < num_subpatches; i++) {
-      update_threads[i].join();
+    void col_hashes(unsigned col, const vec_t *block, size_t block_size,
+                    col_hash_t *out) const {
+      Bucket_Boruvka::col_index_hash_batch(col, block, block_size, seed, out);
     }
-  } else {
-    for (const auto &update_idx : updates) {
-      update(update_idx);
+  };
+
+  /**
+   * Hash a range of updates and call touch(bucket, update_idx, update_hash)
+   * for every bucket of a sketch with the given seed that they land in.
+   * Stops early if touch returns false.
+   */
+  template <class Touch>
+  static void for_each_touch(const SketchGeometry &geometry, long seed,
+                             const vec_t *updates, size_t num_updates, Touch touch,
+                             uint8_t *heights = nullptr) {
+    const SeededHasher hasher{seed};
+    for (size_t start = 0; start < num_updates; start += hash_block_size) {
+      size_t block_size = std::min(hash_block_size, num_updates - start);
+      if (!for_each_block_touch(geometry, hasher, updates + start, block_size, touch,
+                                heights))
+        return;
     }
   }
-}
 
-std::pair<vec_t, SampleSketchRet> Sketch::query() {
-  if (already_quered) {
-    throw MultipleQueryException();
+  static void batch_update(const SketchGeometry &geometry, Sketch &sketch,
+                           const vec_t *updates, size_t num_updates) {
+    tracked_batch_update(geometry, sketch, updates, num_updates, nullptr);
+  }
+
+  // batch_update which also raises the column heights of the sketch
+  static void tracked_batch_update(const SketchGeometry &geometry, Sketch &sketch,
+                                   const vec_t *updates, size_t num_updates,
+                                   uint8_t *heights) {
+    vec_t *bucket_a = sketch.bucket_a;
+    vec_hash_t *bucket_c = sketch.bucket_c;
+    for_each_touch(geometry, sketch.seed, updates, num_updates,
+                   [=](size_t bucket, vec_t update_idx, vec_hash_t update_hash) {
+      Bucket_Boruvka::update(bucket_a[bucket], bucket_c[bucket], update_idx,
+                             update_hash);
+      return true;
+    }, heights);
+  }
+
+  static size_t collect_touches(const SketchGeometry &geometry, long seed,
+                                uint16_t sketch_idx, const vec_t *updates, size_t num_updates,
+                                BucketTouch *touches, size_t max_touches) {
+    size_t num_touches = 0;
+    for_each_touch(geometry, seed, updates, num_updates,
+                   [&num_touches, touches, max_touches, sketch_idx](
+                       size_t bucket, vec_t update_idx, vec_hash_t update_hash) {
+      // give up once full, the caller falls back to a dense delta
+      if (num_touches == max_touches) {
+        ++num_touches;
+        return false;
+      }
+      touches[num_touches++] = {sketch_idx, (uint16_t) bucket, update_hash, update_idx};
+      return true;
+    });
+    return num_touches;
+  }
+
+  // a run of sketches is packed stride bytes apart
+  static Sketch *sketch_at(Sketch *first, size_t s, size_t stride) {
+    return reinterpret_cast<Sketch *>(reinterpret_cast<char *>(first) + s * stride);
+  }
+
+  static void batch_update_run(const SketchGeometry &geometry, Sketch *first,
+                               size_t num_sketches, size_t stride,
+                               const vec_t *updates, size_t num_updates,
+                               uint8_t *heights) {
+    batch_update_run(geometry, first, num_sketches, stride, updates, num_updates,
+                     heights, fused());
+  }
+
+  static size_t collect_run_touches(const SketchGeometry &geometry, long seed,
+                                    size_t num_sketches, const vec_t *updates, size_t num_updates,
+                                    BucketTouch *touches, size_t max_touches) {
+    return collect_run_touches(geometry, seed, num_sketches, updates, num_updates,
+                               touches, max_touches, fused());
+  }
+
+  /*
+   * Without FusedHash every sketch of a run hashes the updates with its own
+   * seed, so the run is simply handled one sketch at a time.
+   */
+  typedef std::is_same<Bucket_Boruvka::HashFamily, Bucket_Boruvka::FusedHash> fused;
+
+  static void batch_update_run(const SketchGeometry &geometry, Sketch *first,
+                               size_t num_sketches, size_t stride,
+                               const vec_t *updates, size_t num_updates,
+                               uint8_t *heights, std::false_type) {
+    const Geometry geo(geometry);
+    for (size_t s = 0; s < num_sketches; ++s) {
+      tracked_batch_update(geometry, *sketch_at(first, s, stride), updates,
+                           num_updates, heights ? heights + s * geo.buckets() : nullptr);
+    }
+  }
+
+  static size_t collect_run_touches(const SketchGeometry &geometry, long seed,
+                                    size_t num_sketches, const vec_t *updates, size_t num_updates,
+                                    BucketTouch *touches, size_t max_touches,
+                                    std::false_type) {
+    size_t num_touches = 0;
+    for (size_t s = 0; s < num_sketches && num_touches <= max_touches; ++s) {
+      num_touches += collect_touches(geometry, seed + s, s, updates, num_updates,
+                                     touches + num_touches, max_touches - num_touches);
+    }
+    return num_touches;
+  }
+
+  /*
+   * With FusedHash an update is hashed once for the whole run, and every
+   * sketch derives its index and column hashes from that wide hash with one
+   * multiply each. The wide hashes of a block of updates are computed up
+   * front, then the block is applied one sketch at a time so that the buckets
+   * of the sketch being updated stay in cache.
+   */
+  static size_t num_fused_keys(const SketchGeometry &geometry) {
+    return Geometry(geometry).buckets() + 1;
+  }
+
+  // the index key and then the column keys of the sketch with the given seed
+  static void fused_keys(const SketchGeometry &geometry, long seed, uint64_t *keys) {
+    const Geometry geo(geometry);
+    keys[0] = Bucket_Boruvka::FusedHash::index_key(seed);
+    for (unsigned i = 0; i < geo.buckets(); ++i) {
+      keys[i + 1] = Bucket_Boruvka::FusedHash::col_key(i, seed);
+    }
+  }
+
+  // derives the hashes of a block from its wide hashes and a sketch's keys
+  struct FusedHasher {
+    const uint64_t *wide_hashes;
+    const uint64_t *keys;
+    void index_hashes(const vec_t *, size_t block_size, vec_hash_t *out) const {
+      for (size_t k = 0; k < block_size; ++k)
+        out[k] = Bucket_Boruvka::FusedHash::derive(wide_hashes[k], keys[0]);
+    }
+    void col_hashes(unsigned col, const vec_t *, size_t block_size,
+                    col_hash_t *out) const {
+      for (size_t k = 0; k < block_size; ++k)
+        out[k] = Bucket_Boruvka::FusedHash::derive(wide_hashes[k], keys[col + 1]);
+    }
+  };
+
+  /**
+   * Call touch(s, bucket, update_idx, update_hash) for every bucket of sketch
+   * s of the run that a range of updates lands in, for every s. keys holds
+   * the fused_keys of each sketch. Stops early if touch returns false.
+   * If heights is not null the column heights of the run are raised.
+   */
+  template <class Touch>
+  static void for_each_fused_touch(const SketchGeometry &geometry,
+                                   const uint64_t *keys, size_t num_sketches,
+                                   const vec_t *updates, size_t num_updates,
+                                    Touch touch, uint8_t *heights = nullptr) {
+    const Geometry geo(geometry);
+    uint64_t wide_hashes[hash_block_size];
+    for (size_t start = 0; start < num_updates; start += hash_block_size) {
+      const vec_t *block = updates + start;
+      size_t block_size = std::min(hash_block_size, num_updates - start);
+      for (size_t k = 0; k < block_size; ++k) {
+        wide_hashes[k] = Bucket_Boruvka::FusedHash::wide(block[k]);
+      }
+      for (size_t s = 0; s < num_sketches; ++s) {
+        const FusedHasher hasher{wide_hashes, keys + s * num_fused_keys(geometry)};
+        if (!for_each_block_touch(geometry, hasher, block, block_size,
+               [&touch, s](size_t bucket, vec_t update_idx, vec_hash_t update_hash) {
+                 return touch(s, bucket, update_idx, update_hash);
+               }, heights ? heights + s * geo.buckets() : nullptr))
+          return;
+      }
+    }
   }
-  already_quered = true;
 
-  if (bucket_a[num_elems - 1] == 0 && bucket_c[num_elems - 1] == 0) {
-    return {0, ZERO}; // the "first" bucket is deterministic so if it is all
-                      // zero then there are no edges to return
+  static void batch_update_run(const SketchGeometry &geometry, Sketch *first,
+                               size_t num_sketches, size_t stride,
+                               const vec_t *updates, size_t num_updates,
+                               uint8_t *heights, std::true_type) {
+    assert(num_sketches <= max_run_sketches);
+    uint64_t keys[max_run_sketches * (max_columns + 1)];
+    vec_t *bucket_a[max_run_sketches];
+    vec_hash_t *bucket_c[max_run_sketches];
+    for (size_t s = 0; s < num_sketches; ++s) {
+      Sketch *sketch = sketch_at(first, s, stride);
+      fused_keys(geometry, sketch->seed, &keys[s * num_fused_keys(geometry)]);
+      bucket_a[s] = sketch->bucket_a;
+      bucket_c[s] = sketch->bucket_c;
+    }
+    vec_t **a = bucket_a;
+    vec_hash_t **c = bucket_c;
+    for_each_fused_touch(geometry, keys, num_sketches, updates, num_updates,
+                         [=](size_t s, size_t bucket, vec_t update_idx,
+                             vec_hash_t update_hash) {
+      Bucket_Boruvka::update(a[s][bucket], c[s][bucket], update_idx, update_hash);
+      return true;
+    }, heights);
   }
-  if (Bucket_Boruvka::is_good(bucket_a[num_elems - 1], bucket_c[num_elems - 1],
-                              seed)) {
-    return {bucket_a[num_elems - 1], GOOD};
+
+  static size_t collect_run_touches(const SketchGeometry &geometry, long seed,
+                                    size_t num_sketches, const vec_t *updates, size_t num_updates,
+                                    BucketTouch *touches, size_t max_touches,
+                                    std::true_type) {
+    assert(num_sketches <= max_run_sketches);
+    uint64_t keys[max_run_sketches * (max_columns + 1)];
+    for (size_t s = 0; s < num_sketches; ++s) {
+      fused_keys(geometry, seed + s, &keys[s * num_fused_keys(geometry)]);
+    }
+    size_t num_touches = 0;
+    for_each_fused_touch(geometry, keys, num_sketches, updates, num_updates,
+                         [&num_touches, touches, max_touches](size_t s,
+                             size_t bucket, vec_t update_idx, vec_hash_t update_hash) {
+      if (num_touches == max_touches) {
+        ++num_touches;
+        return false;
+      }
+      touches[num_touches++] = {(uint16_t) s, (uint16_t) bucket, update_hash, update_idx};
+      return true;
+    });
+    return num_touches;
   }
-  for (unsigned i = 0; i < num_buckets; ++i) {
-    for (unsigned j = 0; j < num_guesses; ++j) {
-      unsigned bucket_id = i * num_guesses + j;
-      if (Bucket_Boruvka::is_good(bucket_a[bucket_id], bucket_c[bucket_id], i,
-                                  2 << j, seed)) {
-        return {bucket_a[bucket_id], GOOD};
+
+  static std::pair<vec_t, SampleSketchRet> query(const SketchGeometry &geometry,
+                                                 const Sketch &sketch) {
+    const Geometry geo(geometry);
+    const size_t last = geo.elems() - 1;
+    const vec_t *bucket_a = sketch.bucket_a;
+    const vec_hash_t *bucket_c = sketch.bucket_c;
+    if (bucket_a[last] == 0 && bucket_c[last] == 0) {
+      return {0, ZERO}; // the "first" bucket is deterministic so if it is all
+                        // zero then there are no edges to return
+    }
+    if (Bucket_Boruvka::is_good(bucket_a[last], bucket_c[last], sketch.seed)) {
+      return {bucket_a[last], GOOD};
+    }
+    for (unsigned i = 0; i < geo.buckets(); ++i) {
+      for (unsigned j = 0; j < geo.guesses(); ++j) {
+        unsigned bucket_id = i * geo.guesses() + j;
+        if (Bucket_Boruvka::is_good(bucket_a[bucket_id], bucket_c[bucket_id], i,
+                                    j, sketch.seed)) {
+          return {bucket_a[bucket_id], GOOD};
+        }
       }
     }
+    return {0, FAIL};
+  }
+};
+
+struct SketchKernels {
+  void (*update)(const SketchGeometry &geometry, Sketch &sketch,
+                 const vec_t &update_idx);
+  void (*batch_update)(const SketchGeometry &geometry, Sketch &sketch,
+                       const vec_t *updates, size_t num_updates);
+  size_t (*collect_touches)(const SketchGeometry &geometry, long seed,
+                            uint16_t sketch_idx, const vec_t *updates,
+                            size_t num_updates, BucketTouch *touches,
+                            size_t max_touches);
+  void (*batch_update_run)(const SketchGeometry &geometry, Sketch *first,
+                           size_t num_sketches, size_t stride,
+                           const vec_t *updates, size_t num_updates,
+                           uint8_t *heights);
+  size_t (*collect_run_touches)(const SketchGeometry &geometry, long seed,
+                                size_t num_sketches, const vec_t *updates,
+                                size_t num_updates, BucketTouch *touches,
+                                size_t max_touches);
+  std::pair<vec_t, SampleSketchRet> (*query)(const SketchGeometry &geometry,
+                                             const Sketch &sketch);
+  const char *name;
+};
+
+template <class Geometry>
+static constexpr SketchKernels make_kernels(const char *name) {
+  return {SketchKernel<Geometry>::update, SketchKernel<Geometry>::batch_update,
+          SketchKernel<Geometry>::collect_touches,
+          SketchKernel<Geometry>::batch_update_run,
+          SketchKernel<Geometry>::collect_run_touches,
+          SketchKernel<Geometry>::query, name};
+}
+
+static const SketchKernels generic_kernels = make_kernels<RuntimeGeometry>("generic");
+
+/*
+ * Fixed geometries are instantiated for the default failure factor of 100
+ * (7 columns) and vectors of length n*n for n from 2^13 to 2^20 nodes, i.e.
+ * 27 to 41 guesses per column. Anything else runs the generic kernels.
+ */
+static constexpr size_t fixed_buckets = 7;
+static constexpr size_t min_fixed_guesses = 27;
+static constexpr size_t max_fixed_guesses = 41;
+
+template <size_t... I>
+static const SketchKernels *fixed_kernels(size_t guesses,
+                                          std::index_sequence<I...>) {
+  static const SketchKernels table[] = {
+      make_kernels<FixedGeometry<fixed_buckets, min_fixed_guesses + I>>("fixed")...};
+  return &table[guesses - min_fixed_guesses];
+}
+
+SketchGeometry::SketchGeometry(vec_t n, int failure_factor) : n(n),
+    failure_factor(failure_factor), num_buckets(bucket_gen(failure_factor)),
+    num_guesses(guess_gen(n)), num_elems(num_buckets * num_guesses + 1) {
+  select_kernels();
+}
+
+void SketchGeometry::select_kernels(bool allow_fixed) {
+  kernels = &generic_kernels;
+  if (allow_fixed && num_buckets == fixed_buckets &&
+      num_guesses >= min_fixed_guesses && num_guesses <= max_fixed_guesses) {
+    kernels = fixed_kernels(num_guesses,
+        std::make_index_sequence<max_fixed_guesses - min_fixed_guesses + 1>());
+  }
+}
+
+size_t SketchGeometry::sketch_sizeof() const {
+  size_t size = sizeof(Sketch) + bucket_bytes() - sizeof(char);
+  return (size + alignof(Sketch) - 1) / alignof(Sketch) * alignof(Sketch);
+}
+
+// a placeholder until configure() is called, defined after the kernels it selects from
+SketchGeometry Sketch::default_geometry(4, 100);
+
+const char *Sketch::get_kernel_name() {
+  return default_geometry.kernels->name;
+}
+
+void Sketch::update(const vec_t &update_idx) {
+  geometry->kernels->update(*geometry, *this, update_idx);
+}
+
+void Sketch::batch_update(const std::vector<vec_t> &updates) {
+  batch_update(updates.data(), updates.size());
+}
+
+void Sketch::batch_update(const vec_t *updates, size_t num_updates) {
+  geometry->kernels->batch_update(*geometry, *this, updates, num_updates);
+}
+
+size_t Sketch::collect_touches(long seed, uint16_t sketch_idx, const vec_t *updates,
+                               size_t num_updates, BucketTouch *touches,
+                               size_t max_touches, const SketchGeometry &geometry) {
+  assert(geometry.num_elems <= UINT16_MAX);
+  return geometry.kernels->collect_touches(geometry, seed, sketch_idx, updates,
+                                           num_updates, touches, max_touches);
+}
+
+void Sketch::batch_update_run(Sketch *first, size_t num_sketches, size_t stride,
+                              const vec_t *updates, size_t num_updates,
+                              uint8_t *heights) {
+  const SketchGeometry &geometry = *first->geometry;
+  geometry.kernels->batch_update_run(geometry, first, num_sketches, stride,
+                                     updates, num_updates, heights);
+}
+
+size_t Sketch::collect_run_touches(long seed, size_t num_sketches,
+                                   const vec_t *updates, size_t num_updates,
+                                   BucketTouch *touches, size_t max_touches,
+                                   const SketchGeometry &geometry) {
+  assert(geometry.num_elems <= UINT16_MAX && num_sketches <= UINT16_MAX);
+  return geometry.kernels->collect_run_touches(geometry, seed, num_sketches, updates,
+                                               num_updates, touches, max_touches);
+}
+
+std::pair<vec_t, SampleSketchRet> Sketch::query() {
+  if (already_quered) {
+    throw MultipleQueryException();
   }
-  return {0, FAIL};
+  already_quered = true;
+  return geometry->kernels->query(*geometry, *this);
+}
+
+std::pair<vec_t, SampleSketchRet> Sketch::peek_query() const {
+  return geometry->kernels->query(*geometry, *this);
 }
 
 Sketch &operator+=(Sketch &sketch1, const Sketch &sketch2) {
   assert(sketch1.seed == sketch2.seed);
-  for (unsigned i = 0; i < Sketch::num_elems; i++) {
-    sketch1.bucket_a[i] ^= sketch2.bucket_a[i];
-    sketch1.bucket_c[i] ^= sketch2.bucket_c[i];
-  }
+  size_t bucket_bytes = sketch1.geometry->bucket_bytes();
+  Bucket_Boruvka::xor_rows(sketch1.buckets, sketch2.buckets, 1, bucket_bytes,
+                           bucket_bytes);
   sketch1.already_quered = sketch1.already_quered || sketch2.already_quered;
   return sketch1;
 }
 
+/*
+ * The sketches of a run are separated by their headers (seed, geometry,
+ * bucket pointers and query flag), so the buckets are XORed as one row per sketch
+ * with the kernel dispatched once for the whole run.
+ */
+void Sketch::add_sketches(Sketch *dst, const Sketch *src, size_t num_sketches,
+                          size_t stride) {
+  if (num_sketches == 0) return;
+  for (size_t i = 0; i < num_sketches; ++i) {
+    Sketch *sketch1 = reinterpret_cast<Sketch *>((char *)dst + i * stride);
+    const Sketch *sketch2 =
+        reinterpret_cast<const Sketch *>((const char *)src + i * stride);
+    assert(sketch1->seed == sketch2->seed);
+    sketch1->already_quered = sketch1->already_quered || sketch2->already_quered;
+  }
+  Bucket_Boruvka::xor_rows(dst->buckets, src->buckets, num_sketches,
+                           dst->geometry->bucket_bytes(), stride);
+}
+
+/*
+ * The visited buckets are the first heights[i] guesses of each column i plus
+ * the deterministic bucket, so each column is a short contiguous row.
+ */
+template <class Visit>
+static void for_each_dirty_row(size_t num_sketches, const uint8_t *heights,
+                               size_t num_buckets, size_t num_guesses,
+                               Visit visit) {
+  for (size_t s = 0; s < num_sketches; ++s) {
+    visit(s, num_buckets * num_guesses, 1);
+    for (size_t i = 0; i < num_buckets; ++i) {
+      size_t height = heights[s * num_buckets + i];
+      if (height > 0) visit(s, i * num_guesses, height);
+    }
+  }
+}
+
+void Sketch::add_and_clear_sketches(Sketch *dst, Sketch *src, size_t num_sketches,
+                                    size_t stride, uint8_t *heights) {
+  size_t num_buckets = dst->geometry->num_buckets;
+  size_t num_guesses = dst->geometry->num_guesses;
+  for_each_dirty_row(num_sketches, heights, num_buckets, num_guesses,
+                     [=](size_t s, size_t start, size_t len) {
+    Sketch *sketch1 = reinterpret_cast<Sketch *>((char *)dst + s * stride);
+    Sketch *sketch2 = reinterpret_cast<Sketch *>((char *)src + s * stride);
+    sketch1->already_quered = sketch1->already_quered || sketch2->already_quered;
+    Bucket_Boruvka::xor_and_clear_rows((char *)(sketch1->bucket_a + start),
+                                       (char *)(sketch2->bucket_a + start), 1,
+                                       len * sizeof(vec_t), len * sizeof(vec_t));
+    Bucket_Boruvka::xor_and_clear_rows((char *)(sketch1->bucket_c + start),
+                                       (char *)(sketch2->bucket_c + start), 1,
+                                       len * sizeof(vec_hash_t), len * sizeof(vec_hash_t));
+  });
+  std::memset(heights, 0, num_sketches * num_buckets);
+}
+
+void Sketch::clear_sketches(Sketch *run, size_t num_sketches, size_t stride,
+                            uint8_t *heights) {
+  size_t num_buckets = run->geometry->num_buckets;
+  size_t num_guesses = run->geometry->num_guesses;
+  for_each_dirty_row(num_sketches, heights, num_buckets, num_guesses,
+                     [=](size_t s, size_t start, size_t len) {
+    Sketch *sketch = reinterpret_cast<Sketch *>((char *)run + s * stride);
+    std::memset(sketch->bucket_a + start, 0, len * sizeof(vec_t));
+    std::memset(sketch->bucket_c + start, 0, len * sizeof(vec_hash_t));
+  });
+  std::memset(heights, 0, num_sketches * num_buckets);
+}
+
 bool operator==(const Sketch &sketch1, const Sketch &sketch2) {
   if (sketch1.seed != sketch2.seed ||
-      sketch1.already_quered != sketch2.already_quered)
+      sketch1.already_quered != sketch2.already_quered ||
+      sketch1.geometry->num_elems != sketch2.geometry->num_elems)
     return false;
 
-  for (size_t i = 0; i < Sketch::num_elems; ++i) {
+  size_t num_elems = sketch1.geometry->num_elems;
+  for (size_t i = 0; i < num_elems; ++i) {
     if (sketch1.bucket_a[i] != sketch2.bucket_a[i])
       return false;
   }
 
-  for (size_t i = 0; i < Sketch::num_elems; ++i) {
+  for (size_t i = 0; i < num_elems; ++i) {
     if (sketch1.bucket_c[i] != sketch2.bucket_c[i])
       return false;
   }
@@ -162,28 +690,30 @@ bool operator==(const Sketch &sketch1, const Sketch &sketch2) {
 }
 
 std::ostream &operator<<(std::ostream &os, const Sketch &sketch) {
-  for (unsigned k = 0; k < Sketch::n; k++) {
+  const SketchGeometry &geometry = *sketch.geometry;
+  for (unsigned k = 0; k < geometry.n; k++) {
     os << '1';
   }
   os << std::endl
-     << "a:" << sketch.bucket_a[Sketch::num_buckets * Sketch::num_guesses]
+     << "a:" << sketch.bucket_a[geometry.num_buckets * geometry.num_guesses]
      << std::endl
-     << "c:" << sketch.bucket_c[Sketch::num_buckets * Sketch::num_guesses]
+     << "c:" << sketch.bucket_c[geometry.num_buckets * geometry.num_guesses]
      << std::endl
      << (Bucket_Boruvka::is_good(
-             sketch.bucket_a[Sketch::num_buckets * Sketch::num_guesses],
-             sketch.bucket_c[Sketch::num_buckets * Sketch::num_guesses],
+             sketch.bucket_a[geometry.num_buckets * geometry.num_guesses],
+             sketch.bucket_c[geometry.num_buckets * geometry.num_guesses],
              sketch.seed)
              ? "good"
              : "bad")
      << std::endl;
 
-  for (unsigned i = 0; i < Sketch::num_buckets; ++i) {
-    for (unsigned j = 0; j < Sketch::num_guesses; ++j) {
-      unsigned bucket_id = i * Sketch::num_guesses + j;
-      for (unsigned k = 0; k < Sketch::n; k++) {
-        os << (Bucket_Boruvka::contains(
-                   Bucket_Boruvka::col_index_hash(i, k, sketch.seed), 2 << j)
+  for (unsigned i = 0; i < geometry.num_buckets; ++i) {
+    for (unsigned j = 0; j < geometry.num_guesses; ++j) {
+      unsigned bucket_id = i * geometry.num_guesses + j;
+      for (unsigned k = 0; k < geometry.n; k++) {
+        os << (j < Bucket_Boruvka::get_index_depth(
+                       Bucket_Boruvka::col_index_hash(i, k, sketch.seed),
+                       geometry.num_guesses)
                    ? '1'
                    : '0');
       }
@@ -191,7 +721,7 @@ std::ostream &operator<<(std::ostream &os, const Sketch &sketch) {
          << "a:" << sketch.bucket_a[bucket_id] << std::endl
          << "c:" << sketch.bucket_c[bucket_id] << std::endl
          << (Bucket_Boruvka::is_good(sketch.bucket_a[bucket_id],
-                                     sketch.bucket_c[bucket_id], i, 2 << j,
+                                     sketch.bucket_c[bucket_id], i, j,
                                      sketch.seed)
                  ? "good"
                  : "bad")
@@ -201,7 +731,11 @@ std::ostream &operator<<(std::ostream &os, const Sketch &sketch) {
   return os;
 }
 
-void Sketch::write_binary(std::fstream &binary_out) {
-  binary_out.write((char *)bucket_a, num_elems * sizeof(vec_t));
-  binary_out.write((char *)bucket_c, num_elems * sizeof(vec_hash_t));
+void Sketch::write_binary(std::fstream &binary_out) const {
+  binary_out.write((char *)bucket_a, geometry->num_elems * sizeof(vec_t));
+  binary_out.write((char *)bucket_c, geometry->num_elems * sizeof(vec_hash_t));
+}
+
+void Sketch::write_binary(char *binary_out) const {
+  std::memcpy(binary_out, buckets, geometry->bucket_bytes());
 }
@@ -0,0 +1,204 @@
+#include "../../include/l0_sampling/xor_kernels.h"
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XOR_KERNELS_X86
+#endif
+
+namespace {
+// XORs len bytes of src into dst
+typedef void (*xor_kernel_t)(char *, const char *, size_t);
+// XORs len bytes of src into dst and zeroes them in src
+typedef void (*xor_clear_kernel_t)(char *, char *, size_t);
+
+// word at a time, then byte at a time for whatever is left
+inline void xor_tail(char *dst, const char *src, size_t len) {
+  size_t k = 0;
+  for (; k + sizeof(uint64_t) <= len; k += sizeof(uint64_t)) {
+    uint64_t a, b;
+    std::memcpy(&a, dst + k, sizeof(a));
+    std::memcpy(&b, src + k, sizeof(b));
+    a ^= b;
+    std::memcpy(dst + k, &a, sizeof(a));
+  }
+  for (; k < len; ++k) dst[k] ^= src[k];
+}
+
+void xor_scalar(char *dst, const char *src, size_t len) {
+  xor_tail(dst, src, len);
+}
+
+inline void xor_clear_tail(char *dst, char *src, size_t len) {
+  xor_tail(dst, src, len);
+  std::memset(src, 0, len);
+}
+
+void xor_clear_scalar(char *dst, char *src, size_t len) {
+  xor_clear_tail(dst, src, len);
+}
+
+#ifdef XOR_KERNELS_X86
+__attribute__((target("avx2")))
+void xor_avx2(char *dst, const char *src, size_t len) {
+  size_t k = 0;
+  for (; k + 128 <= len; k += 128) {
+    __m256i a0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + k));
+    __m256i a1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + k + 32));
+    __m256i a2 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + k + 64));
+    __m256i a3 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + k + 96));
+    __m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + k));
+    __m256i b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + k + 32));
+    __m256i b2 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + k + 64));
+    __m256i b3 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + k + 96));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + k), _mm256_xor_si256(a0, b0));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + k + 32), _mm256_xor_si256(a1, b1));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + k + 64), _mm256_xor_si256(a2, b2));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + k + 96), _mm256_xor_si256(a3, b3));
+  }
+  for (; k + 32 <= len; k += 32) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + k));
+    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + k));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + k), _mm256_xor_si256(a, b));
+  }
+  xor_tail(dst + k, src + k, len - k);
+}
+
+__attribute__((target("avx2")))
+void xor_clear_avx2(char *dst, char *src, size_t len) {
+  const __m256i zero = _mm256_setzero_si256();
+  size_t k = 0;
+  for (; k + 64 <= len; k += 64) {
+    __m256i a0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + k));
+    __m256i a1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + k + 32));
+    __m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + k));
+    __m256i b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + k + 32));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + k), _mm256_xor_si256(a0, b0));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + k + 32), _mm256_xor_si256(a1, b1));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(src + k), zero);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(src + k + 32), zero);
+  }
+  for (; k + 32 <= len; k += 32) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + k));
+    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + k));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + k), _mm256_xor_si256(a, b));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(src + k), zero);
+  }
+  xor_clear_tail(dst + k, src + k, len - k);
+}
+
+// GCC 12's AVX-512 headers trigger spurious uninitialized warnings
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f")))
+void xor_avx512(char *dst, const char *src, size_t len) {
+  size_t k = 0;
+  for (; k + 256 <= len; k += 256) {
+    __m512i a0 = _mm512_loadu_si512(dst + k);
+    __m512i a1 = _mm512_loadu_si512(dst + k + 64);
+    __m512i a2 = _mm512_loadu_si512(dst + k + 128);
+    __m512i a3 = _mm512_loadu_si512(dst + k + 192);
+    __m512i b0 = _mm512_loadu_si512(src + k);
+    __m512i b1 = _mm512_loadu_si512(src + k + 64);
+    __m512i b2 = _mm512_loadu_si512(src + k + 128);
+    __m512i b3 = _mm512_loadu_si512(src + k + 192);
+    _mm512_storeu_si512(dst + k, _mm512_xor_si512(a0, b0));
+    _mm512_storeu_si512(dst + k + 64, _mm512_xor_si512(a1, b1));
+    _mm512_storeu_si512(dst + k + 128, _mm512_xor_si512(a2, b2));
+    _mm512_storeu_si512(dst + k + 192, _mm512_xor_si512(a3, b3));
+  }
+  for (; k + 64 <= len; k += 64) {
+    __m512i a = _mm512_loadu_si512(dst + k);
+    __m512i b = _mm512_loadu_si512(src + k);
+    _mm512_storeu_si512(dst + k, _mm512_xor_si512(a, b));
+  }
+  // the final partial vector is handled with a masked load and store
+  if (k < len) {
+    __mmask16 mask = (__mmask16) ((1u << ((len - k) / 4)) - 1);
+    __m512i a = _mm512_maskz_loadu_epi32(mask, dst + k);
+    __m512i b = _mm512_maskz_loadu_epi32(mask, src + k);
+    _mm512_mask_storeu_epi32(dst + k, mask, _mm512_xor_si512(a, b));
+    k += (len - k) / 4 * 4;
+  }
+  xor_tail(dst + k, src + k, len - k);
+}
+
+__attribute__((target("avx512f")))
+void xor_clear_avx512(char *dst, char *src, size_t len) {
+  const __m512i zero = _mm512_setzero_si512();
+  size_t k = 0;
+  for (; k + 128 <= len; k += 128) {
+    __m512i a0 = _mm512_loadu_si512(dst + k);
+    __m512i a1 = _mm512_loadu_si512(dst + k + 64);
+    __m512i b0 = _mm512_loadu_si512(src + k);
+    __m512i b1 = _mm512_loadu_si512(src + k + 64);
+    _mm512_storeu_si512(dst + k, _mm512_xor_si512(a0, b0));
+    _mm512_storeu_si512(dst + k + 64, _mm512_xor_si512(a1, b1));
+    _mm512_storeu_si512(src + k, zero);
+    _mm512_storeu_si512(src + k + 64, zero);
+  }
+  for (; k + 64 <= len; k += 64) {
+    __m512i a = _mm512_loadu_si512(dst + k);
+    __m512i b = _mm512_loadu_si512(src + k);
+    _mm512_storeu_si512(dst + k, _mm512_xor_si512(a, b));
+    _mm512_storeu_si512(src + k, zero);
+  }
+  // the final partial vector is handled with a masked load and store
+  if (k < len) {
+    __mmask16 mask = (__mmask16) ((1u << ((len - k) / 4)) - 1);
+    __m512i a = _mm512_maskz_loadu_epi32(mask, dst + k);
+    __m512i b = _mm512_maskz_loadu_epi32(mask, src + k);
+    _mm512_mask_storeu_epi32(dst + k, mask, _mm512_xor_si512(a, b));
+    _mm512_mask_storeu_epi32(src + k, mask, zero);
+    k += (len - k) / 4 * 4;
+  }
+  xor_clear_tail(dst + k, src + k, len - k);
+}
+#pragma GCC diagnostic pop
+#endif // XOR_KERNELS_X86
+
+struct XorKernels {
+  xor_kernel_t xor_rows;
+  xor_clear_kernel_t xor_and_clear_rows;
+  const char *name;
+};
+
+XorKernels select_kernels() {
+#ifdef XOR_KERNELS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) return {xor_avx512, xor_clear_avx512, "avx512"};
+  if (__builtin_cpu_supports("avx2")) return {xor_avx2, xor_clear_avx2, "avx2"};
+#endif
+  return {xor_scalar, xor_clear_scalar, "scalar"};
+}
+
+const XorKernels kernels = select_kernels();
+} // namespace
+
+void Bucket_Boruvka::xor_rows(char *dst, const char *src, size_t num_rows,
+                              size_t row_bytes, size_t stride) {
+  // rows which are packed back to back form a single span
+  if (row_bytes == stride) {
+    kernels.xor_rows(dst, src, num_rows * row_bytes);
+    return;
+  }
+  for (size_t i = 0; i < num_rows; ++i) {
+    kernels.xor_rows(dst + i * stride, src + i * stride, row_bytes);
+  }
+}
+
+void Bucket_Boruvka::xor_and_clear_rows(char *dst, char *src, size_t num_rows,
+                                        size_t row_bytes, size_t stride) {
+  if (row_bytes == stride) {
+    kernels.xor_and_clear_rows(dst, src, num_rows * row_bytes);
+    return;
+  }
+  for (size_t i = 0; i < num_rows; ++i) {
+    kernels.xor_and_clear_rows(dst + i * stride, src + i * stride, row_bytes);
+  }
+}
+
+const char *Bucket_Boruvka::xor_kernel_name() {
+  return kernels.name;
+}
@@ -0,0 +1,79 @@
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "../include/numa_topology.h"
+
+static constexpr int mpol_preferred = 1; // MPOL_PREFERRED from <numaif.h>
+
+// parse a cpulist such as "0-3,8-11"
+static std::vector<int> parse_cpulist(const std::string &list) {
+  std::vector<int> cpus;
+  std::stringstream ss(list);
+  std::string range;
+  while (getline(ss, range, ',')) {
+    if (range.empty() || range[0] == '\n') continue;
+    size_t dash = range.find('-');
+    int first = std::stoi(range.substr(0, dash));
+    int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+    for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+NumaTopology::NumaTopology() {
+  for (int node = 0; ; ++node) {
+    std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    if (!in.is_open()) break;
+    std::string list;
+    getline(in, list);
+    std::vector<int> cpus = parse_cpulist(list);
+    if (cpus.empty()) continue; // skip memory only nodes
+    node_cpus.push_back(cpus);
+    node_ids.push_back(node);
+  }
+  if (node_cpus.empty()) {
+    node_cpus.emplace_back();
+    node_ids.push_back(0);
+    unsigned num_cpus = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned cpu = 0; cpu < num_cpus; ++cpu) node_cpus[0].push_back(cpu);
+  }
+}
+
+const NumaTopology &NumaTopology::get() {
+  static const NumaTopology topology;
+  return topology;
+}
+
+int NumaTopology::num_nodes() {
+  return (int) get().node_cpus.size();
+}
+
+const std::vector<int> &NumaTopology::cpus(int node) {
+  return get().node_cpus[node % num_nodes()];
+}
+
+bool NumaTopology::pin_thread(int node) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus(node)) CPU_SET(cpu, &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+bool NumaTopology::bind_memory(void *addr, size_t len, int node) {
+  node = get().node_ids[node % num_nodes()];
+  size_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t start = ((uintptr_t) addr + page - 1) / page * page;
+  uintptr_t end = ((uintptr_t) addr + len) / page * page;
+  if (start >= end) return true;
+  len = end - start;
+  unsigned long mask[16] = {};
+  if (node >= (int) (sizeof(mask) * 8)) return false;
+  mask[node / 64] |= 1UL << (node % 64);
+  return syscall(SYS_mbind, start, len, mpol_preferred, mask, sizeof(mask) * 8, 0) == 0;
+}
@@ -1,55 +1,118 @@
 #include <stdexcept>
 #include <cmath>
+#include <cstring>
+#include <atomic>
+#include <cstdint>
 #include <boost/multiprecision/cpp_int.hpp>
 #include "../include/supernode.h"
-#include "../include/graph_worker.h"
 
-uint32_t Supernode::bytes_size;
+SupernodeGeometry::SupernodeGeometry(uint64_t n, int sketch_fail_factor) : n(n),
+    sketch(n * n, sketch_fail_factor) {
+  size_t num_sketches = log2(n)/(log2(3)-1);
+  bytes_size = sizeof(Supernode) + num_sketches * sketch.sketch_sizeof() - sizeof(char);
+  delta_bytes_size = bytes_size + Supernode::heights_bytes(sketch, num_sketches)
+                     + Supernode::max_touches(sketch, num_sketches) * sizeof(BucketTouch);
+  binary_size = num_sketches * sketch.bucket_bytes();
+}
+
+// a placeholder until configure() is called
+SupernodeGeometry Supernode::default_geometry(2);
 
-Supernode::Supernode(uint64_t n, long seed): idx(0), num_sketches(log2(n)/(log2(3)-1)),
-               n(n), seed(seed), sketch_size(Sketch::sketchSizeof()) {
+Supernode::Supernode(const SupernodeGeometry &geometry, uint64_t n, long seed): idx(0),
+    num_sketches(log2(n)/(log2(3)-1)), geometry(&geometry), n(n), seed(seed),
+    sketch_size(geometry.sketch.sketch_sizeof()) {
 
   // generate num_sketches sketches for each supernode (read: node)
   for (int i = 0; i < num_sketches; ++i) {
-    Sketch::makeSketch(get_sketch(i), seed++);
+    Sketch::makeSketch(get_sketch(i), geometry.sketch, seed++);
   }
 }
 
-Supernode::Supernode(uint64_t n, long seed, std::fstream &binary_in) :
-  idx(0), num_sketches(log2(n)/(log2(3)-1)), n(n), seed(seed), sketch_size(Sketch::sketchSizeof()) {
+Supernode::Supernode(const SupernodeGeometry &geometry, uint64_t n, long seed,
+                     std::fstream &binary_in) : idx(0), num_sketches(log2(n)/(log2(3)-1)),
+    geometry(&geometry), n(n), seed(seed), sketch_size(geometry.sketch.sketch_sizeof()) {
 
   // read num_sketches sketches from file for each supernode (read: node)
   for (int i = 0; i < num_sketches; ++i) {
-    Sketch::makeSketch(get_sketch(i), seed++, binary_in);
+    Sketch::makeSketch(get_sketch(i), geometry.sketch, seed++, binary_in);
+  }
+}
+
+Supernode::Supernode(const SupernodeGeometry &geometry, uint64_t n, long seed,
+                     const char *binary_in) : idx(0), num_sketches(log2(n)/(log2(3)-1)),
+    geometry(&geometry), n(n), seed(seed), sketch_size(geometry.sketch.sketch_sizeof()) {
+  for (int i = 0; i < num_sketches; ++i) {
+    Sketch::makeSketch(get_sketch(i), geometry.sketch, seed++, binary_in);
+    binary_in += geometry.sketch.bucket_bytes();
   }
 }
 
-Supernode::Supernode(const Supernode& s) : idx(s.idx), num_sketches(s.num_sketches), n(s.n),
-    seed(s.seed), sketch_size(s.sketch_size) {
+Supernode::Supernode(const SupernodeGeometry &geometry, uint64_t n, long seed, bool sparse) :
+  idx(0), num_sketches(log2(n)/(log2(3)-1)), geometry(&geometry), n(n), seed(seed),
+  sketch_size(geometry.sketch.sketch_sizeof()), sparse(sparse) {}
+
+Supernode::Supernode(const Supernode& s) : idx(s.idx), num_sketches(s.num_sketches),
+    geometry(s.geometry), n(s.n), seed(s.seed), sketch_size(s.sketch_size) {
   for (int i = 0; i < num_sketches; ++i) {
     Sketch::makeSketch(get_sketch(i), *s.get_sketch(i));
   }
 }
 
 Supernode* Supernode::makeSupernode(uint64_t n, long seed) {
-  void *loc = malloc(bytes_size);
-  return new (loc) Supernode(n, seed);
+  void *loc = malloc(default_geometry.bytes_size);
+  return new (loc) Supernode(default_geometry, n, seed);
 }
 
 Supernode* Supernode::makeSupernode(uint64_t n, long seed, std::fstream &binary_in) {
-  void *loc = malloc(bytes_size);
-  return new (loc) Supernode(n, seed, binary_in);
+  void *loc = malloc(default_geometry.bytes_size);
+  return new (loc) Supernode(default_geometry, n, seed, binary_in);
 }
 
 Supernode* Supernode::makeSupernode(void* loc, uint64_t n, long seed) {
-  return new (loc) Supernode(n, seed);
+  return new (loc) Supernode(default_geometry, n, seed);
+}
+
+Supernode* Supernode::makeSupernode(void* loc, uint64_t n, long seed, std::fstream &binary_in) {
+  return new (loc) Supernode(default_geometry, n, seed, binary_in);
 }
 
 Supernode* Supernode::makeSupernode(const Supernode& s) {
-  void *loc = malloc(bytes_size);
+  void *loc = malloc(s.geometry->bytes_size);
+  return new (loc) Supernode(s);
+}
+
+Supernode* Supernode::makeSupernode(void* loc, const Supernode& s) {
   return new (loc) Supernode(s);
 }
 
+Supernode* Supernode::makeSupernode(void* loc, const SupernodeGeometry &geometry, long seed) {
+  return new (loc) Supernode(geometry, geometry.n, seed);
+}
+
+Supernode* Supernode::makeSupernode(void* loc, const SupernodeGeometry &geometry, long seed,
+                                    std::fstream &binary_in) {
+  return new (loc) Supernode(geometry, geometry.n, seed, binary_in);
+}
+
+Supernode* Supernode::makeSupernode(void* loc, const SupernodeGeometry &geometry, long seed,
+                                    const char *binary_in) {
+  return new (loc) Supernode(geometry, geometry.n, seed, binary_in);
+}
+
+Supernode* Supernode::makeDeltaSupernode(void* loc, uint64_t n, long seed) {
+  Supernode *delta_node = new (loc) Supernode(default_geometry, n, seed);
+  memset(delta_node->get_heights(), 0,
+         heights_bytes(default_geometry.sketch, delta_node->num_sketches));
+  return delta_node;
+}
+
+Supernode* Supernode::makeDeltaSupernode(void* loc, const SupernodeGeometry &geometry,
+                                         long seed) {
+  Supernode *delta_node = new (loc) Supernode(geometry, geometry.n, seed);
+  memset(delta_node->get_heights(), 0, heights_bytes(geometry.sketch, delta_node->num_sketches));
+  return delta_node;
+}
+
 Supernode::~Supernode() {
 }
 
@@ -62,11 +125,22 @@ std::pair<Edge, SampleSketchRet> Supernode::sample() {
   return {inv_nondir_non_self_edge_pairing_fn(idx), ret_code};
 }
 
+std::pair<Edge, SampleSketchRet> Supernode::peek_sample(int i) const {
+  if (i >= num_sketches) throw OutOfQueriesException();
+
+  std::pair<vec_t, SampleSketchRet> query_ret = get_sketch(i)->peek_query();
+  return {inv_nondir_non_self_edge_pairing_fn(query_ret.first), query_ret.second};
+}
+
 void Supernode::merge(Supernode &other) {
   idx = max(idx, other.idx);
-  for (int i=idx;i<num_sketches;++i) {
-    (*get_sketch(i))+=(*other.get_sketch(i));
-  }
+  merge(other, idx);
+}
+
+void Supernode::merge(const Supernode &other, int first) {
+  if (first < num_sketches)
+    Sketch::add_sketches(get_sketch(first), other.get_sketch(first),
+                         num_sketches - first, sketch_size);
 }
 
 void Supernode::update(vec_t upd) {
@@ -74,46 +148,168 @@ void Supernode::update(vec_t upd) {
     get_sketch(i)->update(upd);
 }
 
+/*
+ * Deltas are applied under a table of striped spinlocks instead of a mutex
+ * in every supernode. XOR commutes, so concurrent deltas may be applied to a
+ * supernode in any order and only the XOR into each sketch must be
+ * exclusive. Each sketch is locked on its own, so workers applying deltas to
+ * the same high degree node pipeline through its sketches rather than
+ * queueing for the whole supernode. A sparse delta locks the sketch of each
+ * run of its touches, which are grouped by sketch.
+ */
+namespace {
+constexpr size_t num_stripes = 1024;
+
+// padded to a cache line so that threads spinning on one lock don't slow
+// down the holders of its neighbours
+struct alignas(64) Stripe {
+  std::atomic<bool> locked{false};
+};
+Stripe stripes[num_stripes];
+
+class StripeLock {
+  Stripe &stripe;
+public:
+  explicit StripeLock(const void *addr) : stripe(stripes[
+      ((uintptr_t) addr * 0x9E3779B97F4A7C15ULL) >> 54]) {
+    static_assert(num_stripes == 1 << (64 - 54), "stripe index must fit the table");
+    while (stripe.locked.exchange(true, std::memory_order_acquire)) {
+      while (stripe.locked.load(std::memory_order_relaxed)) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+      }
+    }
+  }
+  ~StripeLock() { stripe.locked.store(false, std::memory_order_release); }
+};
+} // namespace
+
+void Supernode::apply_touches(const BucketTouch *touches, size_t num_touches) {
+  size_t i = 0;
+  while (i < num_touches) {
+    Sketch *sketch = get_sketch(touches[i].sketch);
+    StripeLock lk(sketch);
+    for (; i < num_touches && get_sketch(touches[i].sketch) == sketch; ++i) {
+      sketch->apply_touch(touches[i]);
+    }
+  }
+}
+
 void Supernode::apply_delta_update(const Supernode* delta_node) {
-  std::unique_lock<std::mutex> lk(node_mt);
+  if (delta_node->sparse) {
+    apply_touches(delta_node->get_touches(), delta_node->num_touches);
+    return;
+  }
+  for (int i = 0; i < num_sketches; ++i) {
+    StripeLock lk(get_sketch(i));
+    Sketch::add_sketches(get_sketch(i), delta_node->get_sketch(i), 1, sketch_size);
+  }
+}
+
+void Supernode::apply_and_clear_delta(Supernode* delta_node) {
+  if (delta_node->sparse) {
+    apply_touches(delta_node->get_touches(), delta_node->num_touches);
+    delta_node->num_touches = 0;
+    return;
+  }
+  uint8_t *heights = delta_node->get_heights();
+  size_t num_buckets = geometry->sketch.num_buckets;
   for (int i = 0; i < num_sketches; ++i) {
-    *get_sketch(i) += *delta_node->get_sketch(i);
+    StripeLock lk(get_sketch(i));
+    Sketch::add_and_clear_sketches(get_sketch(i), delta_node->get_sketch(i), 1,
+                                   sketch_size, heights + i * num_buckets);
   }
-  lk.unlock();
 }
 
 /*
- * Consider fiddling with environment vars
- * OMP_DYNAMIC: whether the OS is allowed to dynamically change the number
- * of threads employed for each parallel section
- * OMP_NUM_THREADS (or set_omp_num_threads): how many threads to spin up for
- * each parallel section. the default is (probably) one per CPU core
- * available, but we may want to set it lower if num_sketches is a nice multiple of
- * a lower number.
+ * A dense delta costs a pass over every bucket of every sketch to zero it and
+ * another to XOR it into the supernode, however small the batch. Applying a
+ * touch of a sparse delta to a supernode which is not in cache costs about as
+ * much as XORing four buckets, so a batch is recorded sparsely unless it
+ * touches more than a quarter as many buckets as the delta holds. An update
+ * lands in 1 + num_buckets buckets of each sketch on average, so batches
+ * expected to exceed the limit go straight to the dense path, and the rest
+ * stop recording at the limit and fall back to it.
  *
- * We may want to use omp option schedule(dynamic) or schedule(guided) if
- * there are very many more iterations of loop than threads. Dynamic
- * scheduling is good if loop iterations are expected to take very much
- * different amounts of time. Refer to
- * http://www.inf.ufsc.br/~bosco.sobral/ensino/ine5645/OpenMP_Dynamic_Scheduling.pdf
- * for a detailed explanation.
- */
-/*
- * Current impl uses default threads and parallelism within batched_update.
- * Considered using spin-threads and parallelism within sketch::update, but
- * this was slow (at least on small graph inputs).
+ * The sketches of a dense delta are split into one run per thread of the
+ * calling GraphWorker's thread pool, and each run is built by exactly one
+ * task so that a fused hash family hashes every update once per run. As no
+ * sketch is visible to more than one thread while it is built, the buckets
+ * are updated with plain (non-atomic) XORs.
+ *
+ * Batches with fewer than serial_batch_size sketch updates in total are
+ * applied by the caller alone, as handing them to the pool costs more than
+ * the updates themselves.
+ *
+ * A dense delta tracks the column heights of its sketches as it is built.
+ * A GraphWorker reuses one delta for all of its batches, and applying it with
+ * apply_and_clear_delta zeroes the buckets it dirtied as they are XORed into
+ * the supernode, so the next batch starts from an empty delta without a pass
+ * over every bucket to zero it.
  */
-void Supernode::delta_supernode(uint64_t n, long seed,
-               const vector<vec_t> &updates, void *loc) {
-  auto delta_node = makeSupernode(loc, n, seed);
-#pragma omp parallel for num_threads(GraphWorker::get_group_size()) default(shared)
-  for (int i = 0; i < delta_node->num_sketches; ++i) {
-    delta_node->get_sketch(i)->batch_update(updates);
+static constexpr size_t serial_batch_size = 512;
+
+bool Supernode::build_sparse_delta(const vector<vec_t> &updates) {
+  const SketchGeometry &sketch = geometry->sketch;
+  size_t max = max_touches(sketch, num_sketches);
+  if (updates.size() * num_sketches * (1 + sketch.num_buckets) > max)
+    return false;
+  size_t touches = Sketch::collect_run_touches(seed, num_sketches,
+                          updates.data(), updates.size(), get_touches(), max, sketch);
+  if (touches > max) return false;
+  sparse = true;
+  num_touches = touches;
+  return true;
+}
+
+void Supernode::build_dense_delta(const vector<vec_t> &updates, ThreadPool *pool) {
+  sparse = false;
+  num_touches = 0;
+  uint8_t *heights = get_heights();
+  if (pool == nullptr || updates.size() * num_sketches <= serial_batch_size) {
+    Sketch::batch_update_run(get_sketch(0), num_sketches, sketch_size,
+                             updates.data(), updates.size(), heights);
+    return;
   }
+
+  size_t num_tasks = std::min((size_t) num_sketches, (size_t) pool->get_num_threads() + 1);
+  pool->parallel_for(num_tasks, [&](size_t t) {
+    size_t begin = t * num_sketches / num_tasks;
+    size_t end = (t + 1) * num_sketches / num_tasks;
+    Sketch::batch_update_run(get_sketch(begin), end - begin, sketch_size,
+                             updates.data(), updates.size(),
+                             heights + begin * geometry->sketch.num_buckets);
+  });
+}
+
+void Supernode::build_delta(const vector<vec_t> &updates, ThreadPool *pool) {
+  num_touches = 0;
+  if (build_sparse_delta(updates)) return;
+  // only visits the deterministic buckets unless the last batch was applied
+  // without apply_and_clear_delta
+  Sketch::clear_sketches(get_sketch(0), num_sketches, sketch_size, get_heights());
+  build_dense_delta(updates, pool);
 }
 
-void Supernode::write_binary(std::fstream& binary_out) {
+void Supernode::delta_supernode(uint64_t n, long seed,
+               const vector<vec_t> &updates, void *loc, ThreadPool *pool) {
+  // a sparse delta never reads its sketches, so they are only built if needed
+  auto delta_node = new (loc) Supernode(default_geometry, n, seed, true);
+  if (delta_node->build_sparse_delta(updates)) return;
+
+  delta_node = makeDeltaSupernode(loc, n, seed);
+  delta_node->build_dense_delta(updates, pool);
+}
+
+void Supernode::write_binary(std::fstream& binary_out) const {
   for (int i = 0; i < num_sketches; ++i) {
     get_sketch(i)->write_binary(binary_out);
   }
 }
+
+void Supernode::write_binary(char *binary_out) const {
+  for (int i = 0; i < num_sketches; ++i) {
+    get_sketch(i)->write_binary(binary_out + i * geometry->sketch.bucket_bytes());
+  }
+}
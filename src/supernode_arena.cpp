@@ -0,0 +1,163 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <new>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "../include/supernode_arena.h"
+#include "../include/numa_topology.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+HugePages SupernodeArena::huge_pages = TRANSPARENT;
+bool SupernodeArena::on_disk = false;
+std::string SupernodeArena::disk_prefix;
+uint64_t SupernodeArena::writeback_interval = 0;
+
+static constexpr size_t cache_line = 64;
+static constexpr size_t page_4kb = size_t(1) << 12;
+static constexpr size_t page_2mb = size_t(1) << 21;
+static constexpr size_t page_1gb = size_t(1) << 30;
+
+static inline size_t round_up(size_t x, size_t to) {
+  return (x + to - 1) / to * to;
+}
+
+SupernodeArena::SupernodeArena(node_id_t num_slots, uint32_t supernode_size) : base(nullptr),
+    num_slots(num_slots), slot_size(round_up(supernode_size, cache_line)),
+    map_bytes(0), backing(NO_HUGEPAGES), num_batches(0) {
+  size_t bytes = std::max((size_t) num_slots * slot_size, cache_line);
+  if (on_disk) {
+    map_file(bytes);
+    return;
+  }
+  if (map(bytes, huge_pages)) return;
+  printf("WARNING: could not map %s for the supernodes, using %s instead.\n",
+         huge_pages_name(huge_pages), huge_pages_name(TRANSPARENT));
+  huge_pages = TRANSPARENT; // don't retry for every backup of the supernodes
+  if (!map(bytes, TRANSPARENT)) throw std::bad_alloc();
+}
+
+SupernodeArena::~SupernodeArena() {
+  munmap(base, map_bytes);
+  if (fd != -1) close(fd); // the file was unlinked so this deletes it
+}
+
+/*
+ * Reserved hugepages are requested directly and fail if none are free. Other
+ * arenas are mapped with regular pages; for transparent hugepages the mapping
+ * is trimmed to start on a 2MB boundary so that the kernel can back all of it
+ * with hugepages. Anonymous mappings are zeroed and only faulted in when
+ * first touched.
+ */
+bool SupernodeArena::map(size_t bytes, HugePages pages) {
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  if (pages == HUGEPAGES_2MB || pages == HUGEPAGES_1GB) {
+    size_t page = pages == HUGEPAGES_2MB ? page_2mb : page_1gb;
+    flags |= MAP_HUGETLB | (pages == HUGEPAGES_2MB ? MAP_HUGE_2MB : MAP_HUGE_1GB);
+    bytes = round_up(bytes, page);
+    void *loc = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (loc == MAP_FAILED) return false;
+    base = (char *) loc;
+    map_bytes = bytes;
+    backing = pages;
+    return true;
+  }
+
+  size_t align = pages == TRANSPARENT ? page_2mb : 0;
+  bytes = round_up(bytes, pages == TRANSPARENT ? page_2mb : page_4kb);
+  void *loc = mmap(nullptr, bytes + align, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (loc == MAP_FAILED) return false;
+  char *start = (char *) loc;
+  if (align) {
+    char *aligned = (char *) round_up((uintptr_t) start, align);
+    if (aligned > start) munmap(start, aligned - start);
+    size_t tail = (start + align) - aligned;
+    if (tail > 0) munmap(aligned + bytes, tail);
+    start = aligned;
+    madvise(start, bytes, MADV_HUGEPAGE);
+  }
+  base = start;
+  map_bytes = bytes;
+  backing = pages;
+  return true;
+}
+
+/*
+ * The mapping is shared so that evicted pages are written to the file rather
+ * than to swap. A new file is all zeros, like an anonymous mapping, and its
+ * blocks are only allocated as the supernodes are written.
+ */
+void SupernodeArena::map_file(size_t bytes) {
+  std::string path = disk_prefix + "supernodes_XXXXXX";
+  fd = mkstemp(&path[0]);
+  if (fd == -1) throw ArenaFileException();
+  unlink(path.c_str());
+  bytes = round_up(bytes, page_4kb);
+  if (ftruncate(fd, bytes) != 0) {
+    close(fd);
+    throw ArenaFileException();
+  }
+  void *loc = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (loc == MAP_FAILED) {
+    close(fd);
+    throw ArenaFileException();
+  }
+  base = (char *) loc;
+  map_bytes = bytes;
+  backing = NO_HUGEPAGES;
+  advise_random();
+}
+
+size_t SupernodeArena::get_page_size() const {
+  switch (backing) {
+    case TRANSPARENT:   return page_2mb;
+    case HUGEPAGES_2MB: return page_2mb;
+    case HUGEPAGES_1GB: return page_1gb;
+    default:            return page_4kb;
+  }
+}
+
+node_id_t SupernodeArena::page_boundary(node_id_t i) const {
+  size_t offset = round_up((size_t) i * slot_size, get_page_size());
+  return (node_id_t) std::min((size_t) num_slots, round_up(offset, slot_size) / slot_size);
+}
+
+void SupernodeArena::bind(node_id_t begin, node_id_t end, int numa_node) {
+  size_t page = get_page_size();
+  size_t first = round_up((size_t) begin * slot_size, page);
+  // the last range also owns the padding at the end of the mapping
+  size_t last = end == num_slots ? map_bytes : (size_t) end * slot_size / page * page;
+  if (first < last) NumaTopology::bind_memory(base + first, last - first, numa_node);
+}
+
+void SupernodeArena::write_back() {
+  if (fd != -1) sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+}
+
+void SupernodeArena::advise_random() {
+  if (fd != -1) madvise(base, map_bytes, MADV_RANDOM);
+}
+
+void SupernodeArena::advise_sequential() {
+  if (fd != -1) madvise(base, map_bytes, MADV_SEQUENTIAL);
+}
+
+const char *SupernodeArena::huge_pages_name(HugePages pages) {
+  switch (pages) {
+    case NO_HUGEPAGES:  return "regular pages";
+    case TRANSPARENT:   return "transparent hugepages";
+    case HUGEPAGES_2MB: return "2MB hugepages";
+    case HUGEPAGES_1GB: return "1GB hugepages";
+  }
+  return "unknown pages";
+}
@@ -0,0 +1,39 @@
+#include <cstdlib>
+#include "../include/supernode_snapshot.h"
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+SupernodeSnapshot::SupernodeSnapshot(SupernodeArena *live) : live(live),
+    state(new std::atomic<uint32_t>[live->get_num_slots()]),
+    copies(new Supernode*[live->get_num_slots()]), num_saved(0) {
+  for (node_id_t i = 0; i < live->get_num_slots(); ++i) {
+    state[i].store(0, std::memory_order_relaxed);
+    copies[i] = nullptr;
+  }
+}
+
+SupernodeSnapshot::~SupernodeSnapshot() {
+  for (node_id_t i = 0; i < live->get_num_slots(); ++i) free(copies[i]);
+}
+
+/*
+ * The first writer copies the supernode while the other writers wait for the
+ * copy. Readers and the saved flag share a word, so a reader either counted
+ * itself in before the flag was set, and is waited for, or sees the flag and
+ * reads the copy.
+ */
+void SupernodeSnapshot::save_slow(node_id_t i) {
+  if (!(state[i].fetch_or(saving, std::memory_order_acq_rel) & saving)) {
+    copies[i] = Supernode::makeSupernode(*live->get(i));
+    ++num_saved;
+    state[i].fetch_or(saved, std::memory_order_acq_rel);
+  } else {
+    while (!(state[i].load(std::memory_order_acquire) & saved)) cpu_relax();
+  }
+  while (state[i].load(std::memory_order_acquire) & readers_mask) cpu_relax();
+  state[i].fetch_or(ready, std::memory_order_release);
+}
@@ -0,0 +1,77 @@
+#include "../include/thread_pool.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool(int num_threads, const std::function<void()> &init) : init(init) {
+  grow(num_threads);
+}
+
+ThreadPool::~ThreadPool() {
+  std::unique_lock<std::mutex> lk(queue_lock);
+  shutdown = true;
+  lk.unlock();
+  queue_condition.notify_all();
+  for (auto &thr : threads) thr.join();
+}
+
+void ThreadPool::grow(int num_threads) {
+  std::lock_guard<std::mutex> lk(queue_lock);
+  while ((int) threads.size() < num_threads) {
+    threads.emplace_back(&ThreadPool::do_work, this, init);
+  }
+  num_helpers = (int) threads.size();
+}
+
+void ThreadPool::parallel_for(size_t num_tasks, const std::function<void(size_t)> &task) {
+  if (num_tasks == 0) return;
+
+  Job job;
+  job.task = &task;
+  job.num_tasks = num_tasks;
+
+  // only hand the job to the pool if there is more than one task
+  bool shared = num_tasks > 1 && num_helpers > 0;
+  if (shared) {
+    std::unique_lock<std::mutex> lk(queue_lock);
+    jobs.push_back(&job);
+    lk.unlock();
+    queue_condition.notify_all();
+  }
+
+  run_tasks(&job);
+  if (!shared) return;
+
+  // every task has been claimed, wait for the pool threads to finish theirs
+  std::unique_lock<std::mutex> lk(queue_lock);
+  auto it = std::find(jobs.begin(), jobs.end(), &job);
+  if (it != jobs.end()) jobs.erase(it);
+  done_condition.wait(lk, [&job]{ return job.active == 0; });
+}
+
+void ThreadPool::run_tasks(Job *job) {
+  std::unique_lock<std::mutex> lk(queue_lock);
+  while (job->next_task < job->num_tasks) {
+    size_t i = job->next_task++;
+    lk.unlock();
+    (*job->task)(i);
+    lk.lock();
+  }
+}
+
+void ThreadPool::do_work(std::function<void()> init) {
+  if (init) init();
+  std::unique_lock<std::mutex> lk(queue_lock);
+  while (true) {
+    queue_condition.wait(lk, [this]{ return shutdown || !jobs.empty(); });
+    if (jobs.empty()) return; // shutdown with no work left
+
+    Job *job = jobs.front();
+    ++job->active;
+    lk.unlock();
+    run_tasks(job);
+    lk.lock();
+
+    // all tasks of the job are claimed so no other thread should pick it up
+    if (!jobs.empty() && jobs.front() == job) jobs.pop_front();
+    if (--job->active == 0) done_condition.notify_all();
+  }
+}
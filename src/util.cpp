@@ -3,6 +3,8 @@
 #include "../include/util.h"
 #include "../include/graph_worker.h"
 #include "../include/graph.h"
+#include "../include/supernode_arena.h"
+#include "../include/numa_topology.h"
 
 const char *config_file = "streaming.conf";
 using uint128_t = boost::multiprecision::uint128_t;
@@ -36,6 +38,10 @@ std::pair<bool, std::string> configure_system() {
   std::string pre = "./GUTTREEDATA/";
   int num_groups = 1;
   int group_size = 1;
+  HugePages huge_pages = TRANSPARENT;
+  bool on_disk = false;
+  uint64_t writeback = 0;
+  int num_partitions = 0;
   std::string line;
   std::ifstream conf(config_file);
   if (conf.is_open()) {
@@ -51,9 +57,9 @@ std::pair<bool, std::string> configure_system() {
         }
         printf("Using %s for buffering.\n", use_guttertree? "GutterTree" : "StandAloneGutters");
       }
-      if(line.substr(0, line.find('=')) == "path_prefix" && use_guttertree) {
+      if(line.substr(0, line.find('=')) == "path_prefix") {
         pre = line.substr(line.find('=') + 1);
-        printf("GutterTree path_prefix = %s\n", pre.c_str());
+        printf("path_prefix = %s\n", pre.c_str());
       }
       if(line.substr(0, line.find('=')) == "num_groups") {
         num_groups = std::stoi(line.substr(line.find('=') + 1));
@@ -71,11 +77,56 @@ std::pair<bool, std::string> configure_system() {
         }
         printf("Size of groups = %i\n", group_size);
       }
+      if(line.substr(0, line.find('=')) == "hugepages") {
+        string pages_str = line.substr(line.find('=') + 1);
+        if (pages_str == "none") {
+          huge_pages = NO_HUGEPAGES;
+        } else if (pages_str == "2MB") {
+          huge_pages = HUGEPAGES_2MB;
+        } else if (pages_str == "1GB") {
+          huge_pages = HUGEPAGES_1GB;
+        } else if (pages_str != "transparent") {
+          printf("WARNING: string %s is not a valid option for "
+                "hugepages. Defaulting to transparent.\n", pages_str.c_str());
+        }
+        printf("Supernodes use %s\n", SupernodeArena::huge_pages_name(huge_pages));
+      }
+      if(line.substr(0, line.find('=')) == "supernode_storage") {
+        string storage_str = line.substr(line.find('=') + 1);
+        if (storage_str == "disk") {
+          on_disk = true;
+        } else if (storage_str != "memory") {
+          printf("WARNING: string %s is not a valid option for "
+                "supernode_storage. Defaulting to memory.\n", storage_str.c_str());
+        }
+        printf("Supernodes are stored in %s\n", on_disk? "files under path_prefix" : "memory");
+      }
+      if(line.substr(0, line.find('=')) == "disk_writeback") {
+        writeback = std::stoull(line.substr(line.find('=') + 1));
+        printf("Supernode write-back every %lu batches\n", writeback);
+      }
+      if(line.substr(0, line.find('=')) == "numa") {
+        string numa_str = line.substr(line.find('=') + 1);
+        if (numa_str == "on") {
+          num_partitions = NumaTopology::num_nodes();
+        } else if (numa_str != "off") {
+          num_partitions = std::stoi(numa_str);
+          if (num_partitions < 0) {
+            printf("numa=%i is out of bounds. Defaulting to off.\n", num_partitions);
+            num_partitions = 0;
+          }
+        }
+        printf("NUMA partitions = %i\n", num_partitions);
+      }
     }
   } else {
     printf("WARNING: Could not open thread configuration file! Using default values.\n");
   }
 
   GraphWorker::set_config(num_groups, group_size);
+  GraphWorker::set_num_partitions(num_partitions);
+  SupernodeArena::set_huge_pages(huge_pages);
+  SupernodeArena::set_storage(on_disk, pre);
+  SupernodeArena::set_writeback_interval(writeback);
   return {use_guttertree, pre};
 }
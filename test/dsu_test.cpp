@@ -0,0 +1,46 @@
+#include <gtest/gtest.h>
+#include <thread>
+#include "../include/dsu.h"
+
+TEST(DSUTestSuite, TestLongChain) {
+  // linking a chain one element at a time must not recurse down it
+  const uint32_t n = 1 << 22;
+  DisjointSetUnion<uint32_t> dsu(n);
+  for (uint32_t i = 1; i < n; ++i) {
+    ASSERT_TRUE(dsu.union_set(i - 1, i));
+  }
+  uint32_t root = dsu.find_set(n - 1);
+  for (uint32_t i = 0; i < n; ++i) {
+    ASSERT_EQ(root, dsu.find_set(i));
+  }
+  ASSERT_FALSE(dsu.union_set(0, n - 1));
+}
+
+TEST(DSUTestSuite, TestConcurrentUnions) {
+  // threads unioning overlapping edges must give the sets of the edges, with
+  // exactly one successful union per edge of a spanning forest
+  const uint32_t n = 1 << 16;
+  const uint32_t num_groups = 16;
+  const unsigned num_threads = std::max(4u, std::thread::hardware_concurrency());
+  DisjointSetUnion<uint32_t> dsu(n);
+  std::atomic<uint32_t> num_linked(0);
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&, t]() {
+      // every thread unions all of the edges i -- i + num_groups, in its own order
+      for (uint32_t k = 0; k + num_groups < n; ++k) {
+        uint32_t i = (k * (2 * t + 1)) % (n - num_groups);
+        if (dsu.union_set(i, i + num_groups)) ++num_linked;
+      }
+    });
+  }
+  for (auto &thread : threads) thread.join();
+
+  ASSERT_EQ(n - num_groups, num_linked);
+  for (uint32_t i = 0; i < n; ++i) {
+    ASSERT_EQ(dsu.find_set(i % num_groups), dsu.find_set(i));
+  }
+  for (uint32_t g = 1; g < num_groups; ++g) {
+    ASSERT_NE(dsu.find_set(0), dsu.find_set(g));
+  }
+}
@@ -0,0 +1,43 @@
+#include <gtest/gtest.h>
+#include <chrono>
+#include <fstream>
+#include "../../include/graph.h"
+#include "../../include/test/file_graph_verifier.h"
+#include "../../include/test/graph_gen.h"
+#include "../../include/test/write_configuration.h"
+
+/*
+ * Timings of whole graph streams, printed for comparison rather than checked.
+ * The tests of the same configurations are in ../graph_test.cpp.
+ */
+
+TEST(EXPR_Graph, OutOfCoreSupernodes) {
+  generate_stream({4096,0.002,0.5,0,"./sample.txt","./cumul_sample.txt"});
+  // process the same stream with the supernodes in memory and out of core
+  for (bool use_tree : {true, false}) {
+    for (bool on_disk : {false, true}) {
+      write_configuration(use_tree, 1, 1, on_disk);
+      ifstream in{"./sample.txt"};
+      node_id_t n;
+      edge_id_t m;
+      in >> n >> m;
+      edge_id_t num_updates = m;
+      Graph g{n};
+      auto start_time = std::chrono::steady_clock::now();
+      int type, a, b;
+      while (m--) {
+        in >> type >> a >> b;
+        if (type == INSERT) {
+          g.update({{a, b}, INSERT});
+        } else g.update({{a, b}, DELETE});
+      }
+      g.set_verifier(std::make_unique<FileGraphVerifier>("./cumul_sample.txt"));
+      g.connected_components();
+      std::chrono::duration<double> time = std::chrono::steady_clock::now() - start_time;
+      printf("%lu updates and connected components with %s and supernodes in %s: %f updates/second\n",
+             num_updates, use_tree? "the gutter tree" : "standalone gutters",
+             on_disk? "files" : "memory", num_updates / time.count());
+    }
+  }
+  write_configuration(false);
+}
@@ -0,0 +1,86 @@
+#include <gtest/gtest.h>
+#include <chrono>
+#include "../../include/l0_sampling/sketch.h"
+#include "../../include/l0_sampling/hash_kernels.h"
+#include "../../include/test/sketch_constructors.h"
+
+/*
+ * Timings of the sketch operations, printed for comparison rather than
+ * checked. The tests of the same operations are in ../sketch_test.cpp.
+ */
+
+static const int fail_factor = 100;
+
+TEST(EXPR_Sketch, BatchHashing) {
+  srand(time(nullptr));
+  const size_t num_updates = 100003;
+  std::vector<vec_t> updates(num_updates);
+  for (auto& update : updates) {
+    update = ((vec_t) rand() << 32) | (vec_t) rand();
+  }
+  std::vector<col_hash_t> col_hashes(num_updates);
+
+  long seed = rand();
+  auto start_time = std::chrono::steady_clock::now();
+  for (unsigned col = 0; col < 8; ++col) {
+    for (size_t k = 0; k < num_updates; ++k) {
+      col_hashes[k] = Bucket_Boruvka::col_index_hash(col, updates[k], seed);
+    }
+  }
+  std::cout << "Scalar hashing took " << static_cast<std::chrono::duration<long double>>(std::chrono::steady_clock::now() - start_time).count() << std::endl;
+  start_time = std::chrono::steady_clock::now();
+  for (unsigned col = 0; col < 8; ++col) {
+    Bucket_Boruvka::col_index_hash_batch(col, updates.data(), num_updates, seed, col_hashes.data());
+  }
+  std::cout << "Batched hashing (" << Bucket_Boruvka::hash_kernel_name() << ") took " << static_cast<std::chrono::duration<long double>>(std::chrono::steady_clock::now() - start_time).count() << std::endl;
+}
+
+TEST(EXPR_Sketch, FixedGeometry) {
+  srand(time(nullptr));
+  const size_t num_sketches = 1000, num_updates = 100;
+  for (unsigned log_n = 13; log_n <= 20; ++log_n) {
+    vec_t n = (vec_t) 1 << log_n;
+    Sketch::configure(n * n, fail_factor);
+    std::vector<vec_t> updates(num_sketches * num_updates);
+    for (auto& update : updates) {
+      update = (((vec_t) rand() << 32) | (vec_t) rand()) % (n * n);
+    }
+    long seed = rand();
+
+    // time each operation over the same sketches with either kernels
+    std::chrono::duration<long double> update_time[2], batch_time[2], query_time[2];
+    std::vector<SketchUniquePtr> sketches[2], batched[2];
+    std::vector<std::pair<vec_t, SampleSketchRet>> results[2];
+    for (int fixed = 0; fixed < 2; ++fixed) {
+      Sketch::select_kernels(fixed);
+      for (size_t i = 0; i < num_sketches; ++i) {
+        sketches[fixed].push_back(makeSketch(seed + i));
+        batched[fixed].push_back(makeSketch(seed + i));
+      }
+      auto start_time = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < num_sketches; ++i) {
+        for (size_t j = 0; j < num_updates; ++j) {
+          sketches[fixed][i]->update(updates[i * num_updates + j]);
+        }
+      }
+      update_time[fixed] = std::chrono::steady_clock::now() - start_time;
+      start_time = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < num_sketches; ++i) {
+        batched[fixed][i]->batch_update(&updates[i * num_updates], num_updates);
+      }
+      batch_time[fixed] = std::chrono::steady_clock::now() - start_time;
+      start_time = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < num_sketches; ++i) {
+        results[fixed].push_back(sketches[fixed][i]->query());
+      }
+      query_time[fixed] = std::chrono::steady_clock::now() - start_time;
+    }
+    Sketch::select_kernels();
+
+    std::cout << "n = 2^" << log_n << ": update generic " << update_time[0].count()
+              << " fixed " << update_time[1].count() << ", batch_update generic "
+              << batch_time[0].count() << " fixed " << batch_time[1].count()
+              << ", query generic " << query_time[0].count() << " fixed "
+              << query_time[1].count() << std::endl;
+  }
+}
@@ -0,0 +1,280 @@
+#include <gtest/gtest.h>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include "../../include/supernode.h"
+#include "../../include/supernode_arena.h"
+#include "../../include/l0_sampling/xor_kernels.h"
+
+/*
+ * Timings of the supernode operations, printed for comparison rather than
+ * checked. The tests of the same operations are in ../supernode_test.cpp.
+ */
+
+TEST(EXPR_Supernode, DeltaOverhead) {
+  // compare the per-batch cost of building deltas on a persistent pool against
+  // spawning one thread per sub-batch of 512 updates for each sketch
+  unsigned long vec_size = 1000000, num_batches = 200;
+  Supernode::configure(vec_size);
+  srand(time(nullptr));
+  auto seed = rand();
+  auto* loc = (Supernode*) malloc(Supernode::get_delta_size());
+  ThreadPool pool(3);
+
+  for (unsigned long batch_size : {8, 64, 1024}) {
+    std::vector<vec_t> updates(batch_size);
+    for (unsigned long i = 0; i < batch_size; i++) {
+      updates[i] = static_cast<vec_t>(rand() % vec_size);
+    }
+
+    auto start_time = std::chrono::steady_clock::now();
+    for (unsigned long b = 0; b < num_batches; b++) {
+      Supernode* delta = Supernode::makeSupernode(loc, vec_size, seed);
+      for (int i = 0; i < delta->get_num_sktch(); ++i) {
+        Sketch* sketch = delta->get_sketch(i);
+        size_t num_subbatches = (batch_size + 511) / 512;
+        std::vector<std::thread> thds;
+        for (size_t s = 0; s < num_subbatches; s++) {
+          size_t start = s * 512;
+          size_t end = std::min((size_t) 512 + start, batch_size);
+          thds.emplace_back([&, start, end]{
+            for (size_t j = start; j < end; j++) sketch->update(updates[j]);
+          });
+        }
+        for (auto& thd : thds) thd.join();
+      }
+    }
+    std::chrono::duration<long double> spawned = std::chrono::steady_clock::now() - start_time;
+
+    start_time = std::chrono::steady_clock::now();
+    for (unsigned long b = 0; b < num_batches; b++) {
+      Supernode::delta_supernode(vec_size, seed, updates, loc, &pool);
+    }
+    std::chrono::duration<long double> pooled = std::chrono::steady_clock::now() - start_time;
+
+    std::cout << "Batch of " << batch_size << " updates: thread per sub-batch "
+              << spawned.count() / num_batches << "s, pool "
+              << pooled.count() / num_batches << "s per batch" << std::endl;
+  }
+  free(loc);
+}
+
+TEST(EXPR_Supernode, MergeBandwidth) {
+  unsigned long vec_size = 100000;
+  Supernode::configure(vec_size);
+  srand(time(nullptr));
+  auto seed = rand();
+
+  // merge enough supernodes that they cannot fit in cache, and compare the
+  // rate against copying buffers of the same size with memcpy
+  const size_t num_snodes = (256 << 20) / Supernode::get_size();
+  std::vector<Supernode*> nodes(num_snodes), deltas(num_snodes);
+  for (size_t i = 0; i < num_snodes; ++i) {
+    nodes[i] = Supernode::makeSupernode(vec_size, seed);
+    deltas[i] = Supernode::makeSupernode(vec_size, seed);
+  }
+  // each merge reads both sets of buckets and writes one
+  const size_t merge_bytes = 3 * num_snodes * nodes[0]->get_num_sktch() * Sketch::bucket_bytes();
+  const int num_rounds = 5;
+
+  auto start_time = std::chrono::steady_clock::now();
+  for (int r = 0; r < num_rounds; ++r) {
+    for (size_t i = 0; i < num_snodes; ++i) nodes[i]->apply_delta_update(deltas[i]);
+  }
+  std::chrono::duration<double> merge_time = std::chrono::steady_clock::now() - start_time;
+
+  const size_t copy_bytes = num_snodes * Supernode::get_size();
+  std::vector<char> copy_dst(copy_bytes), copy_src(copy_bytes, 1);
+  start_time = std::chrono::steady_clock::now();
+  for (int r = 0; r < num_rounds; ++r) {
+    memcpy(copy_dst.data(), copy_src.data(), copy_bytes);
+  }
+  std::chrono::duration<double> copy_time = std::chrono::steady_clock::now() - start_time;
+
+  std::cout << "Merging supernodes (" << Bucket_Boruvka::xor_kernel_name() << ") ran at "
+            << merge_bytes * num_rounds / merge_time.count() / 1e9 << " GB/s, memcpy ran at "
+            << 2 * copy_bytes * num_rounds / copy_time.count() / 1e9 << " GB/s" << std::endl;
+  for (size_t i = 0; i < num_snodes; ++i) {
+    free(nodes[i]);
+    free(deltas[i]);
+  }
+}
+
+TEST(EXPR_Supernode, SparseDelta) {
+  unsigned long vec_size = 100000;
+  Supernode::configure(vec_size);
+  srand(time(nullptr));
+  auto seed = rand();
+  auto* loc = (Supernode*) malloc(Supernode::get_delta_size());
+
+  // time building and applying deltas of a few updates each way, spread over
+  // more supernodes than fit in cache as with the flushes of a large graph
+  const size_t num_snodes = (256 << 20) / Supernode::get_size();
+  unsigned long num_batches = 10000, batch_size = 4;
+  std::vector<Supernode*> snodes(num_snodes);
+  for (auto& snode : snodes) snode = Supernode::makeSupernode(vec_size, seed);
+  std::vector<vec_t> updates(batch_size);
+  for (auto& update : updates) {
+    update = static_cast<vec_t>(rand() % (vec_size * vec_size));
+  }
+  auto start_time = std::chrono::steady_clock::now();
+  for (unsigned long b = 0; b < num_batches; b++) {
+    Supernode* delta = Supernode::makeSupernode(loc, vec_size, seed);
+    for (int i = 0; i < delta->get_num_sktch(); ++i) {
+      delta->get_sketch(i)->batch_update(updates);
+    }
+    snodes[b * 7919 % num_snodes]->apply_delta_update(delta);
+  }
+  std::chrono::duration<long double> dense = std::chrono::steady_clock::now() - start_time;
+
+  start_time = std::chrono::steady_clock::now();
+  for (unsigned long b = 0; b < num_batches; b++) {
+    Supernode::delta_supernode(vec_size, seed, updates, loc);
+    snodes[b * 7919 % num_snodes]->apply_delta_update(loc);
+  }
+  std::chrono::duration<long double> sparse = std::chrono::steady_clock::now() - start_time;
+  std::cout << "Batch of " << batch_size << " updates: dense delta "
+            << dense.count() / num_batches << "s, sparse delta "
+            << sparse.count() / num_batches << "s per batch" << std::endl;
+  for (auto& snode : snodes) free(snode);
+  free(loc);
+}
+
+TEST(EXPR_Supernode, ReusableDelta) {
+  unsigned long vec_size = 100000;
+  Supernode::configure(vec_size);
+  srand(time(nullptr));
+  auto seed = rand();
+  auto* loc = malloc(Supernode::get_delta_size());
+  Supernode* delta = Supernode::makeDeltaSupernode(loc, vec_size, seed);
+
+  // time dense batches with a fresh delta each and with the reused one,
+  // spread over more supernodes than fit in cache
+  const size_t num_snodes = (256 << 20) / Supernode::get_size();
+  unsigned long num_batches = 10000, batch_size = 64;
+  std::vector<Supernode*> snodes(num_snodes);
+  for (auto& snode : snodes) snode = Supernode::makeSupernode(vec_size, seed);
+  std::vector<vec_t> updates(batch_size);
+  for (auto& update : updates) {
+    update = static_cast<vec_t>(rand() % (vec_size * vec_size));
+  }
+  auto* fresh_loc = (Supernode*) malloc(Supernode::get_delta_size());
+  auto start_time = std::chrono::steady_clock::now();
+  for (unsigned long b = 0; b < num_batches; b++) {
+    Supernode::delta_supernode(vec_size, seed, updates, fresh_loc);
+    snodes[b * 7919 % num_snodes]->apply_delta_update(fresh_loc);
+  }
+  std::chrono::duration<long double> fresh = std::chrono::steady_clock::now() - start_time;
+
+  start_time = std::chrono::steady_clock::now();
+  for (unsigned long b = 0; b < num_batches; b++) {
+    delta->build_delta(updates);
+    snodes[b * 7919 % num_snodes]->apply_and_clear_delta(delta);
+  }
+  std::chrono::duration<long double> reused = std::chrono::steady_clock::now() - start_time;
+  std::cout << "Batch of " << batch_size << " updates: fresh delta "
+            << fresh.count() / num_batches << "s, reused delta "
+            << reused.count() / num_batches << "s per batch" << std::endl;
+  for (auto& snode : snodes) free(snode);
+  free(fresh_loc);
+  free(loc);
+}
+
+TEST(EXPR_Supernode, Arena) {
+  unsigned long vec_size = 100000;
+  Supernode::configure(vec_size);
+  srand(time(nullptr));
+  auto seed = rand();
+
+  // time applying small deltas to random supernodes malloc'd one by one and
+  // in an arena, spread over more supernodes than fit in cache
+  const size_t num_snodes = (1 << 30) / Supernode::get_size();
+  unsigned long num_batches = 100000, batch_size = 4;
+  std::vector<Supernode*> snodes(num_snodes);
+  for (auto& snode : snodes) snode = Supernode::makeSupernode(vec_size, seed);
+  SupernodeArena arena(num_snodes);
+  for (size_t i = 0; i < num_snodes; ++i) Supernode::makeSupernode(arena.slot(i), vec_size, seed);
+  std::vector<vec_t> updates(batch_size);
+  for (auto& update : updates) {
+    update = static_cast<vec_t>(rand() % (vec_size * vec_size));
+  }
+  auto* delta = (Supernode*) malloc(Supernode::get_delta_size());
+  Supernode::delta_supernode(vec_size, seed, updates, delta);
+  auto start_time = std::chrono::steady_clock::now();
+  for (unsigned long b = 0; b < num_batches; b++) {
+    snodes[b * 7919 % num_snodes]->apply_delta_update(delta);
+  }
+  std::chrono::duration<long double> heap = std::chrono::steady_clock::now() - start_time;
+  start_time = std::chrono::steady_clock::now();
+  for (unsigned long b = 0; b < num_batches; b++) {
+    arena.get(b * 7919 % num_snodes)->apply_delta_update(delta);
+  }
+  std::chrono::duration<long double> arena_time = std::chrono::steady_clock::now() - start_time;
+  std::cout << "Applying deltas of " << batch_size << " updates: malloc'd "
+            << heap.count() / num_batches << "s, arena ("
+            << SupernodeArena::huge_pages_name(arena.get_backing()) << ") "
+            << arena_time.count() / num_batches << "s per batch" << std::endl;
+  for (auto& snode : snodes) free(snode);
+  free(delta);
+}
+
+TEST(EXPR_Supernode, HubContention) {
+  unsigned long vec_size = 100000, num_batches = 500;
+  Supernode::configure(vec_size);
+  srand(time(nullptr));
+  auto seed = rand();
+  const unsigned num_threads = std::max(4u, std::thread::hardware_concurrency());
+  const unsigned num_hubs = 2;
+
+  // every thread applies dense and sparse deltas to the same few hubs
+  std::vector<std::vector<std::vector<vec_t>>> batches(num_threads,
+      std::vector<std::vector<vec_t>>(num_batches));
+  for (unsigned t = 0; t < num_threads; ++t) {
+    for (unsigned long b = 0; b < num_batches; ++b) {
+      batches[t][b].resize(b % 2 ? 3 : 500);
+      for (auto& update : batches[t][b]) {
+        update = static_cast<vec_t>(rand() % (vec_size * vec_size));
+      }
+    }
+  }
+
+  std::vector<Supernode*> deltas(num_threads);
+  for (auto& delta : deltas) {
+    delta = Supernode::makeDeltaSupernode(malloc(Supernode::get_delta_size()), vec_size, seed);
+  }
+  std::vector<Supernode*> hubs(num_hubs);
+  std::mutex hub_mutexes[num_hubs];
+
+  // apply all the batches, either as is or holding a mutex for the whole hub
+  // as every supernode used to
+  auto run = [&](bool whole_node_lock) {
+    for (auto& hub : hubs) hub = Supernode::makeSupernode(vec_size, seed);
+    std::vector<std::thread> threads;
+    auto start_time = std::chrono::steady_clock::now();
+    for (unsigned t = 0; t < num_threads; ++t) {
+      threads.emplace_back([&, t]() {
+        for (unsigned long b = 0; b < num_batches; ++b) {
+          deltas[t]->build_delta(batches[t][b]);
+          if (whole_node_lock) {
+            std::lock_guard<std::mutex> lk(hub_mutexes[b % num_hubs]);
+            hubs[b % num_hubs]->apply_and_clear_delta(deltas[t]);
+          } else {
+            hubs[b % num_hubs]->apply_and_clear_delta(deltas[t]);
+          }
+        }
+      });
+    }
+    for (auto& thread : threads) thread.join();
+    std::chrono::duration<double> time = std::chrono::steady_clock::now() - start_time;
+    for (auto& hub : hubs) free(hub);
+    return num_threads * num_batches / time.count();
+  };
+  double whole_node = run(true);
+  double striped = run(false);
+  std::cout << num_threads << " threads applying deltas to " << num_hubs
+            << " supernodes: " << whole_node << " deltas/s locking whole supernodes, "
+            << striped << " deltas/s locking sketches" << std::endl;
+
+  for (auto& delta : deltas) free(delta);
+}
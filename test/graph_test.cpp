@@ -1,6 +1,10 @@
 #include <gtest/gtest.h>
+#include <chrono>
 #include <fstream>
+#include <thread>
+#include <xxhash.h>
 #include "../include/graph.h"
+#include "../include/binary_graph_stream.h"
 #include "../include/test/file_graph_verifier.h"
 #include "../include/test/mat_graph_verifier.h"
 #include "../include/test/graph_gen.h"
@@ -63,6 +67,49 @@ TEST_P(GraphTest, IFconnectedComponentsAlgRunTHENupdateLocked) {
   g.connected_components();
   ASSERT_THROW(g.update({{1,2}, INSERT}), UpdateLockedException);
   ASSERT_THROW(g.update({{1,2}, DELETE}), UpdateLockedException);
+  ASSERT_THROW(g.connected_component_labels_async(), UpdateLockedException);
+  ASSERT_THROW(g.checkpoint_async("./locked_checkpoint.data"), UpdateLockedException);
+}
+
+TEST_P(GraphTest, TestComponentLabels) {
+  write_configuration(GetParam());
+  const std::string fname = __FILE__;
+  size_t pos = fname.find_last_of("\\/");
+  const std::string curr_dir = (std::string::npos == pos) ? "" : fname.substr(0, pos);
+  ifstream in{curr_dir + "/res/multiples_graph_1024.txt"};
+  node_id_t num_nodes;
+  in >> num_nodes;
+  edge_id_t m;
+  in >> m;
+  node_id_t a, b;
+  Graph g{num_nodes};
+  while (m--) {
+    in >> a >> b;
+    g.update({{a, b}, INSERT});
+  }
+  g.set_verifier(std::make_unique<FileGraphVerifier>(curr_dir + "/res/multiples_graph_1024.txt"));
+  ComponentLabels cc = g.connected_component_labels(true);
+  ASSERT_EQ(78, cc.num_components);
+  ASSERT_EQ(num_nodes, cc.labels.size());
+
+  // the labels must give the same components as the set based query
+  g.set_verifier(std::make_unique<FileGraphVerifier>(curr_dir + "/res/multiples_graph_1024.txt"));
+  vector<set<node_id_t>> sets = g.connected_components();
+  vector<set<node_id_t>> label_sets = cc.to_sets();
+  sort(sets.begin(), sets.end());
+  sort(label_sets.begin(), label_sets.end());
+  ASSERT_EQ(sets, label_sets);
+
+  node_id_t total_size = 0;
+  vector<set<node_id_t>> by_label = cc.to_sets();
+  for (node_id_t c = 0; c < cc.num_components; ++c) {
+    ASSERT_EQ(by_label[c].size(), cc.sizes[c]);
+    total_size += cc.sizes[c];
+  }
+  ASSERT_EQ(num_nodes, total_size);
+  node_id_t total_count = 0;
+  for (auto &entry : cc.size_histogram()) total_count += entry.second;
+  ASSERT_EQ(cc.num_components, total_count);
 }
 
 TEST_P(GraphTest, TestCorrectnessOnSmallRandomGraphs) {
@@ -180,3 +227,450 @@ TEST_P(GraphTest, TestCorrectnessOfReheating) {
     }
   }
 }
+
+TEST_P(GraphTest, TestOutOfCoreSupernodes) {
+  int allow_fail = 2; // allow 2 failures
+  int fails = 0;
+  generate_stream({4096,0.002,0.5,0,"./sample.txt","./cumul_sample.txt"});
+  // process the same stream with the supernodes in memory and out of core,
+  // which must give the same components
+  ComponentLabels labels[2];
+  for (bool on_disk : {false, true}) {
+    write_configuration(GetParam(), 1, 1, on_disk);
+    while (true) {
+      ifstream in{"./sample.txt"};
+      node_id_t n;
+      edge_id_t m;
+      in >> n >> m;
+      Graph g{n};
+      ASSERT_EQ(on_disk, g.supernodes->is_on_disk());
+      int type, a, b;
+      while (m--) {
+        in >> type >> a >> b;
+        if (type == INSERT) {
+          g.update({{a, b}, INSERT});
+        } else g.update({{a, b}, DELETE});
+      }
+      g.set_verifier(std::make_unique<FileGraphVerifier>("./cumul_sample.txt"));
+      try {
+        labels[on_disk] = g.connected_component_labels();
+        break;
+      } catch (OutOfQueriesException& err) {
+        fails++;
+        if (fails > allow_fail) {
+          printf("More than %i failures failing test\n", allow_fail);
+          throw;
+        }
+      }
+    }
+  }
+  write_configuration(GetParam());
+
+  // the labels themselves depend on the order of the merges, so compare the
+  // components they describe
+  ASSERT_EQ(labels[0].num_components, labels[1].num_components);
+  auto in_memory = labels[0].to_sets();
+  auto out_of_core = labels[1].to_sets();
+  std::sort(in_memory.begin(), in_memory.end());
+  std::sort(out_of_core.begin(), out_of_core.end());
+  ASSERT_EQ(in_memory, out_of_core);
+}
+
+TEST_P(GraphTest, TestNumaPartitions) {
+  // the nodes are split into partitions with their own buffering systems and
+  // workers, which must give the same components as a single partition
+  int allow_fail = 2; // allow 2 failures
+  int fails = 0;
+  for (int num_partitions : {1, 2, 3}) {
+    write_configuration(GetParam(), 3, 2, false, num_partitions);
+    generate_stream();
+    ifstream in{"./sample.txt"};
+    node_id_t n;
+    edge_id_t m;
+    in >> n >> m;
+    Graph g{n};
+    int type, a, b;
+    while (m--) {
+      in >> type >> a >> b;
+      if (type == INSERT) {
+        g.update({{a, b}, INSERT});
+      } else g.update({{a, b}, DELETE});
+    }
+
+    g.set_verifier(std::make_unique<FileGraphVerifier>("./cumul_sample.txt"));
+    try {
+      g.connected_components();
+    } catch (OutOfQueriesException& err) {
+      fails++;
+      if (fails > allow_fail) {
+        printf("More than %i failures failing test\n", allow_fail);
+        throw;
+      }
+    }
+  }
+  write_configuration(GetParam());
+}
+
+TEST_P(GraphTest, TestMergeTrees) {
+  // a star, whose center absorbs many supernodes in one round, and a path,
+  // whose trees are long chains, must each be found as one component
+  write_configuration(GetParam());
+  node_id_t num_nodes = 1024;
+  node_id_t half = num_nodes / 2;
+  std::vector<bool> adj(num_nodes * (num_nodes - 1) / 2, false);
+  Graph g{num_nodes};
+  for (node_id_t i = 1; i < half; ++i) {
+    g.update({{0, i}, INSERT});
+    adj[MatGraphVerifier::get_uid(0, i)] = true;
+  }
+  for (node_id_t i = half; i + 1 < num_nodes; ++i) {
+    g.update({{i, i + 1}, INSERT});
+    adj[MatGraphVerifier::get_uid(i, i + 1)] = true;
+  }
+  g.set_verifier(std::make_unique<MatGraphVerifier>(num_nodes, adj));
+  ASSERT_EQ(2, g.connected_components().size());
+}
+
+TEST_P(GraphTest, TestNonDestructiveQuery) {
+  // a query which leaves the supernodes intact must let the graph be updated
+  // and queried again, as many times as we like
+  write_configuration(GetParam());
+  node_id_t num_nodes = 1024;
+  node_id_t half = num_nodes / 2;
+  std::vector<bool> adj(num_nodes * (num_nodes - 1) / 2, false);
+  Graph g{num_nodes};
+  for (node_id_t i = 1; i < half; ++i) {
+    g.update({{0, i}, INSERT});
+    adj[MatGraphVerifier::get_uid(0, i)] = true;
+  }
+  for (int q = 0; q < 2; ++q) {
+    g.set_verifier(std::make_unique<MatGraphVerifier>(num_nodes, adj));
+    ASSERT_EQ(1 + half, g.connected_component_labels(true).num_components);
+  }
+
+  for (node_id_t i = half; i + 1 < num_nodes; ++i) {
+    g.update({{i, i + 1}, INSERT});
+    adj[MatGraphVerifier::get_uid(i, i + 1)] = true;
+  }
+  g.set_verifier(std::make_unique<MatGraphVerifier>(num_nodes, adj));
+  ASSERT_EQ(2, g.connected_components(true).size());
+
+  g.update({{0, num_nodes - 1}, INSERT});
+  adj[MatGraphVerifier::get_uid(0, num_nodes - 1)] = true;
+  g.set_verifier(std::make_unique<MatGraphVerifier>(num_nodes, adj));
+  ASSERT_EQ(1, g.connected_components().size());
+}
+
+TEST_P(GraphTest, TestAsyncQuery) {
+  // an asynchronous query must see the graph as of the call, even as it is
+  // updated while the query runs
+  write_configuration(GetParam());
+  node_id_t num_nodes = 1024;
+  node_id_t half = num_nodes / 2;
+  std::vector<bool> adj(num_nodes * (num_nodes - 1) / 2, false);
+  Graph g{num_nodes};
+  for (node_id_t i = 1; i < half; ++i) {
+    g.update({{0, i}, INSERT});
+    adj[MatGraphVerifier::get_uid(0, i)] = true;
+  }
+  g.set_verifier(std::make_unique<MatGraphVerifier>(num_nodes, adj));
+  std::future<ComponentLabels> query = g.connected_component_labels_async();
+  std::vector<bool> later_adj = adj;
+  for (node_id_t i = half; i + 1 < num_nodes; ++i) {
+    g.update({{i, i + 1}, INSERT});
+    later_adj[MatGraphVerifier::get_uid(i, i + 1)] = true;
+  }
+  ASSERT_EQ(1 + half, query.get().num_components);
+
+  g.set_verifier(std::make_unique<MatGraphVerifier>(num_nodes, later_adj));
+  ASSERT_EQ(2, g.connected_component_labels_async().get().num_components);
+  // nothing was updated during the second query, so nothing had to be saved
+  ASSERT_EQ(0, g.get_last_query_saved());
+  g.set_verifier(std::make_unique<MatGraphVerifier>(num_nodes, later_adj));
+  ASSERT_EQ(2, g.connected_components().size());
+}
+
+TEST_P(GraphTest, TestIncrementalQuery) {
+  // a query after updates to one component must find the components again
+  // while keeping the others as the last query found them
+  write_configuration(GetParam());
+  node_id_t num_nodes = 1024;
+  node_id_t half = num_nodes / 2;
+  std::vector<bool> adj(num_nodes * (num_nodes - 1) / 2, false);
+  Graph g{num_nodes};
+  auto insert = [&](node_id_t a, node_id_t b) {
+    g.update({{a, b}, INSERT});
+    adj[MatGraphVerifier::get_uid(a, b)] = true;
+  };
+  auto remove = [&](node_id_t a, node_id_t b) {
+    g.update({{a, b}, DELETE});
+    adj[MatGraphVerifier::get_uid(a, b)] = false;
+  };
+  for (node_id_t i = 1; i < half; ++i) insert(0, i);
+  for (node_id_t i = half; i + 1 < num_nodes; ++i) insert(i, i + 1);
+  g.set_verifier(std::make_unique<MatGraphVerifier>(num_nodes, adj));
+  ComponentLabels before = g.connected_component_labels(true);
+  ASSERT_EQ(2, before.num_components);
+
+  // split the path in two, leaving the star untouched
+  remove(half + half / 2, half + half / 2 + 1);
+  g.set_verifier(std::make_unique<MatGraphVerifier>(num_nodes, adj));
+  ComponentLabels after = g.connected_component_labels(true);
+  ASSERT_EQ(3, after.num_components);
+  for (node_id_t i = 1; i < half; ++i) ASSERT_EQ(after.labels[0], after.labels[i]);
+
+  // join everything through the star
+  insert(0, half);
+  insert(0, num_nodes - 1);
+  g.set_verifier(std::make_unique<MatGraphVerifier>(num_nodes, adj));
+  ASSERT_EQ(1, g.connected_component_labels_async().get().num_components);
+
+  // a query with no updates since the last finds nothing to do
+  g.set_verifier(std::make_unique<MatGraphVerifier>(num_nodes, adj));
+  ASSERT_EQ(1, g.connected_components().size());
+}
+
+TEST_P(GraphTest, TestSpanningForest) {
+  write_configuration(GetParam());
+  node_id_t num_nodes = 1024;
+  node_id_t half = num_nodes / 2;
+  std::vector<bool> adj(num_nodes * (num_nodes - 1) / 2, false);
+  Graph g{num_nodes};
+  auto insert = [&](node_id_t a, node_id_t b) {
+    g.update({{a, b}, INSERT});
+    adj[MatGraphVerifier::get_uid(a, b)] = true;
+  };
+  // a star with extra edges between its leaves, and a path
+  for (node_id_t i = 1; i < half; ++i) insert(0, i);
+  for (node_id_t i = 1; i + 2 < half; i += 3) insert(i, i + 2);
+  for (node_id_t i = half; i + 1 < num_nodes; ++i) insert(i, i + 1);
+
+  // the forest must use only edges of the graph and connect its components
+  auto check_forest = [&](const std::vector<Edge> &forest, node_id_t num_components) {
+    ASSERT_EQ(num_nodes - num_components, forest.size());
+    DisjointSetUnion<node_id_t> dsu(num_nodes);
+    for (auto edge : forest) {
+      ASSERT_TRUE(adj[MatGraphVerifier::get_uid(edge.first, edge.second)]);
+      ASSERT_TRUE(dsu.union_set(edge.first, edge.second)); // no cycles
+    }
+    for (node_id_t i = 1; i < half; ++i) ASSERT_EQ(dsu.find_set(0), dsu.find_set(i));
+  };
+  g.set_verifier(std::make_unique<MatGraphVerifier>(num_nodes, adj));
+  check_forest(g.spanning_forest(true), 2);
+
+  // split the path and stream the forest to a file
+  g.update({{half, half + 1}, DELETE});
+  adj[MatGraphVerifier::get_uid(half, half + 1)] = false;
+  g.set_verifier(std::make_unique<MatGraphVerifier>(num_nodes, adj));
+  ASSERT_THROW(g.write_spanning_forest("./no_such_dir/forest.data", true), GraphFileException);
+  g.write_spanning_forest("./forest.data");
+
+  BinaryGraphStream stream("./forest.data", 1024 * 32);
+  ASSERT_EQ(num_nodes, stream.nodes());
+  std::vector<Edge> forest;
+  for (uint64_t e = 0; e < stream.edges(); ++e) {
+    GraphUpdate upd = stream.get_edge();
+    ASSERT_EQ(INSERT, upd.second);
+    forest.push_back(upd.first);
+  }
+  check_forest(forest, 3);
+}
+
+TEST_P(GraphTest, TestMultipleGraphs) {
+  // graphs of different sizes must be updated and queried side by side
+  write_configuration(GetParam(), 2, 2);
+  std::vector<node_id_t> sizes = {1024, 100, 4096};
+  std::vector<std::unique_ptr<Graph>> graphs;
+  std::vector<std::vector<bool>> adjs;
+  for (node_id_t num_nodes : sizes) {
+    graphs.push_back(std::make_unique<Graph>(num_nodes));
+    adjs.emplace_back(num_nodes * (num_nodes - 1) / 2, false);
+  }
+
+  // graph g is a path over the nodes which are 0 mod g + 2, leaving the
+  // others isolated
+  std::vector<std::thread> threads;
+  for (size_t g = 0; g < graphs.size(); ++g) {
+    threads.emplace_back([&, g]() {
+      node_id_t step = g + 2;
+      for (node_id_t i = 0; i + step < sizes[g]; i += step) {
+        graphs[g]->update({{i, i + step}, INSERT});
+        adjs[g][MatGraphVerifier::get_uid(i, i + step)] = true;
+      }
+    });
+  }
+  for (auto &thr : threads) thr.join();
+
+  std::vector<std::future<ComponentLabels>> queries;
+  for (size_t g = 0; g < graphs.size(); ++g) {
+    graphs[g]->set_verifier(std::make_unique<MatGraphVerifier>(sizes[g], adjs[g]));
+    queries.push_back(graphs[g]->connected_component_labels_async());
+  }
+  for (size_t g = 0; g < graphs.size(); ++g) {
+    node_id_t step = g + 2;
+    node_id_t on_path = (sizes[g] + step - 1) / step;
+    ASSERT_EQ(sizes[g] - on_path + 1, queries[g].get().num_components);
+  }
+}
+
+TEST_P(GraphTest, TestWorkerConfigPerGraph) {
+  // each graph keeps the workers it was configured with, and the helper
+  // threads the graphs share grow to what the largest of them asks for
+  write_configuration(GetParam(), 1, 1);
+  Graph small{100};
+  write_configuration(GetParam(), 2, 4);
+  Graph large{100};
+  ASSERT_EQ(1, small.worker_config.group_size);
+  ASSERT_EQ(1, small.workers->get_num_workers());
+  ASSERT_EQ(4, large.worker_config.group_size);
+  ASSERT_EQ(2, large.workers->get_num_workers());
+  ASSERT_GE(large.workers->get_num_helpers(-1), 2 * 3);
+  ASSERT_EQ(small.workers->get_num_helpers(-1), large.workers->get_num_helpers(-1));
+
+  std::vector<bool> adj(100 * 99 / 2, false);
+  adj[MatGraphVerifier::get_uid(1, 2)] = true;
+  for (Graph *g : {&small, &large}) {
+    g->update({{1, 2}, INSERT});
+    g->set_verifier(std::make_unique<MatGraphVerifier>(100, adj));
+    ASSERT_EQ(99, g->connected_components().size());
+  }
+}
+
+TEST_P(GraphTest, TestCheckpoint) {
+  // a checkpoint log must reheat to the graph as of its last checkpoint, even
+  // though the graph is updated while the checkpoint is written
+  write_configuration(GetParam());
+  node_id_t num_nodes = 1024;
+  node_id_t half = num_nodes / 2;
+  const std::string log = "./checkpoint.data";
+  std::vector<bool> adj(num_nodes * (num_nodes - 1) / 2, false);
+  Graph g{num_nodes};
+  auto insert = [&](node_id_t a, node_id_t b) {
+    g.update({{a, b}, INSERT});
+    adj[MatGraphVerifier::get_uid(a, b)] = true;
+  };
+  auto log_size = [&]() {
+    std::ifstream in(log, std::ios::binary | std::ios::ate);
+    return (size_t) in.tellg();
+  };
+  auto reheat = [&](std::vector<bool> expected) {
+    Graph reheated{log};
+    reheated.set_verifier(std::make_unique<MatGraphVerifier>(num_nodes, expected));
+    return reheated.connected_component_labels();
+  };
+
+  for (node_id_t i = 1; i < half; ++i) insert(0, i);
+  std::vector<bool> base_adj = adj;
+  std::future<void> base = g.checkpoint_async(log);
+  for (node_id_t i = half; i + 1 < num_nodes; ++i) insert(i, i + 1);
+  base.get();
+  size_t base_size = log_size();
+  ASSERT_EQ(1 + half, reheat(base_adj).num_components);
+
+  g.checkpoint_async(log).get();
+  ASSERT_EQ(2, reheat(adj).num_components);
+
+  // only the few supernodes updated since are appended
+  size_t before = log_size();
+  g.update({{half, half + 1}, DELETE});
+  adj[MatGraphVerifier::get_uid(half, half + 1)] = false;
+  insert(1, num_nodes - 1);
+  g.checkpoint_async(log).get();
+  ASSERT_LT(log_size() - before, base_size / 100);
+  ComponentLabels reheated = reheat(adj);
+  ASSERT_EQ(2, reheated.num_components);
+  ASSERT_EQ(reheated.labels[0], reheated.labels[num_nodes - 1]);
+  ASSERT_EQ(1, reheated.sizes[reheated.labels[half]]);
+}
+
+TEST_P(GraphTest, TestDumpFormat) {
+  // a dump is encoded sparsely and checksummed, its supernodes can be read one
+  // at a time, dumps of the first version still reheat, and only with the hash
+  // family they were written with
+  write_configuration(GetParam());
+  node_id_t num_nodes = 1024;
+  const std::string file = "./dump.data";
+  std::vector<bool> adj(num_nodes * (num_nodes - 1) / 2, false);
+  Graph g{num_nodes};
+  for (node_id_t i = 0; i + 1 < num_nodes; i += 2) {
+    g.update({{i, i + 1}, INSERT});
+    adj[MatGraphVerifier::get_uid(i, i + 1)] = true;
+  }
+  g.write_binary(file);
+  // the dump is written beside the file and renamed over it
+  ASSERT_FALSE(std::ifstream(file + ".tmp").good());
+  auto file_size = [](const std::string &name) {
+    std::ifstream in(name, std::ios::binary | std::ios::ate);
+    return (size_t) in.tellg();
+  };
+  size_t dump_size = file_size(file);
+  ASSERT_LT(dump_size * 3, num_nodes * g.geometry->binary_size);
+
+  {
+    GraphDump dump(file);
+    ASSERT_EQ(GraphDump::version, dump.get_version());
+    ASSERT_EQ(num_nodes, dump.get_num_nodes());
+    std::vector<char> expected(g.geometry->binary_size);
+    std::vector<char> read(g.geometry->binary_size);
+    Supernode *node = dump.read_supernode(7, malloc(g.geometry->bytes_size));
+    g.supernodes->get(7)->write_binary(expected.data());
+    node->write_binary(read.data());
+    ASSERT_EQ(expected, read);
+    free(node);
+  }
+
+  {
+    auto out = std::fstream("./dump_v1.data", std::ios::out | std::ios::binary);
+    // the first version left the high bytes of the number of nodes unset
+    uint64_t n = num_nodes | (uint64_t(0xdeadbeef) << 32);
+    int fail_factor = g.geometry->sketch.failure_factor;
+    out.write((char*)&g.seed, sizeof(long));
+    out.write((char*)&n, sizeof(uint64_t));
+    out.write((char*)&fail_factor, sizeof(int));
+    for (node_id_t i = 0; i < num_nodes; ++i) g.supernodes->get(i)->write_binary(out);
+  }
+  if (std::strcmp(Bucket_Boruvka::HashFamily::name(), "xxh32") == 0) {
+    Graph v1{"./dump_v1.data"};
+    v1.set_verifier(std::make_unique<MatGraphVerifier>(num_nodes, adj));
+    ASSERT_EQ(num_nodes / 2, v1.connected_component_labels().num_components);
+  } else {
+    ASSERT_THROW(Graph("./dump_v1.data"), HashFamilyException);
+  }
+  Graph v2{file};
+  v2.set_verifier(std::make_unique<MatGraphVerifier>(num_nodes, adj));
+  ASSERT_EQ(num_nodes / 2, v2.connected_component_labels().num_components);
+
+  // a flipped byte in the header, a block or the index fails to reheat
+  auto corrupt = [&](size_t offset) {
+    std::ifstream in(file, std::ios::binary);
+    std::vector<char> bytes(dump_size);
+    in.read(bytes.data(), dump_size);
+    bytes[offset] ^= 1;
+    std::ofstream("./dump_bad.data", std::ios::binary).write(bytes.data(), dump_size);
+  };
+  corrupt(20);
+  ASSERT_THROW(Graph("./dump_bad.data"), CorruptDumpException);
+  corrupt(sizeof(GraphDump::DumpHeader) + 100);
+  ASSERT_THROW(Graph("./dump_bad.data"), CorruptDumpException);
+  corrupt(dump_size - 20);
+  ASSERT_THROW(Graph("./dump_bad.data"), CorruptDumpException);
+
+  // so does a dump of another hash family, even with a good checksum
+  {
+    std::fstream io(file, std::ios::in | std::ios::out | std::ios::binary);
+    GraphDump::DumpHeader header;
+    io.read((char *) &header, sizeof(header));
+    std::memset(header.hash_family, 0, sizeof(header.hash_family));
+    std::strcpy(header.hash_family, "another");
+    header.checksum = XXH64(&header, offsetof(GraphDump::DumpHeader, checksum), 0);
+    io.seekp(0);
+    io.write((char *) &header, sizeof(header));
+  }
+  ASSERT_THROW(Graph{file}, HashFamilyException);
+
+  // the graph keeps taking updates and queries after a dump
+  g.update({{0, 2}, INSERT});
+  adj[MatGraphVerifier::get_uid(0, 2)] = true;
+  g.set_verifier(std::make_unique<MatGraphVerifier>(num_nodes, adj));
+  ASSERT_EQ(num_nodes / 2 - 1, g.connected_component_labels_async().get().num_components);
+}
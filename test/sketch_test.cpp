@@ -1,4 +1,7 @@
 #include "../include/l0_sampling/sketch.h"
+#include "../include/l0_sampling/hash_kernels.h"
+#include "../include/l0_sampling/xor_kernels.h"
+#include <algorithm>
 #include <chrono>
 #include <gtest/gtest.h>
 #include "../include/test/testing_vector.h"
@@ -17,13 +20,13 @@ TEST(SketchTestSuite, TestExceptions) {
    */
   Sketch::configure(100 * 100, fail_factor);
   SketchUniquePtr sketch2 = makeSketch(0);
-  std::vector<bool> vec_idx(sketch2->n, true);
+  std::vector<bool> vec_idx(sketch2->geometry->n, true);
   unsigned long long num_buckets = bucket_gen(fail_factor);
-  unsigned long long num_guesses = guess_gen(sketch2->n);
+  unsigned long long num_guesses = guess_gen(sketch2->geometry->n);
   for (unsigned long long i = 0; i < num_buckets; ++i) {
     for (unsigned long long j = 0; j < num_guesses;) {
       uint64_t index = 0;
-      for (uint64_t k = 0; k < sketch2->n; ++k) {
+      for (uint64_t k = 0; k < sketch2->geometry->n; ++k) {
         if (vec_idx[k] && Bucket_Boruvka::contains(Bucket_Boruvka::col_index_hash(i, k, sketch2->seed), 1 << j)) {
           if (index == 0) {
             index = k + 1;
@@ -41,7 +44,7 @@ TEST(SketchTestSuite, TestExceptions) {
       }
     }
   }
-  for (uint64_t i = 0; i < sketch2->n; ++i) {
+  for (uint64_t i = 0; i < sketch2->geometry->n; ++i) {
     if (vec_idx[i]) {
       sketch2->update(static_cast<vec_t>(i));
     }
@@ -290,6 +293,221 @@ TEST(SketchTestSuite, TestBatchUpdate) {
   ASSERT_EQ(*sketch, *sketch_batch);
 }
 
+TEST(SketchTestSuite, TestIndexDepth) {
+  srand(time(nullptr));
+  const unsigned num_guesses = 30;
+  for (int i = 0; i < 100000; ++i) {
+    col_hash_t col_index_hash = Bucket_Boruvka::col_index_hash(i % 7, rand(), rand());
+    unsigned expected = 0;
+    while (expected < num_guesses &&
+           Bucket_Boruvka::contains(col_index_hash, (vec_t) 1 << (expected + 1)))
+      ++expected;
+    ASSERT_EQ(expected, Bucket_Boruvka::get_index_depth(col_index_hash, num_guesses));
+  }
+  ASSERT_EQ(num_guesses, Bucket_Boruvka::get_index_depth(0, num_guesses));
+  ASSERT_EQ(3, Bucket_Boruvka::get_index_depth(8, num_guesses));
+}
+
+TEST(SketchTestSuite, TestBatchHashing) {
+  srand(time(nullptr));
+  // not a multiple of the vector width so the kernels' tails are exercised
+  const size_t num_updates = 100003;
+  std::vector<vec_t> updates(num_updates);
+  for (auto& update : updates) {
+    update = ((vec_t) rand() << 32) | (vec_t) rand();
+  }
+  std::vector<vec_hash_t> hashes(num_updates);
+  std::vector<col_hash_t> col_hashes(num_updates);
+
+  for (long seed : {0L, (long) rand(), -(long) rand(), 7000000001L}) {
+    Bucket_Boruvka::index_hash_batch(updates.data(), num_updates, seed, hashes.data());
+    for (size_t k = 0; k < num_updates; ++k) {
+      ASSERT_EQ(hashes[k], Bucket_Boruvka::index_hash(updates[k], seed));
+    }
+    for (unsigned col = 0; col < 8; ++col) {
+      Bucket_Boruvka::col_index_hash_batch(col, updates.data(), num_updates, seed, col_hashes.data());
+      for (size_t k = 0; k < num_updates; ++k) {
+        ASSERT_EQ(col_hashes[k], Bucket_Boruvka::col_index_hash(col, updates[k], seed));
+      }
+    }
+  }
+}
+
+/**
+ * Time the hashes of a family over a batch of edge indices, as a sketch with
+ * num_cols columns computes them, and check that the depths of the indices,
+ * i.e. the trailing zeros of their column hashes, are geometrically distributed.
+ */
+template <class Family>
+void benchmark_hash_family(const std::vector<vec_t>& updates, unsigned num_cols) {
+  long seed = rand();
+  std::vector<vec_hash_t> hashes(updates.size());
+  std::vector<col_hash_t> col_hashes(updates.size() * num_cols);
+  auto start_time = std::chrono::steady_clock::now();
+  for (size_t k = 0; k < updates.size(); ++k) {
+    hashes[k] = Family::index_hash(updates[k], seed);
+  }
+  for (unsigned col = 0; col < num_cols; ++col) {
+    for (size_t k = 0; k < updates.size(); ++k) {
+      col_hashes[col * updates.size() + k] = Family::col_index_hash(col, updates[k], seed);
+    }
+  }
+  long double secs = static_cast<std::chrono::duration<long double>>(std::chrono::steady_clock::now() - start_time).count();
+  std::cout << Family::name() << ": " << secs * 1e9 / updates.size() << " ns per update" << std::endl;
+
+  const unsigned max_depth = 8;
+  std::vector<size_t> at_least(max_depth + 1);
+  for (col_hash_t h : col_hashes) {
+    unsigned depth = Bucket_Boruvka::get_index_depth(h, max_depth);
+    for (unsigned d = 0; d <= depth; ++d) ++at_least[d];
+  }
+  for (unsigned d = 1; d <= max_depth; ++d) {
+    double expected = (double) col_hashes.size() / (1 << d);
+    EXPECT_NEAR(at_least[d], expected, 0.05 * expected) << Family::name() << " depth " << d;
+  }
+}
+
+TEST(SketchTestSuite, TestHashFamilies) {
+  srand(time(nullptr));
+  // the edges of a graph on 2^16 nodes, which only use 32 bits of the index
+  const size_t num_updates = 1000000;
+  std::vector<vec_t> updates(num_updates);
+  for (auto& update : updates) {
+    node_id_t a = rand() % (1 << 16), b = rand() % (1 << 16);
+    update = nondirectional_non_self_edge_pairing_fn(a, b == a ? a ^ 1 : b);
+  }
+  Sketch::configure((vec_t) 1 << 32, fail_factor);
+  unsigned num_cols = Sketch::get_num_buckets();
+  std::cout << "Sketches hash with " << Bucket_Boruvka::HashFamily::name() << std::endl;
+  benchmark_hash_family<Bucket_Boruvka::XXH32Hash>(updates, num_cols);
+  benchmark_hash_family<Bucket_Boruvka::XXH3Hash>(updates, num_cols);
+  benchmark_hash_family<Bucket_Boruvka::MultiplyShiftHash>(updates, num_cols);
+  benchmark_hash_family<Bucket_Boruvka::TabulationHash>(updates, num_cols);
+  benchmark_hash_family<Bucket_Boruvka::FusedHash>(updates, num_cols);
+
+  std::vector<vec_hash_t> hashes(num_updates);
+  auto start_time = std::chrono::steady_clock::now();
+  Bucket_Boruvka::index_hash_batch(updates.data(), num_updates, 0, hashes.data());
+  for (unsigned col = 0; col < num_cols; ++col) {
+    Bucket_Boruvka::col_index_hash_batch(col, updates.data(), num_updates, 0, hashes.data());
+  }
+  long double secs = static_cast<std::chrono::duration<long double>>(std::chrono::steady_clock::now() - start_time).count();
+  std::cout << "batched " << Bucket_Boruvka::HashFamily::name() << " (" << Bucket_Boruvka::hash_kernel_name() << "): " << secs * 1e9 / num_updates << " ns per update" << std::endl;
+}
+
+TEST(SketchTestSuite, TestBatchUpdateRun) {
+  srand(time(nullptr));
+  const size_t num_sketches = 20;
+  const vec_t vec_size = (vec_t) 1 << 34;
+  Sketch::configure(vec_size, fail_factor);
+  const size_t stride = Sketch::sketchSizeof();
+  long seed = rand();
+  std::vector<char> run(num_sketches * stride), run_expected(num_sketches * stride);
+  for (size_t s = 0; s < num_sketches; ++s) {
+    Sketch::makeSketch(&run[s * stride], seed + s);
+    Sketch::makeSketch(&run_expected[s * stride], seed + s);
+  }
+
+  // not a multiple of the hashing block size
+  std::vector<vec_t> updates(1000);
+  for (auto& update : updates) {
+    update = ((vec_t) rand() << 32 | rand()) % vec_size;
+  }
+  Sketch::batch_update_run((Sketch *) run.data(), num_sketches, stride,
+                           updates.data(), updates.size());
+  for (size_t s = 0; s < num_sketches; ++s) {
+    for (vec_t update : updates) {
+      ((Sketch *) &run_expected[s * stride])->update(update);
+    }
+    ASSERT_EQ(*(Sketch *) &run[s * stride], *(Sketch *) &run_expected[s * stride]);
+  }
+
+  // collecting the touches of the run and applying them undoes the updates
+  std::vector<BucketTouch> touches(num_sketches * Sketch::get_num_elems() * updates.size());
+  size_t num_touches = Sketch::collect_run_touches(seed, num_sketches, updates.data(),
+                           updates.size(), touches.data(), touches.size());
+  ASSERT_LE(num_touches, touches.size());
+  for (size_t t = 0; t < num_touches; ++t) {
+    ((Sketch *) &run[touches[t].sketch * stride])->apply_touch(touches[t]);
+  }
+  for (size_t s = 0; s < num_sketches; ++s) {
+    Sketch *sketch = (Sketch *) &run[s * stride];
+    ASSERT_EQ(sketch->query().second, ZERO);
+  }
+  ASSERT_EQ(Sketch::collect_run_touches(seed, num_sketches, updates.data(),
+                updates.size(), touches.data(), 10), 11u);
+}
+
+TEST(SketchTestSuite, TestFixedGeometry) {
+  srand(time(nullptr));
+  const size_t num_sketches = 100, num_updates = 100;
+  for (unsigned log_n = 13; log_n <= 20; ++log_n) {
+    vec_t n = (vec_t) 1 << log_n;
+    Sketch::configure(n * n, fail_factor);
+    ASSERT_STREQ(Sketch::get_kernel_name(), "fixed");
+    std::vector<vec_t> updates(num_sketches * num_updates);
+    for (auto& update : updates) {
+      update = (((vec_t) rand() << 32) | (vec_t) rand()) % (n * n);
+    }
+    long seed = rand();
+
+    // each operation over the same sketches must agree with either kernels
+    std::vector<SketchUniquePtr> sketches[2], batched[2];
+    std::vector<std::pair<vec_t, SampleSketchRet>> results[2];
+    for (int fixed = 0; fixed < 2; ++fixed) {
+      Sketch::select_kernels(fixed);
+      for (size_t i = 0; i < num_sketches; ++i) {
+        sketches[fixed].push_back(makeSketch(seed + i));
+        batched[fixed].push_back(makeSketch(seed + i));
+        for (size_t j = 0; j < num_updates; ++j) {
+          sketches[fixed][i]->update(updates[i * num_updates + j]);
+        }
+        batched[fixed][i]->batch_update(&updates[i * num_updates], num_updates);
+        results[fixed].push_back(sketches[fixed][i]->query());
+      }
+    }
+    Sketch::select_kernels();
+
+    for (size_t i = 0; i < num_sketches; ++i) {
+      ASSERT_EQ(*sketches[0][i], *sketches[1][i]);
+      ASSERT_EQ(*batched[0][i], *batched[1][i]);
+      ASSERT_EQ(results[0][i], results[1][i]);
+    }
+  }
+}
+
+TEST(SketchTestSuite, TestXorRows) {
+  srand(time(nullptr));
+  // lengths around the vector widths so the kernels' tails are exercised
+  for (size_t row_bytes : {4, 12, 60, 64, 100, 252, 256, 300, 1036}) {
+    for (size_t stride : {row_bytes, row_bytes + 36}) {
+      size_t num_rows = 5;
+      std::vector<char> dst(num_rows * stride), src(num_rows * stride);
+      for (auto& c : dst) c = (char) rand();
+      for (auto& c : src) c = (char) rand();
+      std::vector<char> expected = dst;
+      for (size_t i = 0; i < num_rows; ++i) {
+        for (size_t k = 0; k < row_bytes; ++k) {
+          expected[i * stride + k] ^= src[i * stride + k];
+        }
+      }
+      std::vector<char> cleared = src;
+      for (size_t i = 0; i < num_rows; ++i) {
+        std::fill_n(cleared.begin() + i * stride, row_bytes, 0);
+      }
+      std::vector<char> dst_clear = dst, src_clear = src;
+      Bucket_Boruvka::xor_rows(dst.data(), src.data(), num_rows, row_bytes, stride);
+      ASSERT_EQ(dst, expected) << "row_bytes " << row_bytes << " stride " << stride;
+
+      // xor_and_clear_rows must give the same rows and zero those of src
+      Bucket_Boruvka::xor_and_clear_rows(dst_clear.data(), src_clear.data(), num_rows,
+                                         row_bytes, stride);
+      ASSERT_EQ(dst_clear, expected) << "row_bytes " << row_bytes << " stride " << stride;
+      ASSERT_EQ(src_clear, cleared) << "row_bytes " << row_bytes << " stride " << stride;
+    }
+  }
+}
+
 TEST(SketchTestSuite, TestSerialization) {
   printf("starting test!\n");
   unsigned long vec_size = 1024*1024;
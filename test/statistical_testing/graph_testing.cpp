@@ -1,4 +1,6 @@
 #include <iostream>
+#include <random>
+#include <unordered_set>
 #include "../../include/graph.h"
 #include "../../include/test/graph_gen.h"
 #include "../../include/test/write_configuration.h"
@@ -44,11 +46,55 @@ int medium_graph_test(int runs) {
     return failures;
 }
 
-int main() {
+/*
+ * Queries the sketch of the neighborhood of a node in a graph on 1024 nodes,
+ * as a supernode does, and counts the runs in which the sketch fails or
+ * returns an index which is not in the neighborhood. This isolates the failure
+ * probability of a single sketch, which depends on the hash family.
+ */
+int sketch_test(int runs, std::mt19937_64 &rng) {
+    const node_id_t num_nodes = 1024;
+    Supernode::configure(num_nodes);
+    std::vector<char> buffer(Sketch::sketchSizeof());
+    int failures = 0;
+    for (int i = 0; i < runs; i++) {
+        Sketch *sketch = Sketch::makeSketch(buffer.data(), rng());
+        node_id_t node = rng() % num_nodes;
+        node_id_t degree = 1 + rng() % (num_nodes - 1);
+        std::unordered_set<vec_t> neighborhood;
+        while (neighborhood.size() < degree) {
+            node_id_t other = rng() % num_nodes;
+            if (other == node) continue;
+            vec_t idx = nondirectional_non_self_edge_pairing_fn(node, other);
+            if (neighborhood.insert(idx).second) sketch->update(idx);
+        }
+        std::pair<vec_t, SampleSketchRet> ret = sketch->query();
+        if (ret.second != GOOD || neighborhood.count(ret.first) == 0) failures++;
+    }
+    return failures;
+}
+
+int main(int argc, char** argv) {
     int runs = 100;
-    int num_trails = 500;
+    int num_trails = argc > 1 ? std::stoi(argv[1]) : 500;
     std::vector<int> trial_list;
     std::ofstream out;
+    fprintf(stderr, "Sketches hash with %s\n", Bucket_Boruvka::HashFamily::name());
+
+    /************* sketch test ******************/
+    // independent of the buffering system so only run once
+    std::mt19937_64 rng(std::random_device{}());
+    fprintf(stderr, "sketch_test\n");
+    out.open("./sketch_test");
+    for(int i = 0; i < num_trails; i++) {
+        if (i % 50 == 0) fprintf(stderr, "trial %i\n", i);
+        trial_list.push_back(sketch_test(runs, rng));
+    }
+    for (unsigned i = 0; i < trial_list.size(); i++) {
+        out << trial_list[i] << " " << runs << "\n";
+    }
+    trial_list.clear();
+    out.close();
 
     // run both with GutterTree and StandAloneGutters
     for(int i = 0; i < 2; i++) { 
@@ -101,6 +101,15 @@ if __name__ == "__main__":
 	# Run the tests
 	run_test(build_path)
 
+	# The sketch test does not depend upon the buffering system
+	try:
+		print("sketch test")
+		sketch_err, sketch_dsc = check_error('sketch test', 'sketch_test', stat_path + '/sketch_test_expected.txt')
+	except Exception as err:
+		sketch_err = True
+		sketch_dsc = "test threw expection: {0}".format(err)
+	log += log_result('sketch test', sketch_err, sketch_dsc) + "\n"
+
 	for pre in ["tree", "gutters"]:
 		if pre == "tree":
 			log += "GutterTree\n"
@@ -127,4 +136,4 @@ if __name__ == "__main__":
 		log += log_result('medium test', medium_err, medium_dsc) + "\n"
 
 	print("Sending email!")
-	send_email(small_err or medium_err, log, usr, pwd)
+	send_email(sketch_err or small_err or medium_err, log, usr, pwd)
@@ -3,6 +3,8 @@
 #include <chrono>
 #include <thread>
 #include "../include/supernode.h"
+#include "../include/supernode_arena.h"
+#include "../include/supernode_snapshot.h"
 #include "../include/graph_worker.h"
 
 const long seed = 7000000001;
@@ -157,7 +159,7 @@ TEST_F(SupernodeTestSuite, TestSampleDeleteGrinder) {
 }
 
 void inline apply_delta_to_node(Supernode* node, const std::vector<vec_t>& updates) {
-  auto* loc = (Supernode*) malloc(Supernode::get_size());
+  auto* loc = (Supernode*) malloc(Supernode::get_delta_size());
   Supernode::delta_supernode(node->n, node->seed, updates, loc);
   node->apply_delta_update(loc);
   free(loc);
@@ -234,6 +236,291 @@ TEST_F(SupernodeTestSuite, TestConcurrency) {
   }
 }
 
+TEST_F(SupernodeTestSuite, TestPooledBatchUpdate) {
+  unsigned long vec_size = 1000000000, num_updates = 10000;
+  srand(time(nullptr));
+  std::vector<vec_t> updates(num_updates);
+  for (unsigned long i = 0; i < num_updates; i++) {
+    updates[i] = static_cast<vec_t>(rand() % vec_size);
+  }
+  auto seed = rand();
+  Supernode::configure(vec_size);
+  Supernode* supernode = Supernode::makeSupernode(vec_size, seed);
+  Supernode* supernode_pooled = Supernode::makeSupernode(vec_size, seed);
+  for (const auto& update : updates) {
+    supernode->update(update);
+  }
+
+  ThreadPool pool(3);
+  auto* loc = (Supernode*) malloc(Supernode::get_delta_size());
+  Supernode::delta_supernode(vec_size, seed, updates, loc, &pool);
+  supernode_pooled->apply_delta_update(loc);
+  free(loc);
+
+  for (int i=0;i<supernode->get_num_sktch();++i) {
+    ASSERT_EQ(*supernode->get_sketch(i), *supernode_pooled->get_sketch(i));
+  }
+}
+
+TEST_F(SupernodeTestSuite, TestSparseDelta) {
+  unsigned long vec_size = 100000;
+  Supernode::configure(vec_size);
+  auto seed = rand();
+  auto* loc = (Supernode*) malloc(Supernode::get_delta_size());
+
+  // batches around the sparse limit must produce the same supernode as
+  // applying their updates one by one, whichever representation is chosen
+  for (unsigned long batch_size : {0, 1, 2, 4, 16, 1000}) {
+    std::vector<vec_t> updates(batch_size);
+    for (auto& update : updates) {
+      update = static_cast<vec_t>(rand() % (vec_size * vec_size));
+    }
+    Supernode* supernode = Supernode::makeSupernode(vec_size, seed);
+    Supernode* supernode_delta = Supernode::makeSupernode(vec_size, seed);
+    for (const auto& update : updates) {
+      supernode->update(update);
+    }
+    Supernode::delta_supernode(vec_size, seed, updates, loc);
+    if (batch_size <= 2) {
+      ASSERT_TRUE(loc->sparse);
+    }
+    if (batch_size == 1000) {
+      ASSERT_FALSE(loc->sparse);
+    }
+    supernode_delta->apply_delta_update(loc);
+
+    for (int i = 0; i < supernode->get_num_sktch(); ++i) {
+      ASSERT_EQ(*supernode->get_sketch(i), *supernode_delta->get_sketch(i));
+    }
+    free(supernode);
+    free(supernode_delta);
+  }
+  free(loc);
+}
+
+TEST_F(SupernodeTestSuite, TestReusableDelta) {
+  unsigned long vec_size = 100000;
+  Supernode::configure(vec_size);
+  auto seed = rand();
+  auto* loc = malloc(Supernode::get_delta_size());
+  Supernode* delta = Supernode::makeDeltaSupernode(loc, vec_size, seed);
+  Supernode* empty = Supernode::makeSupernode(vec_size, seed);
+
+  // one delta reused for batches of either representation must give the same
+  // supernode as applying their updates one by one, and be left empty
+  Supernode* supernode = Supernode::makeSupernode(vec_size, seed);
+  Supernode* supernode_delta = Supernode::makeSupernode(vec_size, seed);
+  for (unsigned long batch_size : {1000, 2, 5000, 0, 16, 1000, 3}) {
+    std::vector<vec_t> updates(batch_size);
+    for (auto& update : updates) {
+      update = static_cast<vec_t>(rand() % (vec_size * vec_size));
+      supernode->update(update);
+    }
+    delta->build_delta(updates);
+    supernode_delta->apply_and_clear_delta(delta);
+    for (int i = 0; i < supernode->get_num_sktch(); ++i) {
+      ASSERT_EQ(*supernode->get_sketch(i), *supernode_delta->get_sketch(i));
+      ASSERT_EQ(*empty->get_sketch(i), *delta->get_sketch(i));
+    }
+  }
+
+  // a delta applied without clearing it is reset by the next build
+  std::vector<vec_t> updates(1000);
+  for (auto& update : updates) {
+    update = static_cast<vec_t>(rand() % (vec_size * vec_size));
+    supernode->update(update);
+  }
+  delta->build_delta(updates);
+  supernode_delta->apply_delta_update(delta);
+  updates.resize(2000);
+  for (auto& update : updates) {
+    update = static_cast<vec_t>(rand() % (vec_size * vec_size));
+    supernode->update(update);
+  }
+  delta->build_delta(updates);
+  supernode_delta->apply_and_clear_delta(delta);
+  for (int i = 0; i < supernode->get_num_sktch(); ++i) {
+    ASSERT_EQ(*supernode->get_sketch(i), *supernode_delta->get_sketch(i));
+  }
+  free(supernode);
+  free(supernode_delta);
+  free(empty);
+  free(loc);
+}
+
+TEST_F(SupernodeTestSuite, TestHubContention) {
+  unsigned long vec_size = 100000, num_batches = 100;
+  Supernode::configure(vec_size);
+  auto seed = rand();
+  const unsigned num_threads = std::max(4u, std::thread::hardware_concurrency());
+  const unsigned num_hubs = 2;
+
+  // every thread applies dense and sparse deltas to the same few hubs, which
+  // must end up as if their updates were applied one by one
+  std::vector<std::vector<std::vector<vec_t>>> batches(num_threads,
+      std::vector<std::vector<vec_t>>(num_batches));
+  std::vector<Supernode*> expected(num_hubs), hubs(num_hubs);
+  for (unsigned h = 0; h < num_hubs; ++h) {
+    expected[h] = Supernode::makeSupernode(vec_size, seed);
+    hubs[h] = Supernode::makeSupernode(vec_size, seed);
+  }
+  for (unsigned t = 0; t < num_threads; ++t) {
+    for (unsigned long b = 0; b < num_batches; ++b) {
+      batches[t][b].resize(b % 2 ? 3 : 500);
+      for (auto& update : batches[t][b]) {
+        update = static_cast<vec_t>(rand() % (vec_size * vec_size));
+        expected[b % num_hubs]->update(update);
+      }
+    }
+  }
+
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&, t]() {
+      Supernode* delta = Supernode::makeDeltaSupernode(malloc(Supernode::get_delta_size()),
+          vec_size, seed);
+      for (unsigned long b = 0; b < num_batches; ++b) {
+        delta->build_delta(batches[t][b]);
+        hubs[b % num_hubs]->apply_and_clear_delta(delta);
+      }
+      free(delta);
+    });
+  }
+  for (auto& thread : threads) thread.join();
+
+  for (unsigned h = 0; h < num_hubs; ++h) {
+    for (int i = 0; i < expected[h]->get_num_sktch(); ++i) {
+      ASSERT_EQ(*expected[h]->get_sketch(i), *hubs[h]->get_sketch(i));
+    }
+    free(hubs[h]);
+    free(expected[h]);
+  }
+}
+
+TEST_F(SupernodeTestSuite, TestMergeBandwidth) {
+  unsigned long vec_size = 100000, num_updates = 10000;
+  Supernode::configure(vec_size);
+  auto seed = rand();
+
+  // sketches are linear, so merging the sketches of two halves of a stream
+  // must give the sketch of the whole stream
+  Supernode* whole = Supernode::makeSupernode(vec_size, seed);
+  Supernode* first = Supernode::makeSupernode(vec_size, seed);
+  Supernode* second = Supernode::makeSupernode(vec_size, seed);
+  for (unsigned long i = 0; i < num_updates; i++) {
+    vec_t update = static_cast<vec_t>(rand() % (vec_size * vec_size));
+    whole->update(update);
+    (i % 2 ? first : second)->update(update);
+  }
+  first->merge(*second);
+  for (int i = 0; i < whole->get_num_sktch(); ++i) {
+    ASSERT_EQ(*whole->get_sketch(i), *first->get_sketch(i));
+  }
+  free(whole);
+  free(first);
+  free(second);
+}
+
+TEST_F(SupernodeTestSuite, TestArena) {
+  unsigned long vec_size = 100000, num_updates = 1000;
+  Supernode::configure(vec_size);
+  auto seed = rand();
+  HugePages default_pages = SupernodeArena::get_huge_pages();
+
+  // supernodes in an arena of each kind of page, or out of core, behave as
+  // malloc'd ones, in cache line aligned slots. Reserved hugepages may fall
+  // back.
+  std::vector<std::pair<HugePages, bool>> kinds = {{NO_HUGEPAGES, false},
+      {TRANSPARENT, false}, {HUGEPAGES_2MB, false}, {NO_HUGEPAGES, true}};
+  for (auto kind : kinds) {
+    HugePages pages = kind.first;
+    SupernodeArena::set_huge_pages(pages);
+    SupernodeArena::set_storage(kind.second, "./");
+    node_id_t num_slots = 16;
+    SupernodeArena arena(num_slots);
+    ASSERT_EQ(arena.is_on_disk(), kind.second);
+    ASSERT_TRUE(arena.get_backing() == pages || arena.get_backing() == TRANSPARENT);
+    ASSERT_GE(arena.get_slot_size(), Supernode::get_size());
+    // ranges split at a page boundary share only the page of one slot
+    size_t page = arena.get_page_size();
+    for (node_id_t i = 0; i <= num_slots; ++i) {
+      node_id_t boundary = arena.page_boundary(i);
+      ASSERT_GE(boundary, i);
+      if (boundary == i || boundary == num_slots) continue;
+      size_t page_start = (i * arena.get_slot_size() + page - 1) / page * page;
+      ASSERT_GE(boundary * arena.get_slot_size(), page_start);
+      ASSERT_LT((boundary - 1) * arena.get_slot_size(), page_start);
+    }
+    Supernode* supernode = Supernode::makeSupernode(vec_size, seed);
+    for (node_id_t i = 0; i < num_slots; ++i) {
+      ASSERT_EQ((uintptr_t) arena.slot(i) % 64, 0);
+      Supernode::makeSupernode(arena.slot(i), vec_size, seed);
+    }
+    for (unsigned long j = 0; j < num_updates; ++j) {
+      vec_t update = static_cast<vec_t>(rand() % (vec_size * vec_size));
+      supernode->update(update);
+      for (node_id_t i = 0; i < num_slots; ++i) arena.get(i)->update(update);
+    }
+    for (node_id_t i = 0; i < num_slots; ++i) {
+      for (int k = 0; k < supernode->get_num_sktch(); ++k) {
+        ASSERT_EQ(*supernode->get_sketch(k), *arena.get(i)->get_sketch(k));
+      }
+    }
+    free(supernode);
+  }
+  SupernodeArena::set_huge_pages(default_pages);
+  SupernodeArena::set_storage(false);
+}
+
+TEST_F(SupernodeTestSuite, TestSnapshot) {
+  unsigned long vec_size = 100000, num_updates = 1000;
+  const node_id_t num_snodes = 64;
+  Supernode::configure(vec_size);
+  auto seed = rand();
+  SupernodeArena arena(num_snodes);
+  std::vector<Supernode*> expected(num_snodes);
+  for (node_id_t i = 0; i < num_snodes; ++i) {
+    Supernode::makeSupernode(arena.slot(i), vec_size, seed);
+    expected[i] = Supernode::makeSupernode(vec_size, seed);
+    for (unsigned long j = 0; j < num_updates; ++j) {
+      vec_t update = static_cast<vec_t>(rand() % (vec_size * vec_size));
+      arena.get(i)->update(update);
+      expected[i]->update(update);
+    }
+  }
+
+  // readers must see the supernodes as of the snapshot while a writer keeps
+  // saving and changing every other one of them
+  SupernodeSnapshot snapshot(&arena);
+  std::vector<vec_t> updates(num_updates);
+  for (auto& update : updates) update = static_cast<vec_t>(rand() % (vec_size * vec_size));
+  std::atomic<bool> done(false);
+  std::thread writer([&]() {
+    auto* delta = Supernode::makeDeltaSupernode(malloc(Supernode::get_delta_size()), vec_size, seed);
+    for (int r = 0; r < 5; ++r) {
+      for (node_id_t i = 0; i < num_snodes; i += 2) {
+        delta->build_delta(updates);
+        snapshot.save(i);
+        arena.get(i)->apply_and_clear_delta(delta);
+      }
+    }
+    free(delta);
+    done = true;
+  });
+  do {
+    for (node_id_t i = 0; i < num_snodes; ++i) {
+      snapshot.read(i, [&](const Supernode &node) {
+        for (int s = 0; s < node.get_num_sktch(); ++s) {
+          ASSERT_EQ(*expected[i]->get_sketch(s), *node.get_sketch(s));
+        }
+      });
+    }
+  } while (!done);
+  writer.join();
+  ASSERT_EQ(num_snodes / 2, snapshot.get_num_saved());
+  for (auto& snode : expected) free(snode);
+}
+
 TEST_F(SupernodeTestSuite, TestSerialization) {
   vector<Supernode*> snodes;
   snodes.reserve(num_nodes);
@@ -261,4 +548,21 @@ TEST_F(SupernodeTestSuite, TestSerialization) {
   for (int i = 0; i < snodes[num_nodes / 2]->get_num_sktch(); ++i) {
     ASSERT_EQ(*snodes[num_nodes / 2]->get_sketch(i), *reheated->get_sketch(i));
   }
+
+  // serializing to memory writes the same bytes as to a stream
+  const SupernodeGeometry &geometry = Supernode::get_default_geometry();
+  std::vector<char> from_file(geometry.binary_size);
+  std::vector<char> from_memory(geometry.binary_size);
+  in_file.seekg(0);
+  in_file.read(from_file.data(), from_file.size());
+  ASSERT_TRUE(in_file);
+  snodes[num_nodes / 2]->write_binary(from_memory.data());
+  ASSERT_EQ(from_file, from_memory);
+
+  Supernode* reheated_from_memory = Supernode::makeSupernode(
+      malloc(Supernode::get_size()), geometry, seed, from_memory.data());
+  for (int i = 0; i < snodes[num_nodes / 2]->get_num_sktch(); ++i) {
+    ASSERT_EQ(*snodes[num_nodes / 2]->get_sketch(i), *reheated_from_memory->get_sketch(i));
+  }
+  free(reheated_from_memory);
 }
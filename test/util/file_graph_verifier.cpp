@@ -28,12 +28,13 @@ std::vector<std::set<node_id_t>> FileGraphVerifier::kruskal(const string& input_
   edge_id_t m;
   in >> n >> m;
   DisjointSetUnion<node_id_t> sets(n);
-  int a,b;
-  while (m--) {
-    in >> a >> b;
-    sets.union_set(a,b);
-  }
+  std::vector<Edge> edges(m);
+  for (auto &edge : edges) in >> edge.first >> edge.second;
   in.close();
+  #pragma omp parallel for default(none) shared(edges, sets)
+  for (size_t i = 0; i < edges.size(); i++) { // NOLINT(modernize-loop-convert)
+    sets.union_set(edges[i].first, edges[i].second);
+  }
 
   std::map<node_id_t, std::set<node_id_t>> temp;
   for (unsigned i = 0; i < n; ++i) {
@@ -14,6 +14,7 @@ std::vector<std::set<node_id_t>> MatGraphVerifier::kruskal(node_id_t n, const st
   DisjointSetUnion<node_id_t> sets(n);
 
   uint64_t num_edges = n * (n - 1) / 2;
+  #pragma omp parallel for default(none) shared(input, sets, num_edges)
   for (uint64_t i = 0; i < num_edges; i++) {
     if (input[i]) {
       Edge e = inv_uid(i);